@@ -21,21 +21,48 @@
 #include <X11/cursorfont.h>
 #include <X11/Xlocale.h>
 #include <X11/extensions/Xrender.h>
+#ifdef HAVE_XI2
+#include <X11/extensions/XInput2.h>
+#endif
+#ifdef HAVE_XRANDR
+#include <X11/extensions/Xrandr.h>
+#endif
+#ifdef HAVE_XPRESENT
+#include <X11/extensions/Xpresent.h>
+#endif
+#ifdef ZPEN_BENCH
+#include <dirent.h>
+#endif
+#include <pthread.h>
+#include <regex.h>
 #include <signal.h>
 #include <time.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <ctype.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <pwd.h>
 #include <unistd.h>
 #include <locale.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #define PI 3.14159265358979323846 /* pi */
 #define MAX_COLORS 9
@@ -45,9 +72,37 @@
 #define UNDO_MAX 20
 #define ARROW_SIZE 20
 #define ARROW_DIRECTION_SAMPLES 10
-#define BLUR_RADIUS 1
-#define BLUR_BRUSH 18
+#define BLUR_RADIUS 6      // default blur strength, radius of each box pass
+#define BLUR_RADIUS_MAX 48
+#define BLUR_BRUSH 32      // default blur brush size
+#define BLUR_BRUSH_MIN 8
+#define BLUR_BRUSH_MAX 256
+#define BLUR_PASSES 3      // box passes approximating a Gaussian
+#define PIXELATE_BRUSH 36
+#define PIXELATE_BLOCK 12 // default pixelate cell size, 'x' tool
+#define TILE_SIZE 256      // side of the tiles large areas are filtered in
+#define TOUCH_CELL 32      // granularity of the map of annotated screen areas
+#define REDACT_PATTERNS_MAX 16
+#define REDACT_SCALE 2     // upscale of text redaction OCR input
+#define OCR_STRIP_MIN 160  // shortest strip of a parallel OCR run, in pixels
+#define OCR_STRIP_OVERLAP 48 // fewest rows neighbouring strips share; half a strip when more
+#define PNG_STRIP_ROWS 64  // fewest rows a thread of the PNG encoder deflates
+#define JPEG_QUALITY 90
+#define PNG_COMPRESSION_LEVEL 8 // stb's default: match candidates kept per hash
+#define QOI_PIXELS_MAX 400000000 // largest image the QOI decoder accepts
+#define SNAP_HOLD_MS 400    // hold the pen still this long before release to snap
+#define SNAP_HOLD_SLOP 4    // pixels of jitter tolerated while holding
+#define SNAP_TOLERANCE 0.12 // max normalized fit error accepted as a primitive
 #define TEXT_FONT_SIZE 18
+#define MAX_TOUCHES 10
+#define FRAME_RATE_DEFAULT 60 // used when the monitor refresh rate is unknown
+#define PRESENT_BUFFERS 3     // scratch pixmaps cycled through the Present extension
+#define PRESENT_TIMEOUT_MS 100 // wait for a frame before drawing over it anyway
+#define DAMAGE_MAX 8          // dirty rectangles tracked before they are merged
+#define REMOTE_FRAME_RATE 30  // frame rate cap when the display is remote
+#define REMOTE_BLUR_LEVELS 5  // max halvings of the server-side blur
+#define BLUR_REGION_STAMPS 64 // blur stamps merged into one region at most
+#define BLUR_REGION_SLACK 3   // max ratio of a region's box to the area its stamps cover
 // xlsfonts | grep courier
 // #define FONT "-*-*-*-*-*-*-60-*-*-*-*-*-iso8859-*"
 #define FONT "*-helvetica-*-18-*"
@@ -84,10 +139,23 @@ typedef struct
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
+/**
+ * SIGINT or SIGTERM caught, for the event loop to exit through bye() so
+ * that queued screenshots are still written. The handler also bumps the
+ * `quitFd` eventfd to wake the loop from poll(). A second signal exits at
+ * once.
+ */
+static volatile sig_atomic_t quitSignal;
+static int quitFd = -1;
+
 void signal_handler(int sig)
 {
-  printf("Caught signal %d, exiting...\n", sig);
-  exit(0);
+  if (quitSignal)
+    _exit(1);
+  quitSignal = sig;
+  uint64_t one = 1;
+  ssize_t woke = quitFd != -1 ? write(quitFd, &one, sizeof(one)) : 0;
+  (void)woke; // the loop still sees the flag on its next event
 }
 
 /**
@@ -189,12 +257,77 @@ static int get_config_path(char *out_path, size_t out_size)
   return 0;
 }
 
+/**
+ * Low-bandwidth mode for remote displays
+ */
+typedef enum
+{
+  REMOTE_AUTO = -1, // detect from the X connection
+  REMOTE_OFF,
+  REMOTE_ON,
+} RemoteMode;
+
+typedef enum
+{
+  BLUR_BACKEND_AUTO = -1,   // convolution or scale when remote, client otherwise
+  BLUR_BACKEND_CLIENT,      // read back and blur with the CPU kernels
+  BLUR_BACKEND_CONVOLUTION, // XRender convolution filter on the server
+  BLUR_BACKEND_SCALE,       // XRender downscale/upscale on the server
+} BlurBackend;
+
+typedef enum
+{
+  IMAGE_PNG,
+  IMAGE_JPG,
+  IMAGE_BMP,
+  IMAGE_TGA,
+  IMAGE_QOI,
+  IMAGE_FORMATS
+} ImageFormat;
+
+/**
+ * Config name, which is also the file extension, and clipboard type
+ */
+static const struct
+{
+  const char *name;
+  const char *mime;
+} imageFormats[IMAGE_FORMATS] = {
+    {"png", "image/png"}, {"jpg", "image/jpeg"}, {"bmp", "image/bmp"}, {"tga", "image/x-tga"}, {"qoi", "image/qoi"},
+};
+
+/**
+ * Settings read from the config file that are not changed from the UI
+ */
+typedef struct
+{
+  RemoteMode remote;
+  int pixelBlock;          // pixelate cell size
+  BlurBackend blurBackend; // as configured; resolved by blurBackendSelect
+  int blurRadius;          // blur strength
+  int blurBrush;           // blur brush size
+  char redactPatterns[REDACT_PATTERNS_MAX][128]; // text redaction regexes
+  int redactPatternCount;                        // defaults apply when 0
+  int screenshotUi;                              // screenshots include the palette
+  ImageFormat format;                            // of saved screenshots
+  ImageFormat clipboardFormat;                   // of screenshots copied to the clipboard
+  int jpegQuality;
+  int pngCompressionLevel;                       // higher is smaller and slower
+  int pngFilter;                                 // forced PNG row filter, -1 picks per row
+} Settings;
+
+/**
+ * PNG row filters, as stb_image_write numbers them
+ */
+static const char *const pngFilterNames[] = {"none", "sub", "up", "average", "paeth"};
+
 /**
  * Load saved configuration into the supplied locations. Each out-pointer is
  * updated only when its key is present and the parsed value is within range,
  * so callers must initialize them to defaults first.
  */
-static void load_config(int *color_index, char *shape, int *thickness, int *font_size, int *dashed)
+static void load_config(int *color_index, char *shape, int *thickness, int *font_size, int *dashed,
+                        Settings *settings)
 {
   char path[1024];
   if (get_config_path(path, sizeof(path)) != 0)
@@ -216,7 +349,7 @@ static void load_config(int *color_index, char *shape, int *thickness, int *font
     }
     else if (strcmp(key, "shape") == 0)
     {
-      if (val[0] && strchr("plarcb{[", val[0]))
+      if (val[0] && strchr("plarcbBxX{[", val[0]))
         *shape = val[0];
     }
     else if (strcmp(key, "thickness") == 0)
@@ -235,6 +368,77 @@ static void load_config(int *color_index, char *shape, int *thickness, int *font
     {
       *dashed = (atoi(val) != 0);
     }
+    else if (strcmp(key, "pixel_block") == 0)
+    {
+      int v = atoi(val);
+      if (v >= 4 && v <= 64)
+        settings->pixelBlock = v;
+    }
+    else if (strcmp(key, "blur_radius") == 0)
+    {
+      int v = atoi(val);
+      if (v >= 1 && v <= BLUR_RADIUS_MAX)
+        settings->blurRadius = v;
+    }
+    else if (strcmp(key, "blur_brush") == 0)
+    {
+      int v = atoi(val);
+      if (v >= BLUR_BRUSH_MIN && v <= BLUR_BRUSH_MAX)
+        settings->blurBrush = v;
+    }
+    else if (strcmp(key, "screenshot_ui") == 0)
+    {
+      settings->screenshotUi = atoi(val) != 0;
+    }
+    else if (strcmp(key, "format") == 0 || strcmp(key, "clipboard_format") == 0)
+    {
+      for (int i = 0; i < IMAGE_FORMATS; i++)
+        if (strcmp(val, imageFormats[i].name) == 0)
+          *(key[0] == 'f' ? &settings->format : &settings->clipboardFormat) = (ImageFormat)i;
+    }
+    else if (strcmp(key, "png_compression_level") == 0)
+    {
+      int v = atoi(val);
+      if (v >= 5 && v <= 64)
+        settings->pngCompressionLevel = v;
+    }
+    else if (strcmp(key, "png_filter") == 0)
+    {
+      for (int i = 0; i < 5; i++)
+        if (strcmp(val, pngFilterNames[i]) == 0)
+          settings->pngFilter = i;
+      if (strcmp(val, "auto") == 0)
+        settings->pngFilter = -1;
+    }
+    else if (strcmp(key, "jpeg_quality") == 0)
+    {
+      int v = atoi(val);
+      if (v >= 1 && v <= 100)
+        settings->jpegQuality = v;
+    }
+    else if (strcmp(key, "redact_pattern") == 0)
+    {
+      if (settings->redactPatternCount < REDACT_PATTERNS_MAX)
+        strcpy(settings->redactPatterns[settings->redactPatternCount++], val);
+    }
+    else if (strcmp(key, "blur_backend") == 0)
+    {
+      static const char *names[] = {"client", "convolution", "scale"};
+      for (int i = 0; i < 3; i++)
+        if (strcmp(val, names[i]) == 0)
+          settings->blurBackend = (BlurBackend)i;
+      if (strcmp(val, "auto") == 0)
+        settings->blurBackend = BLUR_BACKEND_AUTO;
+    }
+    else if (strcmp(key, "remote") == 0)
+    {
+      if (strcmp(val, "on") == 0)
+        settings->remote = REMOTE_ON;
+      else if (strcmp(val, "off") == 0)
+        settings->remote = REMOTE_OFF;
+      else if (strcmp(val, "auto") == 0)
+        settings->remote = REMOTE_AUTO;
+    }
   }
   fclose(f);
 }
@@ -242,7 +446,8 @@ static void load_config(int *color_index, char *shape, int *thickness, int *font
 /**
  * Persist the basic UI state to ~/.zpen/config so the next launch can restore it.
  */
-static void save_config(int color_index, char shape, int thickness, int font_size, int dashed)
+static void save_config(int color_index, char shape, int thickness, int font_size, int dashed,
+                        const Settings *settings)
 {
   if (ensure_zpen_directory() == -1)
     return;
@@ -257,12 +462,28 @@ static void save_config(int color_index, char shape, int thickness, int font_siz
   fprintf(f, "thickness=%d\n", thickness);
   fprintf(f, "font_size=%d\n", font_size);
   fprintf(f, "dashed=%d\n", dashed ? 1 : 0);
+  fprintf(f, "pixel_block=%d\n", settings->pixelBlock);
+  static const char *backends[] = {"auto", "client", "convolution", "scale"};
+  fprintf(f, "blur_backend=%s\n", backends[settings->blurBackend + 1]);
+  fprintf(f, "blur_radius=%d\n", settings->blurRadius);
+  fprintf(f, "blur_brush=%d\n", settings->blurBrush);
+  fprintf(f, "screenshot_ui=%d\n", settings->screenshotUi);
+  fprintf(f, "format=%s\n", imageFormats[settings->format].name);
+  fprintf(f, "clipboard_format=%s\n", imageFormats[settings->clipboardFormat].name);
+  fprintf(f, "jpeg_quality=%d\n", settings->jpegQuality);
+  fprintf(f, "png_compression_level=%d\n", settings->pngCompressionLevel);
+  fprintf(f, "png_filter=%s\n", settings->pngFilter < 0 ? "auto" : pngFilterNames[settings->pngFilter]);
+  for (int i = 0; i < settings->redactPatternCount; i++)
+    fprintf(f, "redact_pattern=%s\n", settings->redactPatterns[i]);
+  fprintf(f, "remote=%s\n", settings->remote == REMOTE_ON ? "on" : settings->remote == REMOTE_OFF ? "off" : "auto");
   fclose(f);
 }
 
 /**
  * Returns 1 if the `tesseract` binary is on PATH, 0 otherwise. Cached after
  * first call so the 'o' key handler can probe it cheaply on every press.
+ * main() primes the cache before any thread starts, as the screenshot
+ * encoder reads it too.
  */
 int hasTesseract(void)
 {
@@ -288,34 +509,314 @@ static const char *tmp_dir(void)
   return "/tmp";
 }
 
-int runTesseractOCR(const char *image_path)
+/**
+ * Filter row `y` of a PNG the way stb_image_write does: the forced filter,
+ * or the one of the five with the smallest sum of absolute differences.
+ * `out` gets the filter byte and the w * n filtered bytes.
+ */
+static void pngFilterRow(const unsigned char *pixels, int stride, int w, int h, int y, int n, signed char *line,
+                         unsigned char *out)
 {
-  if (!hasTesseract())
+  int filter = stbi_write_force_png_filter;
+  if (filter < 0 || filter >= 5)
   {
-    fprintf(stderr, "tesseract is not installed. Install with: sudo apt install tesseract-ocr\n");
-    return 0;
+    int best = 0x7fffffff;
+    for (int f = 0; f < 5; f++)
+    {
+      stbiw__encode_png_line((unsigned char *)pixels, stride, w, h, y, n, f, line);
+      int est = 0;
+      for (int i = 0; i < w * n; i++)
+        est += abs(line[i]);
+      if (est < best)
+      {
+        best = est;
+        filter = f;
+      }
+    }
   }
+  stbiw__encode_png_line((unsigned char *)pixels, stride, w, h, y, n, filter, line);
+  out[0] = (unsigned char)filter;
+  memcpy(out + 1, line, (size_t)w * n);
+}
 
-  // Tesseract works best around 300 DPI. Screen captures are ~96 DPI, so
-  // upscale ~3x with nearest-neighbor before OCR.
-  int iw, ih, ic;
-  unsigned char *src = stbi_load(image_path, &iw, &ih, &ic, 0);
-  if (!src)
+/**
+ * Bit just past the end-of-block code of the fixed Huffman deflate block
+ * that starts at bit `bit` of `p` (after its 3 header bits), or -1 when the
+ * data ends first
+ */
+static long deflateFixedBlockEnd(const unsigned char *p, size_t len, long bit)
+{
+  static const unsigned char lengthExtra[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                              2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+  static const unsigned char distExtra[] = {0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+                                            6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+  long end = (long)len * 8;
+#define DEFLATE_BIT() (bit < end ? (p[bit >> 3] >> (bit & 7)) & 1 : 0)
+  for (;;)
   {
-    fprintf(stderr, "OCR: failed to load %s\n", image_path);
-    return 0;
+    // Huffman codes are stored from their top bit
+    int code = 0;
+    for (int i = 0; i < 7; i++, bit++)
+      code = code << 1 | DEFLATE_BIT();
+    int symbol;
+    if (code <= 23)
+      symbol = 256 + code;
+    else
+    {
+      code = code << 1 | DEFLATE_BIT();
+      bit++;
+      if (code >= 48 && code <= 191)
+        symbol = code - 48;
+      else if (code >= 192 && code <= 199)
+        symbol = 280 + code - 192;
+      else
+      {
+        code = code << 1 | DEFLATE_BIT();
+        bit++;
+        symbol = 144 + code - 400;
+      }
+    }
+    if (bit > end || symbol > 285)
+      return -1;
+    if (symbol == 256)
+      return bit;
+    if (symbol > 256)
+    {
+      bit += lengthExtra[symbol - 257];
+      int dist = 0;
+      for (int i = 0; i < 5; i++, bit++)
+        dist = dist << 1 | DEFLATE_BIT();
+      if (dist >= 30)
+        return -1;
+      bit += distExtra[dist];
+    }
   }
-  if (iw <= 0 || ih <= 0 || ic <= 0 || ic > 4)
+#undef DEFLATE_BIT
+}
+
+/**
+ * Checksum of two buffers from theirs, `len2` being the second's length
+ */
+static uint32_t adler32Combine(uint32_t adler1, uint32_t adler2, size_t len2)
+{
+  const uint32_t base = 65521;
+  uint32_t rem = len2 % base;
+  uint32_t sum1 = adler1 & 0xFFFF;
+  uint32_t sum2 = (uint32_t)((uint64_t)rem * sum1 % base);
+  sum1 += (adler2 & 0xFFFF) + base - 1;
+  sum2 += ((adler1 >> 16) & 0xFFFF) + ((adler2 >> 16) & 0xFFFF) + base - rem;
+  if (sum1 >= base)
+    sum1 -= base;
+  if (sum1 >= base)
+    sum1 -= base;
+  if (sum2 >= base << 1)
+    sum2 -= base << 1;
+  if (sum2 >= base)
+    sum2 -= base;
+  return sum1 | sum2 << 16;
+}
+
+/**
+ * A band of rows of a PNG, filtered and deflated by its own thread
+ */
+typedef struct
+{
+  const unsigned char *pixels;
+  int stride, w, h, n;
+  int y0, y1;         // rows [y0, y1)
+  int last;           // ends the zlib stream
+  unsigned char *out; // raw deflate data
+  size_t len;
+  uint32_t adler;     // of the filtered rows
+  size_t rawLen;
+} PngStrip;
+
+/**
+ * Deflate a strip into blocks that the next strip's can follow: the final
+ * flag is cleared and, unless it is the last strip, an empty stored block
+ * realigns the stream to a byte, as a zlib sync flush does.
+ */
+static void *pngStripEncode(void *arg)
+{
+  PngStrip *ps = arg;
+  size_t rowLen = (size_t)ps->w * ps->n + 1;
+  ps->rawLen = rowLen * (ps->y1 - ps->y0);
+  unsigned char *raw = malloc(ps->rawLen);
+  signed char *line = malloc(rowLen);
+  if (raw && line)
+    for (int y = ps->y0; y < ps->y1; y++)
+      pngFilterRow(ps->pixels, ps->stride, ps->w, ps->h, y, ps->n, line, raw + (y - ps->y0) * rowLen);
+  free(line);
+  int zlen = 0;
+  unsigned char *z = raw && line ? stbi_zlib_compress(raw, (int)ps->rawLen, &zlen, stbi_write_png_compression_level)
+                                 : NULL;
+  free(raw);
+  if (!z || zlen < 7)
   {
-    stbi_image_free(src);
-    fprintf(stderr, "OCR: invalid image.\n");
-    return 0;
+    free(z);
+    return NULL;
+  }
+
+  unsigned char *deflate = z + 2; // past the zlib header
+  size_t len = zlen - 6;          // without header and checksum
+  ps->adler = (uint32_t)z[zlen - 4] << 24 | z[zlen - 3] << 16 | z[zlen - 2] << 8 | z[zlen - 1];
+  size_t tail = 0;
+  if (ps->last)
+    ; // ends the stream as it is
+  else if ((deflate[0] & 6) == 0)
+  {
+    // Stored blocks, already byte-aligned: clear the final flag of the last
+    size_t at = 0;
+    while (at + 5 <= len && !(deflate[at] & 1))
+      at += 5 + (deflate[at + 1] | deflate[at + 2] << 8);
+    if (at + 5 > len)
+    {
+      free(z);
+      return NULL;
+    }
+    deflate[at] &= ~1;
+  }
+  else
+  {
+    long end = deflateFixedBlockEnd(deflate, len, 3);
+    if (end < 0)
+    {
+      free(z);
+      return NULL;
+    }
+    deflate[0] &= ~1;
+    len = (end + 7) / 8;
+    // The empty stored block's 3 header bits go in the zero padding when
+    // they fit, otherwise into one more zero byte
+    int padding = (int)(len * 8 - end);
+    tail = (padding >= 3 ? 0 : 1) + 4;
+  }
+  ps->out = malloc(len + tail);
+  if (ps->out)
+  {
+    memcpy(ps->out, deflate, len);
+    memset(ps->out + len, 0, tail);
+    if (tail)
+    {
+      ps->out[len + tail - 2] = 0xFF;
+      ps->out[len + tail - 1] = 0xFF;
+    }
+    ps->len = len + tail;
+  }
+  free(z);
+  return NULL;
+}
+
+/**
+ * PNG of a w x h image of `n` channels in memory, like
+ * stbi_write_png_to_mem() but with bands of rows filtered and deflated on
+ * all cores and joined into one zlib stream. `maxStrips` caps the bands, 0
+ * meaning one per core. The caller frees the result.
+ */
+unsigned char *pngEncode(const unsigned char *pixels, int stride, int w, int h, int n, int maxStrips, int *outLen)
+{
+  long cores = maxStrips > 0 ? maxStrips : sysconf(_SC_NPROCESSORS_ONLN);
+  int nStrips = h / PNG_STRIP_ROWS;
+  if (nStrips > cores)
+    nStrips = cores;
+  if (nStrips > 64)
+    nStrips = 64;
+  if (nStrips < 2)
+    return stbi_write_png_to_mem(pixels, stride, w, h, n, outLen);
+
+  PngStrip strips[64];
+  pthread_t threads[64];
+  int started[64];
+  for (int i = 0; i < nStrips; i++)
+  {
+    strips[i] = (PngStrip){pixels, stride, w, h, n, (int)((long)h * i / nStrips), (int)((long)h * (i + 1) / nStrips),
+                           i == nStrips - 1, NULL, 0, 0, 0};
+    // The calling thread takes the first strip itself
+    started[i] = i > 0 && pthread_create(&threads[i], NULL, pngStripEncode, &strips[i]) == 0;
+  }
+  for (int i = 0; i < nStrips; i++)
+    if (!started[i])
+      pngStripEncode(&strips[i]);
+  size_t zlen = 2 + 4;
+  int ok = 1;
+  uint32_t adler = 1;
+  for (int i = 0; i < nStrips; i++)
+  {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+    ok = ok && strips[i].out;
+    zlen += strips[i].len;
+    adler = adler32Combine(adler, strips[i].adler, strips[i].rawLen);
+  }
+
+  unsigned char *out = ok ? malloc(8 + 12 + 13 + 12 + zlen + 12) : NULL;
+  if (out)
+  {
+    static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    static const int colorType[5] = {-1, 0, 4, 2, 6};
+    unsigned char *o = out;
+    memcpy(o, signature, 8);
+    o += 8;
+    stbiw__wp32(o, 13);
+    stbiw__wptag(o, "IHDR");
+    stbiw__wp32(o, w);
+    stbiw__wp32(o, h);
+    *o++ = 8;
+    *o++ = (unsigned char)colorType[n];
+    *o++ = 0;
+    *o++ = 0;
+    *o++ = 0;
+    stbiw__wpcrc(&o, 13);
+    stbiw__wp32(o, zlen);
+    stbiw__wptag(o, "IDAT");
+    *o++ = 0x78; // same zlib header as stb
+    *o++ = 0x5e;
+    for (int i = 0; i < nStrips; i++)
+    {
+      memcpy(o, strips[i].out, strips[i].len);
+      o += strips[i].len;
+    }
+    stbiw__wp32(o, adler);
+    stbiw__wpcrc(&o, (int)zlen);
+    stbiw__wp32(o, 0);
+    stbiw__wptag(o, "IEND");
+    stbiw__wpcrc(&o, 0);
+    *outLen = (int)(o - out);
   }
-  const int scale = 3;
+  for (int i = 0; i < nStrips; i++)
+    free(strips[i].out);
+  return out;
+}
+
+/**
+ * stbi_write_png() through pngEncode()
+ */
+int writePng(const char *path, int w, int h, int n, const unsigned char *pixels, int stride)
+{
+  int len;
+  unsigned char *png = pngEncode(pixels, stride, w, h, n, 0, &len);
+  if (!png)
+    return 0;
+  FILE *f = fopen(path, "wb");
+  int ok = f && fwrite(png, 1, len, f) == (size_t)len;
+  if (f && fclose(f) != 0)
+    ok = 0;
+  STBIW_FREE(png);
+  return ok;
+}
+
+/**
+ * Upscale the iw x ih image `src` (`ic` channels, `stride` bytes per row)
+ * `scale` times with nearest-neighbor and write it to a new temp PNG, whose
+ * path goes to `path`. Tesseract works best around 300 DPI and screen
+ * captures are ~96 DPI. Returns 1 on success, 0 on failure.
+ */
+static int writeOcrInput(const unsigned char *src, int iw, int ih, int ic, size_t stride, int scale,
+                         char *path, size_t pathSize)
+{
   if ((size_t)iw > SIZE_MAX / (size_t)scale ||
       (size_t)ih > SIZE_MAX / (size_t)scale)
   {
-    stbi_image_free(src);
     fprintf(stderr, "OCR: image too large to upscale.\n");
     return 0;
   }
@@ -323,34 +824,32 @@ int runTesseractOCR(const char *image_path)
   size_t oh = (size_t)ih * (size_t)scale;
   if (oh != 0 && ow > SIZE_MAX / (size_t)ic / oh)
   {
-    stbi_image_free(src);
     fprintf(stderr, "OCR: image too large to upscale.\n");
     return 0;
   }
   unsigned char *dst = malloc(ow * oh * (size_t)ic);
   if (!dst)
   {
-    stbi_image_free(src);
     fprintf(stderr, "OCR: out of memory while upscaling.\n");
     return 0;
   }
-  for (size_t y = 0; y < oh; y++)
+  // Widen each source row once, then repeat it
+  size_t orow = ow * (size_t)ic;
+  for (size_t sy = 0; sy < (size_t)ih; sy++)
   {
-    size_t sy = y / (size_t)scale;
-    for (size_t x = 0; x < ow; x++)
-    {
-      size_t sx = x / (size_t)scale;
-      memcpy(&dst[(y * ow + x) * (size_t)ic],
-             &src[(sy * (size_t)iw + sx) * (size_t)ic], (size_t)ic);
-    }
+    unsigned char *out = dst + sy * (size_t)scale * orow;
+    const unsigned char *in = src + sy * stride;
+    for (size_t sx = 0; sx < (size_t)iw; sx++, in += ic)
+      for (int k = 0; k < scale; k++, out += ic)
+        memcpy(out, in, (size_t)ic);
+    for (int k = 1; k < scale; k++)
+      memcpy(dst + (sy * (size_t)scale + k) * orow, dst + sy * (size_t)scale * orow, orow);
   }
-  stbi_image_free(src);
 
   // Secure temp file for the upscaled input image. mkstemp creates with
   // mode 0600 in O_EXCL mode, so symlink and race-replacement attacks fail.
-  char in_path[1024];
-  snprintf(in_path, sizeof(in_path), "%s/zpen-ocr-XXXXXX", tmp_dir());
-  int in_fd = mkstemp(in_path);
+  snprintf(path, pathSize, "%s/zpen-ocr-XXXXXX", tmp_dir());
+  int in_fd = mkstemp(path);
   if (in_fd == -1)
   {
     free(dst);
@@ -358,14 +857,43 @@ int runTesseractOCR(const char *image_path)
     return 0;
   }
   close(in_fd);
-  int wrote = stbi_write_png(in_path, (int)ow, (int)oh, ic, dst, (int)(ow * (size_t)ic));
+  int wrote = writePng(path, (int)ow, (int)oh, ic, dst, (int)(ow * (size_t)ic));
   free(dst);
   if (!wrote)
   {
-    unlink(in_path);
+    unlink(path);
     fprintf(stderr, "OCR: failed to write upscaled input.\n");
     return 0;
   }
+  return 1;
+}
+
+int runTesseractOCR(const char *image_path)
+{
+  if (!hasTesseract())
+  {
+    fprintf(stderr, "tesseract is not installed. Install with: sudo apt install tesseract-ocr\n");
+    return 0;
+  }
+
+  int iw, ih, ic;
+  unsigned char *src = stbi_load(image_path, &iw, &ih, &ic, 0);
+  if (!src)
+  {
+    fprintf(stderr, "OCR: failed to load %s\n", image_path);
+    return 0;
+  }
+  if (iw <= 0 || ih <= 0 || ic <= 0 || ic > 4)
+  {
+    stbi_image_free(src);
+    fprintf(stderr, "OCR: invalid image.\n");
+    return 0;
+  }
+  char in_path[1024];
+  int written = writeOcrInput(src, iw, ih, ic, (size_t)iw * ic, 3, in_path, sizeof(in_path));
+  stbi_image_free(src);
+  if (!written)
+    return 0;
 
   // Pipe `tesseract <in> stdout` into `xclip ...` so the recognized text
   // never lands on disk. Both children are spawned with execvp (no shell).
@@ -439,900 +967,5260 @@ int runTesseractOCR(const char *image_path)
   return 1;
 }
 
-/*
-convert to png
+/**
+ * Text redacted when no redact_pattern is configured: e-mail addresses,
+ * IPv4 and IPv6 addresses, API keys with well-known prefixes and long
+ * opaque tokens
+ */
+static const char *const defaultRedactPatterns[] = {
+    "[[:alnum:]._%+-]+@[[:alnum:].-]+\\.[[:alpha:]]{2,}",
+    "([0-9]{1,3}\\.){3}[0-9]{1,3}",
+    "([0-9A-Fa-f]{0,4}:){3,7}[0-9A-Fa-f]{1,4}",
+    "(ghp_|gho_|github_pat_|glpat-|sk-|xox[abp]-|AKIA)[A-Za-z0-9_-]{8,}",
+    "[A-Za-z0-9_-]{32,}",
+};
 
-clipMode controls how the resulting PNG is shared:
-  0 - save file only
-  1 - save file + copy image to clipboard
-  2 - save file + run tesseract OCR + copy text to clipboard
-*/
-void saveScreenshotFile(XImage *image, int clipMode)
+/**
+ * One horizontal strip of a parallel OCR run
+ */
+typedef struct
 {
-  if (ensure_zpen_directory() == -1)
-  {
-    fprintf(stderr, "Failed to create or access .zpen directory\n");
-    return;
-  }
+  int y;            // first row in the image
+  pid_t pid;
+  int fd;           // tesseract's stdout, -1 once drained
+  char path[1024];  // upscaled input
+  char *out;
+  size_t len, cap;
+} OcrStrip;
 
-  if (image->width <= 0 || image->height <= 0)
+/**
+ * How the strips run tesseract: its path and our environment with
+ * OMP_THREAD_LIMIT=1, as the strips already run one per core. Prepared
+ * before forking, since the child of a threaded process must not allocate
+ * or take the environment lock.
+ */
+typedef struct
+{
+  char path[1024];
+  char **env; // freed by the caller; the strings are the environ ones
+} OcrExec;
+
+/**
+ * Find tesseract on PATH and build its environment. Returns 0 on failure.
+ */
+static int ocrExecPrepare(OcrExec *x)
+{
+  extern char **environ;
+  const char *dirs = getenv("PATH");
+  x->path[0] = '\0';
+  for (const char *dir = dirs ? dirs : "/usr/bin:/bin"; *dir && !x->path[0];)
   {
-    fprintf(stderr, "Invalid screenshot dimensions: %dx%d\n", image->width, image->height);
-    return;
+    size_t len = strcspn(dir, ":");
+    snprintf(x->path, sizeof(x->path), "%.*s/tesseract", len ? (int)len : 1, len ? dir : ".");
+    if (access(x->path, X_OK) != 0)
+      x->path[0] = '\0';
+    dir += len + (dir[len] == ':');
   }
+  if (!x->path[0])
+    return 0;
+  size_t n = 0;
+  while (environ[n])
+    n++;
+  x->env = malloc((n + 2) * sizeof(char *));
+  if (!x->env)
+    return 0;
+  size_t k = 0;
+  x->env[k++] = (char *)"OMP_THREAD_LIMIT=1";
+  for (size_t i = 0; i < n; i++)
+    if (strncmp(environ[i], "OMP_THREAD_LIMIT=", 17) != 0)
+      x->env[k++] = environ[i];
+  x->env[k] = NULL;
+  return 1;
+}
 
-  // Overflow-safe size: w * h * 3 fits in size_t
-  size_t w = (size_t)image->width;
-  size_t h = (size_t)image->height;
-  if (h != 0 && w > SIZE_MAX / 3 / h)
+/**
+ * Start tesseract as `x` says on rows [y, y + h) of the w-wide RGB image
+ * `rgb`, with word boxes as TSV on its stdout. Returns 0 on failure.
+ */
+static int ocrStripStart(OcrStrip *s, const OcrExec *x, const unsigned char *rgb, int w, int y, int h)
+{
+  s->y = y;
+  s->fd = -1;
+  if (!writeOcrInput(rgb + (size_t)y * w * 3, w, h, 3, (size_t)w * 3, REDACT_SCALE, s->path, sizeof(s->path)))
+    return 0;
+  int pipefd[2];
+  if (pipe(pipefd) == -1)
   {
-    fprintf(stderr, "Screenshot too large to encode.\n");
-    return;
+    unlink(s->path);
+    return 0;
   }
-  size_t row = w * 3;
-  size_t img_size = row * h;
-  unsigned char *data = malloc(img_size);
-  if (!data)
+  char *const argv[] = {"tesseract", s->path, "stdout", "--psm", "11", "tsv", NULL};
+  s->pid = fork();
+  if (s->pid == -1)
   {
-    fprintf(stderr, "Out of memory for screenshot.\n");
-    return;
+    close(pipefd[0]);
+    close(pipefd[1]);
+    unlink(s->path);
+    return 0;
   }
-  for (int y = 0; y < image->height; y++)
+  if (s->pid == 0)
   {
-    for (int x = 0; x < image->width; x++)
+    dup2(pipefd[1], STDOUT_FILENO);
+    close(pipefd[0]);
+    close(pipefd[1]);
+    int devnull = open("/dev/null", O_WRONLY);
+    if (devnull != -1)
     {
-      unsigned long pixel = XGetPixel(image, x, y);
-      size_t off = ((size_t)y * w + (size_t)x) * 3;
-      data[off + 0] = (pixel & image->red_mask) >> 16;
-      data[off + 1] = (pixel & image->green_mask) >> 8;
-      data[off + 2] = pixel & image->blue_mask;
+      dup2(devnull, STDERR_FILENO);
+      close(devnull);
     }
+    execve(x->path, argv, x->env);
+    _exit(127);
   }
+  close(pipefd[1]);
+  s->fd = pipefd[0];
+  return 1;
+}
 
-  time_t t = time(NULL);
-  struct tm tm = *localtime(&t);
-  char filename[1024];
-  const char *home = getenv("HOME");
-  if (!home)
+/**
+ * A recognised word, placed in the text of its line
+ */
+typedef struct
+{
+  XRectangle box; // in image pixels
+  int start, end; // characters of the line text it spans
+  int hit;
+} OcrWord;
+
+/**
+ * Mark the `n` words of line `text` that any of the `nRegex` patterns
+ * matches, on its own or as part of a match across words of the line
+ */
+static void ocrMatchLine(const regex_t *regex, int nRegex, char *text, OcrWord *words, int n)
+{
+  for (int i = 0; i < n; i++)
   {
-    fprintf(stderr, "Error: Could not get HOME directory.\n");
-    free(data);
-    return;
+    // Each word alone, cut out of the line in place
+    char after = text[words[i].end];
+    text[words[i].end] = '\0';
+    for (int r = 0; r < nRegex && !words[i].hit; r++)
+      words[i].hit = regexec(&regex[r], text + words[i].start, 0, NULL, 0) == 0;
+    text[words[i].end] = after;
   }
-  snprintf(filename, sizeof(filename), "%s/.zpen/img%04d%02d%02d%02d%02d%02d.png",
-           home,
-           tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
-           tm.tm_hour, tm.tm_min, tm.tm_sec);
+  for (int r = 0; r < nRegex; r++)
+  {
+    regmatch_t m;
+    for (int at = 0; text[at] && regexec(&regex[r], text + at, 1, &m, at ? REG_NOTBOL : 0) == 0;)
+    {
+      int so = at + m.rm_so, eo = at + m.rm_eo;
+      for (int i = 0; i < n; i++)
+        if (words[i].start < eo && words[i].end > so)
+          words[i].hit = 1;
+      at = eo > at ? eo : at + 1;
+    }
+  }
+}
+
+/**
+ * Boxes of the words of the w x h RGB image `rgb` matching a redaction
+ * pattern of `st`, in image coordinates. Patterns are tried on each word
+ * and on each line with its words joined by single spaces, so they may
+ * span words. The image is recognised in strips, one tesseract per core,
+ * that overlap by half a strip so a line up to that tall is whole in one.
+ * Returns the number of boxes put in *boxes, which the caller frees, or -1
+ * on failure.
+ */
+int ocrSensitiveWords(const unsigned char *rgb, int w, int h, const Settings *st, XRectangle **boxes)
+{
+  *boxes = NULL;
+  const char *patterns[REDACT_PATTERNS_MAX];
+  int nPatterns = 0;
+  if (st->redactPatternCount)
+    for (int i = 0; i < st->redactPatternCount; i++)
+      patterns[nPatterns++] = st->redactPatterns[i];
+  else
+    for (size_t i = 0; i < sizeof(defaultRedactPatterns) / sizeof(*defaultRedactPatterns); i++)
+      patterns[nPatterns++] = defaultRedactPatterns[i];
+  regex_t regex[REDACT_PATTERNS_MAX];
+  int nRegex = 0;
+  for (int i = 0; i < nPatterns; i++)
+  {
+    if (regcomp(&regex[nRegex], patterns[i], REG_EXTENDED) == 0)
+      nRegex++;
+    else
+      fprintf(stderr, "zpen: ignoring invalid redact_pattern %s\n", patterns[i]);
+  }
+
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int nStrips = h / OCR_STRIP_MIN;
+  if (nStrips > cores)
+    nStrips = cores;
+  if (nStrips < 1)
+    nStrips = 1;
+  if (nStrips > 64)
+    nStrips = 64;
+  OcrStrip strips[64];
+  int started = 0;
+  OcrExec exec = {"", NULL};
+  int prepared = ocrExecPrepare(&exec);
+  int stripH = (h + nStrips - 1) / nStrips;
+  int overlap = stripH / 2 > OCR_STRIP_OVERLAP ? stripH / 2 : OCR_STRIP_OVERLAP;
+  for (int i = 0; i < nStrips; i++)
+  {
+    int y0 = i * stripH;
+    int y1 = y0 + stripH + overlap;
+    if (y1 > h)
+      y1 = h;
+    memset(&strips[started], 0, sizeof(*strips));
+    if (prepared && y0 < h && ocrStripStart(&strips[started], &exec, rgb, w, y0, y1 - y0))
+      started++;
+  }
+
+  // Drain every strip as its output comes, so no tesseract blocks on a pipe
+  int running = started;
+  while (running)
+  {
+    struct pollfd fds[64];
+    int index[64], n = 0;
+    for (int i = 0; i < started; i++)
+      if (strips[i].fd != -1)
+      {
+        fds[n] = (struct pollfd){strips[i].fd, POLLIN, 0};
+        index[n++] = i;
+      }
+    if (poll(fds, n, -1) == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    for (int j = 0; j < n; j++)
+    {
+      if (!fds[j].revents)
+        continue;
+      OcrStrip *s = &strips[index[j]];
+      if (s->cap - s->len < 4096)
+      {
+        char *grown = realloc(s->out, s->cap * 2 + 8192);
+        if (grown)
+        {
+          s->out = grown;
+          s->cap = s->cap * 2 + 8192;
+        }
+      }
+      ssize_t got = s->cap - s->len > 1 ? read(s->fd, s->out + s->len, s->cap - s->len - 1) : 0;
+      if (got > 0)
+        s->len += got;
+      else if (got == 0 || errno != EINTR)
+      {
+        close(s->fd);
+        s->fd = -1;
+        running--;
+      }
+    }
+  }
+
+  int count = 0, ok = started > 0, capacity = 0;
+  for (int i = 0; i < started; i++)
+  {
+    OcrStrip *s = &strips[i];
+    if (s->fd != -1)
+      close(s->fd);
+    int status = 0;
+    while (waitpid(s->pid, &status, 0) == -1 && errno == EINTR) {}
+    unlink(s->path);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      ok = 0;
+    if (!s->out)
+      continue;
+    s->out[s->len] = '\0';
+
+    // Words come line by line; the line text joins them with spaces
+    size_t rows = 1;
+    for (const char *c = s->out; *c; c++)
+      rows += *c == '\n';
+    OcrWord *words = malloc(rows * sizeof(OcrWord));
+    char *text = malloc(s->len + 1);
+    if (!words || !text)
+    {
+      free(words);
+      free(text);
+      free(s->out);
+      ok = 0;
+      continue;
+    }
+    int nWords = 0, length = 0, lineKey[3] = {-1, -1, -1}, failed = 0;
+
+    // level page block par line word left top width height conf text
+    char *save = NULL;
+    for (char *line = strtok_r(s->out, "\n", &save);; line = strtok_r(NULL, "\n", &save))
+    {
+      int level = 0, key[3], left, top, bw, bh, consumed = 0;
+      int parsed = line && sscanf(line, "%d\t%*d\t%d\t%d\t%d\t%*d\t%d\t%d\t%d\t%d\t%*s%n", &level, &key[0], &key[1],
+                                  &key[2], &left, &top, &bw, &bh, &consumed) == 8 &&
+                   level == 5 && line[consumed] == '\t' && line[consumed + 1];
+      if (line && !parsed)
+        continue;
+      if (nWords && (!line || memcmp(key, lineKey, sizeof(key)) != 0))
+      {
+        text[length] = '\0';
+        ocrMatchLine(regex, nRegex, text, words, nWords);
+        for (int i = 0; i < nWords && !failed; i++)
+        {
+          if (!words[i].hit)
+            continue;
+          if (count == capacity)
+          {
+            XRectangle *grown = realloc(*boxes, (capacity * 2 + 16) * sizeof(XRectangle));
+            if (!grown)
+            {
+              failed = 1;
+              break;
+            }
+            *boxes = grown;
+            capacity = capacity * 2 + 16;
+          }
+          (*boxes)[count++] = words[i].box;
+        }
+        nWords = length = 0;
+      }
+      if (!line || failed)
+        break;
+      memcpy(lineKey, key, sizeof(key));
+      const char *word = line + consumed + 1;
+      if (length)
+        text[length++] = ' ';
+      // Back to image pixels, rounding outwards
+      int x0 = left / REDACT_SCALE, y0 = top / REDACT_SCALE + s->y;
+      int x1 = (left + bw + REDACT_SCALE - 1) / REDACT_SCALE;
+      int y1 = (top + bh + REDACT_SCALE - 1) / REDACT_SCALE + s->y;
+      words[nWords] = (OcrWord){{x0, y0, x1 - x0, y1 - y0}, length, length + (int)strlen(word), 0};
+      memcpy(text + length, word, strlen(word));
+      length = words[nWords++].end;
+    }
+    free(words);
+    free(text);
+    free(s->out);
+  }
+  for (int r = 0; r < nRegex; r++)
+    regfree(&regex[r]);
+  free(exec.env);
+  if (!ok)
+  {
+    fprintf(stderr, "Tesseract OCR failed.\n");
+    free(*boxes);
+    *boxes = NULL;
+    return -1;
+  }
+  return count;
+}
+
+/**
+ * Pixel layout of an XImage, inspected once so whole rows convert without
+ * an XGetPixel/XPutPixel call per pixel. Colours travel either as native
+ * 0xAARRGGBB words, which the blur and pixelate kernels filter byte by
+ * byte, or as packed RGB bytes for the image writers.
+ *
+ * toArgb: row `y` into width words. Alpha is kept when the image has an
+ * alpha channel and is opaque otherwise.
+ * fromArgb: width words into row `y`.
+ * toRgb: row `y` into width * 3 bytes.
+ */
+typedef struct PixelFormat PixelFormat;
+struct PixelFormat
+{
+  const char *name;
+  int shift[4];      // lowest bit of red, green, blue and alpha
+  int bits[4];       // width of each, 0 when the image has no such channel
+  void (*toArgb)(const PixelFormat *pf, const XImage *img, int y, uint32_t *out);
+  void (*fromArgb)(const PixelFormat *pf, XImage *img, int y, const uint32_t *in);
+  void (*toRgb)(const PixelFormat *pf, const XImage *img, int y, uint8_t *out);
+};
+
+static inline int maskShift(unsigned long mask)
+{
+  return mask ? __builtin_ctzl(mask) : 0;
+}
+
+static inline int maskBits(unsigned long mask)
+{
+  return __builtin_popcountl(mask);
+}
+
+/**
+ * Channel `c` of `pixel` scaled to 8 bits
+ */
+static inline uint32_t channelTo8(const PixelFormat *pf, uint32_t pixel, int c)
+{
+  int bits = pf->bits[c];
+  uint32_t v = (pixel >> pf->shift[c]) & ((1u << bits) - 1);
+  if (bits >= 8)
+    return v >> (bits - 8);
+  uint32_t max = (1u << bits) - 1;
+  return (v * 255 + max / 2) / max;
+}
+
+static inline uint32_t pixelUnpack(const PixelFormat *pf, uint32_t pixel)
+{
+  uint32_t a = pf->bits[3] ? channelTo8(pf, pixel, 3) : 0xFF;
+  return a << 24 | channelTo8(pf, pixel, 0) << 16 | channelTo8(pf, pixel, 1) << 8 | channelTo8(pf, pixel, 2);
+}
+
+static inline uint32_t pixelPack(const PixelFormat *pf, uint32_t argb)
+{
+  static const int from[4] = {16, 8, 0, 24};
+  uint32_t pixel = 0;
+  for (int c = 0; c < 4; c++)
+  {
+    int bits = pf->bits[c];
+    uint32_t v = (argb >> from[c]) & 0xFF;
+    if (bits)
+      pixel |= (bits >= 8 ? v << (bits - 8) : v >> (8 - bits)) << pf->shift[c];
+  }
+  return pixel;
+}
+
+static inline uint32_t load32Lsb(const uint8_t *p)
+{
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+static inline uint32_t load32Msb(const uint8_t *p)
+{
+  return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+static inline uint32_t load24Lsb(const uint8_t *p)
+{
+  return p[0] | p[1] << 8 | p[2] << 16;
+}
+static inline uint32_t load24Msb(const uint8_t *p)
+{
+  return p[0] << 16 | p[1] << 8 | p[2];
+}
+static inline uint32_t load16Lsb(const uint8_t *p)
+{
+  return p[0] | p[1] << 8;
+}
+static inline uint32_t load16Msb(const uint8_t *p)
+{
+  return p[0] << 8 | p[1];
+}
+static inline void store32Lsb(uint8_t *p, uint32_t v)
+{
+  p[0] = v, p[1] = v >> 8, p[2] = v >> 16, p[3] = v >> 24;
+}
+static inline void store32Msb(uint8_t *p, uint32_t v)
+{
+  p[0] = v >> 24, p[1] = v >> 16, p[2] = v >> 8, p[3] = v;
+}
+static inline void store24Lsb(uint8_t *p, uint32_t v)
+{
+  p[0] = v, p[1] = v >> 8, p[2] = v >> 16;
+}
+static inline void store24Msb(uint8_t *p, uint32_t v)
+{
+  p[0] = v >> 16, p[1] = v >> 8, p[2] = v;
+}
+static inline void store16Lsb(uint8_t *p, uint32_t v)
+{
+  p[0] = v, p[1] = v >> 8;
+}
+static inline void store16Msb(uint8_t *p, uint32_t v)
+{
+  p[0] = v >> 8, p[1] = v;
+}
+
+/**
+ * Row converters for a bytes-per-pixel and byte order, any channel masks
+ */
+#define PIXEL_ROW_CONVERTERS(NAME, BYTES, LOAD, STORE)                                           \
+  static void NAME##ToArgb(const PixelFormat *pf, const XImage *img, int y, uint32_t *out)       \
+  {                                                                                              \
+    const uint8_t *p = (const uint8_t *)img->data + (size_t)y * img->bytes_per_line;             \
+    for (int x = 0; x < img->width; x++, p += BYTES)                                             \
+      out[x] = pixelUnpack(pf, LOAD(p));                                                         \
+  }                                                                                              \
+  static void NAME##FromArgb(const PixelFormat *pf, XImage *img, int y, const uint32_t *in)      \
+  {                                                                                              \
+    uint8_t *p = (uint8_t *)img->data + (size_t)y * img->bytes_per_line;                         \
+    for (int x = 0; x < img->width; x++, p += BYTES)                                             \
+      STORE(p, pixelPack(pf, in[x]));                                                            \
+  }                                                                                              \
+  static void NAME##ToRgb(const PixelFormat *pf, const XImage *img, int y, uint8_t *out)         \
+  {                                                                                              \
+    const uint8_t *p = (const uint8_t *)img->data + (size_t)y * img->bytes_per_line;             \
+    for (int x = 0; x < img->width; x++, p += BYTES, out += 3)                                   \
+    {                                                                                            \
+      uint32_t pixel = LOAD(p);                                                                  \
+      out[0] = channelTo8(pf, pixel, 0);                                                         \
+      out[1] = channelTo8(pf, pixel, 1);                                                         \
+      out[2] = channelTo8(pf, pixel, 2);                                                         \
+    }                                                                                            \
+  }
+
+PIXEL_ROW_CONVERTERS(pixels32Lsb, 4, load32Lsb, store32Lsb)
+PIXEL_ROW_CONVERTERS(pixels32Msb, 4, load32Msb, store32Msb)
+PIXEL_ROW_CONVERTERS(pixels24Lsb, 3, load24Lsb, store24Lsb)
+PIXEL_ROW_CONVERTERS(pixels24Msb, 3, load24Msb, store24Msb)
+PIXEL_ROW_CONVERTERS(pixels16Lsb, 2, load16Lsb, store16Lsb)
+PIXEL_ROW_CONVERTERS(pixels16Msb, 2, load16Msb, store16Msb)
+
+#define PIXEL_LOAD_ANY(p) ((uint32_t)XGetPixel((XImage *)img, x, y))
+#define PIXEL_STORE_ANY(p, v) XPutPixel(img, x, y, (v))
+/* Fallback for every other layout, one XGetPixel/XPutPixel per pixel */
+PIXEL_ROW_CONVERTERS(pixelsAny, 0, PIXEL_LOAD_ANY, PIXEL_STORE_ANY)
+#undef PIXEL_LOAD_ANY
+#undef PIXEL_STORE_ANY
+
+typedef struct
+{
+  int bitsPerPixel; // 0 matches any
+  int lsb;
+  const char *name;
+  void (*toArgb)(const PixelFormat *pf, const XImage *img, int y, uint32_t *out);
+  void (*fromArgb)(const PixelFormat *pf, XImage *img, int y, const uint32_t *in);
+  void (*toRgb)(const PixelFormat *pf, const XImage *img, int y, uint8_t *out);
+} PixelRowSet;
+
+#define PIXEL_ROW_SET(NAME, BPP, LSB) {BPP, LSB, #NAME, NAME##ToArgb, NAME##FromArgb, NAME##ToRgb}
+static const PixelRowSet pixelRowSets[] = {
+    PIXEL_ROW_SET(pixels32Lsb, 32, 1), PIXEL_ROW_SET(pixels32Msb, 32, 0),
+    PIXEL_ROW_SET(pixels24Lsb, 24, 1), PIXEL_ROW_SET(pixels24Msb, 24, 0),
+    PIXEL_ROW_SET(pixels16Lsb, 16, 1), PIXEL_ROW_SET(pixels16Msb, 16, 0),
+    PIXEL_ROW_SET(pixelsAny, 0, 0),
+};
+#undef PIXEL_ROW_SET
+
+/*
+ * Native 32 bpp with 0xRRGGBB masks, which is what X servers nearly always
+ * hand out: words are already in the kernel layout.
+ */
+static void xrgb32ToArgb(const PixelFormat *pf, const XImage *img, int y, uint32_t *out)
+{
+  const uint32_t *p = (const uint32_t *)(img->data + (size_t)y * img->bytes_per_line);
+  uint32_t opaque = pf->bits[3] ? 0 : 0xFF000000;
+  for (int x = 0; x < img->width; x++)
+    out[x] = p[x] | opaque;
+}
+
+static void xrgb32FromArgb(const PixelFormat *pf, XImage *img, int y, const uint32_t *in)
+{
+  (void)pf;
+  memcpy(img->data + (size_t)y * img->bytes_per_line, in, (size_t)img->width * 4);
+}
+
+static void xrgb32ToRgb(const PixelFormat *pf, const XImage *img, int y, uint8_t *out)
+{
+  (void)pf;
+  const uint32_t *p = (const uint32_t *)(img->data + (size_t)y * img->bytes_per_line);
+  for (int x = 0; x < img->width; x++, out += 3)
+  {
+    out[0] = p[x] >> 16;
+    out[1] = p[x] >> 8;
+    out[2] = p[x];
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Four pixels per shuffle; the 16-byte store runs 4 bytes ahead of the row
+__attribute__((target("ssse3"))) static void xrgb32ToRgbSsse3(const PixelFormat *pf, const XImage *img, int y,
+                                                               uint8_t *out)
+{
+  const uint8_t *p = (const uint8_t *)img->data + (size_t)y * img->bytes_per_line;
+  const __m128i order = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  int x = 0;
+  for (; x + 6 <= img->width; x += 4)
+    _mm_storeu_si128((__m128i *)(out + x * 3), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + x * 4)), order));
+  XImage rest = *img;
+  rest.data += x * 4;
+  rest.width -= x;
+  xrgb32ToRgb(pf, &rest, y, out + x * 3);
+}
+#endif
+
+#if defined(__aarch64__)
+static void xrgb32ToRgbNeon(const PixelFormat *pf, const XImage *img, int y, uint8_t *out)
+{
+  const uint8_t *p = (const uint8_t *)img->data + (size_t)y * img->bytes_per_line;
+  int x = 0;
+  for (; x + 16 <= img->width; x += 16)
+  {
+    uint8x16x4_t bgra = vld4q_u8(p + x * 4);
+    uint8x16x3_t rgb = {{bgra.val[2], bgra.val[1], bgra.val[0]}};
+    vst3q_u8(out + x * 3, rgb);
+  }
+  XImage rest = *img;
+  rest.data += x * 4;
+  rest.width -= x;
+  xrgb32ToRgb(pf, &rest, y, out + x * 3);
+}
+#endif
+
+/**
+ * Describe the layout of `img` and pick its row converters
+ */
+void pixelFormatInit(PixelFormat *pf, const XImage *img)
+{
+  const uint16_t one = 1;
+  int lsbHost = *(const uint8_t *)&one;
+  unsigned long rgb = img->red_mask | img->green_mask | img->blue_mask;
+  unsigned long alpha = img->depth == 32 && img->bits_per_pixel == 32 && rgb ? 0xFFFFFFFFUL & ~rgb : 0;
+  unsigned long masks[4] = {img->red_mask, img->green_mask, img->blue_mask, alpha};
+  for (int c = 0; c < 4; c++)
+  {
+    pf->shift[c] = maskShift(masks[c]);
+    pf->bits[c] = maskBits(masks[c]);
+  }
+  int lsb = img->byte_order == LSBFirst;
+  if (img->bits_per_pixel == 32 && lsb == lsbHost && img->red_mask == 0xFF0000 && img->green_mask == 0xFF00 &&
+      img->blue_mask == 0xFF && (!alpha || alpha == 0xFF000000))
+  {
+    pf->name = "xrgb32";
+    pf->toArgb = xrgb32ToArgb;
+    pf->fromArgb = xrgb32FromArgb;
+    pf->toRgb = xrgb32ToRgb;
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("ssse3"))
+      pf->toRgb = xrgb32ToRgbSsse3;
+#endif
+#if defined(__aarch64__)
+    pf->toRgb = xrgb32ToRgbNeon;
+#endif
+  }
+  else
+  {
+    // The fallback is last and takes any layout
+    const PixelRowSet *set = pixelRowSets;
+    while (set->bitsPerPixel && (set->bitsPerPixel != img->bits_per_pixel || set->lsb != lsb))
+      set++;
+    pf->name = set->name;
+    pf->toArgb = set->toArgb;
+    pf->fromArgb = set->fromArgb;
+    pf->toRgb = set->toRgb;
+  }
+}
+
+/**
+ * Convert `src` into `dst`, both at least as large, through native words.
+ * `row` holds src->width words, unless dst is xrgb32, which takes them in
+ * place.
+ */
+void imageConvert(XImage *dst, const XImage *src, uint32_t *row)
+{
+  PixelFormat in, out;
+  pixelFormatInit(&in, src);
+  pixelFormatInit(&out, dst);
+  int direct = out.fromArgb == xrgb32FromArgb;
+  for (int y = 0; y < src->height; y++)
+  {
+    uint32_t *words = direct ? (uint32_t *)(dst->data + (size_t)y * dst->bytes_per_line) : row;
+    in.toArgb(&in, src, y, words);
+    if (!direct)
+      out.fromArgb(&out, dst, y, words);
+  }
+}
+
+/**
+ * Packed RGB copy of `image`, freed by the caller. NULL on failure.
+ */
+unsigned char *imageRgb(XImage *image)
+{
+  // Overflow-safe size: w * h * 3 fits in size_t
+  size_t w = (size_t)image->width;
+  size_t h = (size_t)image->height;
+  if (h != 0 && w > SIZE_MAX / 3 / h)
+  {
+    fprintf(stderr, "Screenshot too large to encode.\n");
+    return NULL;
+  }
+  unsigned char *data = malloc(w * 3 * h);
+  if (!data)
+  {
+    fprintf(stderr, "Out of memory for screenshot.\n");
+    return NULL;
+  }
+  PixelFormat pf;
+  pixelFormatInit(&pf, image);
+  for (int y = 0; y < image->height; y++)
+    pf.toRgb(&pf, image, y, data + (size_t)y * w * 3);
+  return data;
+}
+
+/**
+ * QOI ("Quite OK Image") codec: lossless like PNG, but a single pass of
+ * byte-sized ops with no entropy coding, so an order of magnitude faster
+ */
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xC0
+#define QOI_OP_RGB 0xFE
+#define QOI_OP_RGBA 0xFF
+#define QOI_HASH(p) (((p)[0] * 3 + (p)[1] * 5 + (p)[2] * 7 + (p)[3] * 11) % 64)
+
+static inline void qoiPut32(unsigned char *p, uint32_t v)
+{
+  p[0] = v >> 24, p[1] = v >> 16, p[2] = v >> 8, p[3] = v;
+}
+
+/**
+ * QOI of a w x h image of `n` (3 or 4) channels in memory, freed by the
+ * caller
+ */
+unsigned char *qoiEncode(const unsigned char *pixels, int stride, int w, int h, int n, int *outLen)
+{
+  size_t max = (size_t)w * h * (n + 1) + 14 + 8;
+  unsigned char *out = malloc(max);
+  if (!out)
+    return NULL;
+  memcpy(out, "qoif", 4);
+  qoiPut32(out + 4, w);
+  qoiPut32(out + 8, h);
+  out[12] = n;
+  out[13] = 0; // sRGB with linear alpha
+  size_t o = 14;
+
+  unsigned char index[64][4] = {{0}};
+  unsigned char prev[4] = {0, 0, 0, 255}, px[4] = {0, 0, 0, 255};
+  int run = 0;
+  for (int y = 0; y < h; y++)
+  {
+    const unsigned char *row = pixels + (size_t)y * stride;
+    for (int x = 0; x < w; x++, row += n)
+    {
+      memcpy(px, row, n);
+      if (!memcmp(px, prev, 4))
+      {
+        if (++run == 62 || (y == h - 1 && x == w - 1))
+        {
+          out[o++] = QOI_OP_RUN | (run - 1);
+          run = 0;
+        }
+        continue;
+      }
+      if (run)
+      {
+        out[o++] = QOI_OP_RUN | (run - 1);
+        run = 0;
+      }
+      int hash = QOI_HASH(px);
+      if (!memcmp(index[hash], px, 4))
+        out[o++] = QOI_OP_INDEX | hash;
+      else
+      {
+        memcpy(index[hash], px, 4);
+        if (px[3] == prev[3])
+        {
+          signed char vr = px[0] - prev[0], vg = px[1] - prev[1], vb = px[2] - prev[2];
+          signed char vgr = vr - vg, vgb = vb - vg;
+          if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2)
+            out[o++] = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+          else if (vgr > -9 && vgr < 8 && vg > -33 && vg < 32 && vgb > -9 && vgb < 8)
+          {
+            out[o++] = QOI_OP_LUMA | (vg + 32);
+            out[o++] = (vgr + 8) << 4 | (vgb + 8);
+          }
+          else
+          {
+            out[o++] = QOI_OP_RGB;
+            memcpy(out + o, px, 3);
+            o += 3;
+          }
+        }
+        else
+        {
+          out[o++] = QOI_OP_RGBA;
+          memcpy(out + o, px, 4);
+          o += 4;
+        }
+      }
+      memcpy(prev, px, 4);
+    }
+  }
+  static const unsigned char end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+  memcpy(out + o, end, 8);
+  *outLen = (int)(o + 8);
+  return out;
+}
+
+/**
+ * RGBA pixels of the QOI image in `data`, freed by the caller. NULL when
+ * it is not a QOI image.
+ */
+unsigned char *qoiDecode(const unsigned char *data, size_t len, int *w, int *h)
+{
+  if (len < 14 + 8 || memcmp(data, "qoif", 4) != 0)
+    return NULL;
+  uint32_t width = (uint32_t)data[4] << 24 | data[5] << 16 | data[6] << 8 | data[7];
+  uint32_t height = (uint32_t)data[8] << 24 | data[9] << 16 | data[10] << 8 | data[11];
+  if (!width || !height || height >= QOI_PIXELS_MAX / width)
+    return NULL;
+  size_t count = (size_t)width * height;
+  unsigned char *out = malloc(count * 4);
+  if (!out)
+    return NULL;
+
+  unsigned char index[64][4] = {{0}};
+  unsigned char px[4] = {0, 0, 0, 255};
+  size_t p = 14, chunksEnd = len - 8;
+  int run = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    if (run)
+      run--;
+    else if (p < chunksEnd)
+    {
+      int b1 = data[p++];
+      if (b1 == QOI_OP_RGB)
+      {
+        memcpy(px, data + p, 3);
+        p += 3;
+      }
+      else if (b1 == QOI_OP_RGBA)
+      {
+        memcpy(px, data + p, 4);
+        p += 4;
+      }
+      else if ((b1 & 0xC0) == QOI_OP_INDEX)
+        memcpy(px, index[b1], 4);
+      else if ((b1 & 0xC0) == QOI_OP_DIFF)
+      {
+        px[0] += ((b1 >> 4) & 3) - 2;
+        px[1] += ((b1 >> 2) & 3) - 2;
+        px[2] += (b1 & 3) - 2;
+      }
+      else if ((b1 & 0xC0) == QOI_OP_LUMA)
+      {
+        int b2 = data[p++];
+        int vg = (b1 & 0x3F) - 32;
+        px[0] += vg - 8 + ((b2 >> 4) & 0x0F);
+        px[1] += vg;
+        px[2] += vg - 8 + (b2 & 0x0F);
+      }
+      else
+        run = b1 & 0x3F;
+      memcpy(index[QOI_HASH(px)], px, 4);
+    }
+    memcpy(out + i * 4, px, 4);
+  }
+  *w = (int)width;
+  *h = (int)height;
+  return out;
+}
+
+/**
+ * RGBA pixels of the image file at `path` in any format zPen writes,
+ * freed with free()
+ */
+unsigned char *loadImage(const char *path, int *w, int *h)
+{
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return NULL;
+  unsigned char magic[4] = {0};
+  size_t got = fread(magic, 1, 4, f);
+  unsigned char *pixels = NULL;
+  if (got == 4 && !memcmp(magic, "qoif", 4) && fseek(f, 0, SEEK_END) == 0)
+  {
+    long len = ftell(f);
+    unsigned char *data = len > 0 ? malloc(len) : NULL;
+    if (data && fseek(f, 0, SEEK_SET) == 0 && fread(data, 1, len, f) == (size_t)len)
+      pixels = qoiDecode(data, len, w, h);
+    free(data);
+  }
+  else
+  {
+    int channels;
+    pixels = stbi_load(path, w, h, &channels, 4);
+  }
+  fclose(f);
+  return pixels;
+}
+
+/**
+ * Write a w x h image of `n` channels to `path` as `format`
+ */
+int writeImage(const char *path, ImageFormat format, int w, int h, int n, const unsigned char *pixels, int stride,
+               int quality)
+{
+  if (format == IMAGE_QOI)
+  {
+    int len;
+    unsigned char *qoi = qoiEncode(pixels, stride, w, h, n, &len);
+    if (!qoi)
+      return 0;
+    FILE *f = fopen(path, "wb");
+    int ok = f && fwrite(qoi, 1, len, f) == (size_t)len;
+    if (f && fclose(f) != 0)
+      ok = 0;
+    free(qoi);
+    return ok;
+  }
+  if (format != IMAGE_PNG && stride != w * n)
+    return 0; // the other stb writers take packed rows
+  switch (format)
+  {
+  case IMAGE_JPG:
+    return stbi_write_jpg(path, w, h, n, pixels, quality);
+  case IMAGE_BMP:
+    return stbi_write_bmp(path, w, h, n, pixels);
+  case IMAGE_TGA:
+    return stbi_write_tga(path, w, h, n, pixels);
+  default:
+    return writePng(path, w, h, n, pixels, stride);
+  }
+}
+
+/*
+convert to the image format
+
+clipMode controls how the resulting file is shared:
+  0 - save file only
+  1 - save file + copy image to clipboard
+  2 - save file + run tesseract OCR + copy text to clipboard
+*/
+void saveScreenshotFile(XImage *image, int clipMode, ImageFormat format, int quality)
+{
+  if (ensure_zpen_directory() == -1)
+  {
+    fprintf(stderr, "Failed to create or access .zpen directory\n");
+    return;
+  }
+
+  if (image->width <= 0 || image->height <= 0)
+  {
+    fprintf(stderr, "Invalid screenshot dimensions: %dx%d\n", image->width, image->height);
+    return;
+  }
+
+  size_t row = (size_t)image->width * 3;
+  unsigned char *data = imageRgb(image);
+  if (!data)
+    return;
+
+  time_t t = time(NULL);
+  struct tm tm = *localtime(&t);
+  char filename[1024];
+  const char *home = getenv("HOME");
+  if (!home)
+  {
+    fprintf(stderr, "Error: Could not get HOME directory.\n");
+    free(data);
+    return;
+  }
+  snprintf(filename, sizeof(filename), "%s/.zpen/img%04d%02d%02d%02d%02d%02d.%s",
+           home,
+           tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+           tm.tm_hour, tm.tm_min, tm.tm_sec, imageFormats[format].name);
+
+  int wrote = writeImage(filename, format, image->width, image->height, 3, data, (int)row, quality);
+  free(data);
+  if (!wrote)
+  {
+    fprintf(stderr, "Failed to save image: %s\n", filename);
+    return;
+  }
+
+  if (clipMode == 1)
+  {
+    const char *argv[] = {
+        "xclip", "-selection", "clipboard", "-t", imageFormats[format].mime, "-i", filename, NULL};
+    int status = spawn_wait(argv);
+    if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      fprintf(stderr, "xclip failed to copy image to clipboard.\n");
+  }
+  else if (clipMode == 2)
+  {
+    runTesseractOCR(filename);
+  }
+}
+
+/**
+ * Capture waiting for the screenshot encoder. Text redactions set `tool`:
+ * the encoder then puts the boxes of the words to redact in `image`, which
+ * was read at `area`, in `boxes` instead of writing the image.
+ */
+typedef struct ScreenshotJob
+{
+  XImage *image;
+  int clipMode;
+  ImageFormat format;
+  int quality;
+  char tool;
+  XRectangle area;
+  const Settings *settings;
+  XRectangle *boxes;
+  int count; // boxes, or -1 when OCR failed
+  struct ScreenshotJob *next;
+} ScreenshotJob;
+
+/**
+ * Screenshot encoder: one thread converts, writes and shares captures in
+ * order, so the event loop never waits for PNG compression or xclip. It
+ * also runs the OCR of text redactions and hands their boxes back in
+ * `redacted`. It bumps the `done` eventfd after each job to wake the
+ * event loop.
+ */
+static struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t wake; // a job was queued
+  pthread_cond_t idle; // the queue ran empty
+  ScreenshotJob *head, *tail;
+  ScreenshotJob *redacted, *redactedTail; // OCR done, for the event loop
+  int pending;         // queued or being encoded
+  int redacting;       // redactions queued, in OCR or not applied yet
+  int started;
+  int done;            // eventfd, -1 until the thread runs
+} encoder = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, NULL, NULL,
+             0, 0, 0, -1};
+
+static void *encoderThread(void *arg)
+{
+  (void)arg;
+  pthread_mutex_lock(&encoder.lock);
+  for (;;)
+  {
+    while (!encoder.head)
+      pthread_cond_wait(&encoder.wake, &encoder.lock);
+    ScreenshotJob *job = encoder.head;
+    encoder.head = job->next;
+    if (!encoder.head)
+      encoder.tail = NULL;
+    job->next = NULL;
+    pthread_mutex_unlock(&encoder.lock);
+
+    // XImage pixel access never touches the display connection
+    if (job->tool)
+    {
+      unsigned char *rgb = imageRgb(job->image);
+      job->count = rgb ? ocrSensitiveWords(rgb, job->area.width, job->area.height, job->settings, &job->boxes) : -1;
+      free(rgb);
+    }
+    else
+      saveScreenshotFile(job->image, job->clipMode, job->format, job->quality);
+    XDestroyImage(job->image);
+    job->image = NULL;
+
+    pthread_mutex_lock(&encoder.lock);
+    if (!job->tool)
+      free(job);
+    else if (encoder.redactedTail)
+      encoder.redactedTail = encoder.redactedTail->next = job;
+    else
+      encoder.redacted = encoder.redactedTail = job;
+    if (--encoder.pending == 0)
+      pthread_cond_broadcast(&encoder.idle);
+    uint64_t one = 1;
+    if (write(encoder.done, &one, sizeof(one)) == -1)
+      fprintf(stderr, "zpen: encoder wake failed: %s\n", strerror(errno));
+  }
+  return NULL;
+}
+
+/**
+ * Hand `job` over to the encoder, starting it on first use. Returns 0 when
+ * there is no encoder, and the caller still owns the job.
+ */
+static int encoderQueue(ScreenshotJob *job)
+{
+  pthread_mutex_lock(&encoder.lock);
+  if (!encoder.started)
+  {
+    encoder.done = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pthread_t thread;
+    if (encoder.done != -1 && pthread_create(&thread, NULL, encoderThread, NULL) == 0)
+    {
+      pthread_detach(thread);
+      encoder.started = 1;
+    }
+    else if (encoder.done != -1)
+    {
+      close(encoder.done);
+      encoder.done = -1;
+    }
+  }
+  if (!encoder.started)
+  {
+    pthread_mutex_unlock(&encoder.lock);
+    return 0;
+  }
+  if (encoder.tail)
+    encoder.tail->next = job;
+  else
+    encoder.head = job;
+  encoder.tail = job;
+  encoder.pending++;
+  encoder.redacting += job->tool != 0;
+  pthread_cond_signal(&encoder.wake);
+  pthread_mutex_unlock(&encoder.lock);
+  return 1;
+}
+
+/**
+ * Hand `image` over to the encoder. Returns 0 when there is no encoder,
+ * and the caller still owns the image.
+ */
+int screenshotQueue(XImage *image, int clipMode, ImageFormat format, int quality)
+{
+  ScreenshotJob *job = malloc(sizeof(*job));
+  if (!job)
+    return 0;
+  *job = (ScreenshotJob){image, clipMode, format, quality, 0, {0, 0, 0, 0}, NULL, NULL, 0, NULL};
+  if (encoderQueue(job))
+    return 1;
+  free(job);
+  return 0;
+}
+
+/**
+ * Hand the text redaction of `image`, read at `area`, with tool `tool`
+ * and the patterns of `st` over to the encoder. Returns 0 when there is no
+ * encoder, and the caller still owns the image.
+ */
+int redactionQueue(XImage *image, XRectangle area, char tool, const Settings *st)
+{
+  ScreenshotJob *job = malloc(sizeof(*job));
+  if (!job)
+    return 0;
+  *job = (ScreenshotJob){image, 0, IMAGE_PNG, 0, tool, area, st, NULL, 0, NULL};
+  if (encoderQueue(job))
+    return 1;
+  free(job);
+  return 0;
+}
+
+/**
+ * The oldest text redaction whose OCR is done, or NULL. The caller applies
+ * it and frees the job and its boxes.
+ */
+ScreenshotJob *redactionTake(void)
+{
+  pthread_mutex_lock(&encoder.lock);
+  ScreenshotJob *job = encoder.redacted;
+  if (job)
+  {
+    encoder.redacted = job->next;
+    if (!encoder.redacted)
+      encoder.redactedTail = NULL;
+    encoder.redacting--;
+  }
+  pthread_mutex_unlock(&encoder.lock);
+  return job;
+}
+
+/**
+ * Number of text redactions not applied yet
+ */
+int redactionsPending(void)
+{
+  pthread_mutex_lock(&encoder.lock);
+  int redacting = encoder.redacting;
+  pthread_mutex_unlock(&encoder.lock);
+  return redacting;
+}
+
+/**
+ * Number of screenshots not written yet, counting redactions in OCR.
+ * Clears the wake-up of `done`.
+ */
+int screenshotsPending(void)
+{
+  uint64_t count;
+  if (encoder.done != -1 && read(encoder.done, &count, sizeof(count)) == -1 && errno != EAGAIN)
+    fprintf(stderr, "zpen: encoder read failed: %s\n", strerror(errno));
+  pthread_mutex_lock(&encoder.lock);
+  int pending = encoder.pending;
+  pthread_mutex_unlock(&encoder.lock);
+  return pending;
+}
+
+/**
+ * Block until every queued screenshot is written and shared, and no OCR
+ * runs any more
+ */
+void screenshotsWait(void)
+{
+  pthread_mutex_lock(&encoder.lock);
+  while (encoder.pending)
+    pthread_cond_wait(&encoder.idle, &encoder.lock);
+  pthread_mutex_unlock(&encoder.lock);
+}
+
+/**
+ * Clipboard image type to paste: the first of zPen's formats the owner
+ * offers, PNG when the offer cannot be read
+ */
+static const char *clipboardImageType(void)
+{
+  int pipefd[2];
+  if (pipe(pipefd) == -1)
+    return imageFormats[IMAGE_PNG].mime;
+  pid_t pid = fork();
+  if (pid == -1)
+  {
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return imageFormats[IMAGE_PNG].mime;
+  }
+  if (pid == 0)
+  {
+    dup2(pipefd[1], STDOUT_FILENO);
+    close(pipefd[0]);
+    close(pipefd[1]);
+    int devnull = open("/dev/null", O_WRONLY);
+    if (devnull != -1)
+    {
+      dup2(devnull, STDERR_FILENO);
+      close(devnull);
+    }
+    execlp("xclip", "xclip", "-selection", "clipboard", "-t", "TARGETS", "-o", (char *)NULL);
+    _exit(127);
+  }
+  close(pipefd[1]);
+  char targets[4096];
+  size_t len = 0;
+  ssize_t got;
+  while ((got = read(pipefd[0], targets + len, sizeof(targets) - 1 - len)) > 0 ||
+         (got == -1 && errno == EINTR))
+    if (got > 0)
+      len += got;
+  close(pipefd[0]);
+  while (waitpid(pid, NULL, 0) == -1 && errno == EINTR) {}
+  targets[len] = '\0';
+
+  for (int i = 0; i < IMAGE_FORMATS; i++)
+  {
+    const char *mime = imageFormats[i].mime;
+    size_t n = strlen(mime);
+    for (const char *t = strstr(targets, mime); t; t = strstr(t + 1, mime))
+      if ((t == targets || t[-1] == '\n') && (t[n] == '\n' || t[n] == '\0'))
+        return mime;
+  }
+  return imageFormats[IMAGE_PNG].mime;
+}
+
+void pasteClipboard(Display *d, Drawable w, GC gc, XVisualInfo *vinfo, int mouse_x, int mouse_y, unsigned int win_width, unsigned int win_height)
+{
+  const char *type = clipboardImageType();
+
+  // Receive xclip output into a secure temp file (no shell, no fixed path).
+  char tmp_path[1024];
+  snprintf(tmp_path, sizeof(tmp_path), "%s/zpen-paste-XXXXXX", tmp_dir());
+  int tmp_fd = mkstemp(tmp_path);
+  if (tmp_fd == -1)
+  {
+    fprintf(stderr, "Paste: failed to create temp file: %s\n", strerror(errno));
+    return;
+  }
+
+  pid_t pid = fork();
+  if (pid == -1)
+  {
+    close(tmp_fd);
+    unlink(tmp_path);
+    return;
+  }
+  if (pid == 0)
+  {
+    dup2(tmp_fd, STDOUT_FILENO);
+    close(tmp_fd);
+    int devnull = open("/dev/null", O_WRONLY);
+    if (devnull != -1)
+    {
+      dup2(devnull, STDERR_FILENO);
+      close(devnull);
+    }
+    execlp("xclip", "xclip", "-selection", "clipboard", "-t", type, "-o", (char *)NULL);
+    _exit(127);
+  }
+  close(tmp_fd);
+  int status = 0;
+  while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {}
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+  {
+    fprintf(stderr, "No image in clipboard or xclip failed\n");
+    unlink(tmp_path);
+    return;
+  }
+
+  // Decode to RGBA
+  int img_w, img_h;
+  unsigned char *data = loadImage(tmp_path, &img_w, &img_h);
+  unlink(tmp_path);
+  if (!data)
+  {
+    fprintf(stderr, "Failed to load clipboard image\n");
+    return;
+  }
+
+  // Bound dimensions before allocating; rejects malformed PNGs that would
+  // demand absurd memory.
+  const int MAX_PASTE_DIM = 8192;
+  if (img_w <= 0 || img_h <= 0 || img_w > MAX_PASTE_DIM || img_h > MAX_PASTE_DIM)
+  {
+    fprintf(stderr, "Pasted image dimensions out of range: %dx%d\n", img_w, img_h);
+    free(data);
+    return;
+  }
+
+  // Create XImage from loaded data
+  XImage *img = XCreateImage(d, vinfo->visual, 32, ZPixmap, 0, NULL, img_w, img_h, 32, 0);
+  if (!img)
+  {
+    fprintf(stderr, "Paste: XCreateImage failed\n");
+    free(data);
+    return;
+  }
+  size_t img_data_size = (size_t)img->bytes_per_line * (size_t)img_h;
+  img->data = malloc(img_data_size);
+  if (!img->data)
+  {
+    fprintf(stderr, "Paste: out of memory\n");
+    XDestroyImage(img);
+    free(data);
+    return;
+  }
+
+  uint32_t *row = malloc((size_t)img_w * 4);
+  if (!row)
+  {
+    fprintf(stderr, "Paste: out of memory\n");
+    XDestroyImage(img);
+    free(data);
+    return;
+  }
+  PixelFormat pf;
+  pixelFormatInit(&pf, img);
+  for (int y = 0; y < img_h; y++)
+  {
+    const unsigned char *rgba = data + (size_t)y * img_w * 4;
+    for (int x = 0; x < img_w; x++)
+      row[x] = (uint32_t)rgba[x * 4 + 3] << 24 | rgba[x * 4] << 16 | rgba[x * 4 + 1] << 8 | rgba[x * 4 + 2];
+    pf.fromArgb(&pf, img, y, row);
+  }
+  free(row);
+
+  // Draw gradient drop shadow on bottom and right edges
+  {
+    int shadow_size = 6;
+    XRenderPictFormat *fmt = XRenderFindVisualFormat(d, vinfo->visual);
+    Picture dst = XRenderCreatePicture(d, w, fmt, 0, NULL);
+    for (int i = 1; i <= shadow_size; i++)
+    {
+      unsigned short alpha = (unsigned short)(0x4000 * (shadow_size - i + 1) / shadow_size);
+      XRenderColor rc = {0, 0, 0, alpha};
+      // Bottom edge strip
+      int bx = mouse_x + i;
+      int by = mouse_y + img_h + i - 1;
+      int bw = img_w + shadow_size - i;
+      if (bx + bw > (int)win_width)
+        bw = (int)win_width - bx;
+      if (by < (int)win_height && bw > 0)
+        XRenderFillRectangle(d, PictOpOver, dst, &rc, bx, by, bw, 1);
+      // Right edge strip
+      int rx = mouse_x + img_w + i - 1;
+      int ry = mouse_y + i;
+      int rh = img_h + shadow_size - i;
+      if (ry + rh > (int)win_height)
+        rh = (int)win_height - ry;
+      if (rx < (int)win_width && rh > 0)
+        XRenderFillRectangle(d, PictOpOver, dst, &rc, rx, ry, 1, rh);
+    }
+    XRenderFreePicture(d, dst);
+  }
+
+  // Clip image to window bounds
+  int paste_w = img_w;
+  int paste_h = img_h;
+  if (mouse_x + paste_w > (int)win_width)
+    paste_w = (int)win_width - mouse_x;
+  if (mouse_y + paste_h > (int)win_height)
+    paste_h = (int)win_height - mouse_y;
+  if (paste_w > 0 && paste_h > 0)
+    XPutImage(d, w, gc, img, 0, 0, mouse_x, mouse_y, paste_w, paste_h);
+
+  // Draw a subtle 1px border on top and left edges
+  {
+    XRenderPictFormat *fmt = XRenderFindVisualFormat(d, vinfo->visual);
+    Picture dst = XRenderCreatePicture(d, w, fmt, 0, NULL);
+    XRenderColor rc = {0, 0, 0, 0x1800};                                         // Black at ~9% opacity
+    XRenderFillRectangle(d, PictOpOver, dst, &rc, mouse_x, mouse_y, paste_w, 1); // top edge
+    XRenderFillRectangle(d, PictOpOver, dst, &rc, mouse_x, mouse_y, 1, paste_h); // left edge
+    XRenderFreePicture(d, dst);
+  }
+
+  XDestroyImage(img); // This also frees img->data
+  free(data);
+  XFlush(d);
+}
+
+static inline void addPoint(Path *p, int x, int y)
+{
+  da_append(p, ((Point){x, y}));
+}
+
+void smoothPath(Path *path, int smoothing_level)
+{
+  if (smoothing_level <= 1 || path->count < 3)
+    return;
+
+  Path smoothed_path = {0};
+
+  for (int i = 0; i < path->count; i++)
+  {
+    if (i == 0 || i == path->count - 1)
+    {
+      // Preserve first and last points exactly to avoid gaps
+      addPoint(&smoothed_path, path->items[i].x, path->items[i].y);
+    }
+    else
+    {
+      // Apply smoothing only to interior points
+      int sum_x = 0, sum_y = 0, count = 0;
+      for (int j = -smoothing_level; j <= smoothing_level; j++)
+      {
+        int index = i + j;
+        if (index >= 0 && index < path->count)
+        {
+          sum_x += path->items[index].x;
+          sum_y += path->items[index].y;
+          count++;
+        }
+      }
+      addPoint(&smoothed_path, sum_x / count, sum_y / count);
+    }
+  }
+
+  // Copy back the smoothed points
+  path->count = 0;
+  for (int i = 0; i < smoothed_path.count; i++)
+  {
+    addPoint(path, smoothed_path.items[i].x, smoothed_path.items[i].y);
+  }
+  free(smoothed_path.items);
+}
+
+// Build guide line color: the preview GC draws double dashes that alternate
+// between this opaque color and black, which stays readable on any background
+static unsigned long guideColor(unsigned long c)
+{
+  return c | 0xFF000000;
+}
+
+/**
+ * Draw an path
+ * p: array of points (x,y)
+ */
+void drawPath(Display *d, Window w, GC gc, Path *p)
+{
+  for (int i = 1; i < p->count; i++)
+  {
+    XDrawLine(d, w, gc,
+              p->items[i - 1].x, p->items[i - 1].y,
+              p->items[i].x, p->items[i].y);
+  }
+}
+
+/**
+ * Bounding box of a path, padded by the line width
+ */
+XRectangle pathBounds(const Path *p, int lineWidth)
+{
+  if (p->count == 0)
+    return (XRectangle){0, 0, 0, 0};
+  int left = p->items[0].x, right = left, top = p->items[0].y, bottom = top;
+  for (size_t i = 1; i < p->count; i++)
+  {
+    if (p->items[i].x < left)
+      left = p->items[i].x;
+    if (p->items[i].x > right)
+      right = p->items[i].x;
+    if (p->items[i].y < top)
+      top = p->items[i].y;
+    if (p->items[i].y > bottom)
+      bottom = p->items[i].y;
+  }
+  int pad = lineWidth / 2 + 2;
+  return (XRectangle){left - pad, top - pad, right - left + 2 * pad, bottom - top + 2 * pad};
+}
+
+/**
+ * Draw the segments of a path that start at point `from` with a single
+ * XDrawSegments request per chunk, instead of one request per segment
+ */
+void drawPathSegments(Display *d, Window w, GC gc, Path *p, size_t from)
+{
+  XSegment seg[256];
+  int n = 0;
+  for (size_t i = from + 1; i < p->count; i++)
+  {
+    seg[n++] = (XSegment){p->items[i - 1].x, p->items[i - 1].y, p->items[i].x, p->items[i].y};
+    if (n == (int)(sizeof(seg) / sizeof(seg[0])))
+    {
+      XDrawSegments(d, w, gc, seg, n);
+      n = 0;
+    }
+  }
+  if (n > 0)
+    XDrawSegments(d, w, gc, seg, n);
+}
+
+/**
+ * Geometry of one shape: every primitive a shape helper produces, so the
+ * whole shape goes to the server with one request per primitive kind
+ * instead of one request per line or arc. The same geometry gives the
+ * damage box of a preview and can be reused for hit-testing or export.
+ */
+#define GEOMETRY_MAX_SEGMENTS 16
+#define GEOMETRY_MAX_ARCS 4
+
+typedef struct
+{
+  XSegment segments[GEOMETRY_MAX_SEGMENTS];
+  XArc arcs[GEOMETRY_MAX_ARCS];
+  XRectangle rect;
+  int nSegments, nArcs, nRects;
+} ShapeGeometry;
+
+static inline void geometryReset(ShapeGeometry *g)
+{
+  g->nSegments = g->nArcs = g->nRects = 0;
+}
+
+static inline void addSegment(ShapeGeometry *g, int x0, int y0, int x1, int y1)
+{
+  if (g->nSegments < GEOMETRY_MAX_SEGMENTS)
+    g->segments[g->nSegments++] = (XSegment){x0, y0, x1, y1};
+}
+
+static inline void addArc(ShapeGeometry *g, int x, int y, int width, int height, int angle1, int angle2)
+{
+  if (g->nArcs < GEOMETRY_MAX_ARCS)
+    g->arcs[g->nArcs++] = (XArc){x, y, width, height, angle1, angle2};
+}
+
+/**
+ * Submit a shape: at most one XDrawSegments, one XDrawArcs and one
+ * XDrawRectangle request
+ */
+void drawGeometry(Display *d, Drawable w, GC gc, const ShapeGeometry *g)
+{
+  if (g->nSegments)
+    XDrawSegments(d, w, gc, (XSegment *)g->segments, g->nSegments);
+  if (g->nArcs)
+    XDrawArcs(d, w, gc, (XArc *)g->arcs, g->nArcs);
+  if (g->nRects)
+    XDrawRectangle(d, w, gc, g->rect.x, g->rect.y, g->rect.width, g->rect.height);
+}
+
+static inline void growBounds(int *left, int *top, int *right, int *bottom, int x, int y)
+{
+  if (x < *left)
+    *left = x;
+  if (x > *right)
+    *right = x;
+  if (y < *top)
+    *top = y;
+  if (y > *bottom)
+    *bottom = y;
+}
+
+/**
+ * Area covered by a shape, padded by the line width. Empty for a shape
+ * without primitives.
+ */
+XRectangle geometryBounds(const ShapeGeometry *g, int lineWidth)
+{
+  int left = INT32_MAX, top = INT32_MAX, right = INT32_MIN, bottom = INT32_MIN;
+  for (int i = 0; i < g->nSegments; i++)
+  {
+    growBounds(&left, &top, &right, &bottom, g->segments[i].x1, g->segments[i].y1);
+    growBounds(&left, &top, &right, &bottom, g->segments[i].x2, g->segments[i].y2);
+  }
+  for (int i = 0; i < g->nArcs; i++)
+  {
+    growBounds(&left, &top, &right, &bottom, g->arcs[i].x, g->arcs[i].y);
+    growBounds(&left, &top, &right, &bottom, g->arcs[i].x + g->arcs[i].width, g->arcs[i].y + g->arcs[i].height);
+  }
+  if (g->nRects)
+  {
+    growBounds(&left, &top, &right, &bottom, g->rect.x, g->rect.y);
+    growBounds(&left, &top, &right, &bottom, g->rect.x + g->rect.width, g->rect.y + g->rect.height);
+  }
+  if (right < left)
+    return (XRectangle){0, 0, 0, 0};
+  int pad = lineWidth / 2 + 2;
+  return (XRectangle){left - pad, top - pad, right - left + 2 * pad, bottom - top + 2 * pad};
+}
+
+/**
+ * Build a line
+ * x0, y0: point that marks the tip of the line
+ * x1, y1: point that marks the end of the line
+ */
+void buildLine(ShapeGeometry *g, int x0, int y0, int x1, int y1)
+{
+  addSegment(g, x0, y0, x1, y1);
+}
+
+/**
+ * Build the two strokes of an arrow head pointing at x1, y1
+ */
+void buildArrowHead(ShapeGeometry *g, int x1, int y1, float angle, int arrowSize)
+{
+  float arrowAngle = PI / 4;
+  int f_x1 = x1 - arrowSize * cos(angle + arrowAngle);
+  int f_y1 = y1 - arrowSize * sin(angle + arrowAngle);
+  int f_x2 = x1 - arrowSize * cos(angle - arrowAngle);
+  int f_y2 = y1 - arrowSize * sin(angle - arrowAngle);
+  addSegment(g, x1, y1, f_x1, f_y1);
+  addSegment(g, x1, y1, f_x2, f_y2);
+}
+
+/**
+ * Build an arrow
+ * x0, y0: point that marks the tail of the arrow
+ * x1, y1: point that marks the tip of the arrow
+ */
+void buildArrow(ShapeGeometry *g, int x0, int y0, int x1, int y1, int arrowSize)
+{
+  addSegment(g, x0, y0, x1, y1);
+  float angle = atan2(y0 - y1, x0 - x1) + PI;
+  buildArrowHead(g, x1, y1, angle, arrowSize);
+}
+
+/**
+ * Build a rectangle
+ * x0, y0 : point that marks a corner of the rectangle
+ * x1, y1 : point that marks the opposite corner of the rectangle
+ * */
+void buildRectangle(ShapeGeometry *g, int x0, int y0, int x1, int y1)
+{
+  g->rect = (XRectangle){(x0 < x1) ? x0 : x1, (y0 < y1) ? y0 : y1, abs(x1 - x0), abs(y1 - y0)};
+  g->nRects = 1;
+}
+
+/**
+ * Build a rounded rectangle
+ * x0, y0 : point that marks a corner of the rectangle
+ * x1, y1 : point that marks the opposite corner of the rectangle
+ * */
+void buildRoundedRectangle(ShapeGeometry *g, int x0, int y0, int x1, int y1)
+{
+  int height = abs(y1 - y0);
+  int width = abs(x1 - x0);
+  int x = (x0 < x1) ? x0 : x1;
+  int y = (y0 < y1) ? y0 : y1;
+
+  // Corner radius is proportional to the smaller dimension
+  int radius = (width < height ? width : height) / 10;
+  if (radius < 3)
+    radius = 3;
+  if (radius > 15)
+    radius = 15;
+
+  int diameter = radius * 2;
+
+  // Four corners (arcs): top-left, top-right, bottom-right, bottom-left
+  addArc(g, x, y, diameter, diameter, 90 * 64, 90 * 64);
+  addArc(g, x + width - diameter, y, diameter, diameter, 0, 90 * 64);
+  addArc(g, x + width - diameter, y + height - diameter, diameter, diameter, 270 * 64, 90 * 64);
+  addArc(g, x, y + height - diameter, diameter, diameter, 180 * 64, 90 * 64);
+
+  // Four sides (lines): top, right, bottom, left
+  addSegment(g, x + radius, y, x + width - radius, y);
+  addSegment(g, x + width, y + radius, x + width, y + height - radius);
+  addSegment(g, x + radius, y + height, x + width - radius, y + height);
+  addSegment(g, x, y + radius, x, y + height - radius);
+}
+
+/**
+ * Build a circle
+ * x0, y0 : center of the circle
+ * width : diameter of the circle
+ * */
+void buildCircle(ShapeGeometry *g, int x0, int y0, int width)
+{
+  addArc(g, x0 - (int)(width / 2), y0 - (int)(width / 2), width, width, 0, 360 * 64);
+}
+
+/**
+ * Build an axis-aligned ellipse
+ * x0, y0 : point that marks a corner of the bounding box
+ * x1, y1 : point that marks the opposite corner of the bounding box
+ * */
+void buildEllipse(ShapeGeometry *g, int x0, int y0, int x1, int y1)
+{
+  int x = (x0 < x1) ? x0 : x1;
+  int y = (y0 < y1) ? y0 : y1;
+  addArc(g, x, y, abs(x1 - x0), abs(y1 - y0), 0, 360 * 64);
+}
+
+/**
+ * Draw an line on the screen
+ * x0, y0: point that marks the tip of the line
+ * x1, y1: point that marks the end of the line
+ */
+void drawLine(Display *d, Window w, GC gc, int x0, int y0, int x1, int y1)
+{
+  XDrawLine(d, w, gc, x0, y0, x1, y1);
+}
+
+/**
+ * Draw an arrow head on the screen
+ */
+void drawArrowHead(Display *d, Window w, GC gc, int x1, int y1, float angle, int arrowSize)
+{
+  ShapeGeometry g;
+  geometryReset(&g);
+  buildArrowHead(&g, x1, y1, angle, arrowSize);
+  drawGeometry(d, w, gc, &g);
+}
+
+void drawArrow(Display *d, Window w, GC gc, int x0, int y0, int x1, int y1, int arrowSize)
+{
+  ShapeGeometry g;
+  geometryReset(&g);
+  buildArrow(&g, x0, y0, x1, y1, arrowSize);
+  drawGeometry(d, w, gc, &g);
+}
+
+void drawRetangle(Display *d, Window w, GC gc, int x0, int y0, int x1, int y1)
+{
+  ShapeGeometry g;
+  geometryReset(&g);
+  buildRectangle(&g, x0, y0, x1, y1);
+  drawGeometry(d, w, gc, &g);
+}
+
+void drawRoundedRetangle(Display *d, Window w, GC gc, int x0, int y0, int x1, int y1)
+{
+  ShapeGeometry g;
+  geometryReset(&g);
+  buildRoundedRectangle(&g, x0, y0, x1, y1);
+  drawGeometry(d, w, gc, &g);
+}
+
+void drawCircle(Display *d, Window w, GC gc, int x0, int y0, int width)
+{
+  ShapeGeometry g;
+  geometryReset(&g);
+  buildCircle(&g, x0, y0, width);
+  drawGeometry(d, w, gc, &g);
+}
+
+void drawEllipse(Display *d, Window w, GC gc, int x0, int y0, int x1, int y1)
+{
+  ShapeGeometry g;
+  geometryReset(&g);
+  buildEllipse(&g, x0, y0, x1, y1);
+  drawGeometry(d, w, gc, &g);
+}
+
+/**
+ * draws the horizontal color palette at the bottom-right of the screen
+ * and returns the area it covers
+ * */
+XRectangle drawColorPalette(Display *d, Window w, GC gc, int screen_width, int screen_height, unsigned long color_list[], int selected_color_index, int thickness, int dashed)
+{
+  int circle_size = 8; // Small circle size
+  int gap = 4;         // Small gap between circles
+  int palette_width = MAX_COLORS * circle_size + (MAX_COLORS - 1) * gap;
+  int start_x = screen_width - palette_width - 4; // 4px margin from right edge
+  int y = screen_height - 10;                     // Position from bottom edge (accounting for -35 window offset)
+
+  // Save current GC color and line attributes (the palette shares its GC with
+  // the pen, so we need to neutralize the user's thickness/dash settings while
+  // drawing the selection ring and restore them on the way out).
+  XGCValues values;
+  XGetGCValues(d, gc, GCForeground | GCLineWidth | GCLineStyle | GCCapStyle | GCJoinStyle, &values);
+  unsigned long original_color = values.foreground;
+
+  XSetLineAttributes(d, gc, 1, LineSolid, CapButt, JoinMiter);
+
+  for (int i = 0; i < MAX_COLORS; i++)
+  {
+    int x = start_x + i * (circle_size + gap);
+
+    // Clear the border area first with fully transparent black to erase any previous selection indicator
+    XSetForeground(d, gc, 0x00000000);
+    XFillArc(d, w, gc, x - circle_size / 2 - 3, y - circle_size / 2 - 3, circle_size + 6, circle_size + 6, 0, 360 * 64);
+
+    // Set color for this circle
+    XSetForeground(d, gc, color_list[i]);
+
+    // Draw filled circle
+    XFillArc(d, w, gc, x - circle_size / 2, y - circle_size / 2, circle_size, circle_size, 0, 360 * 64);
+
+    if (i == selected_color_index)
+    {
+      // Add white border for selected color
+      XSetForeground(d, gc, 0xFFFFFFFF);
+      XDrawArc(d, w, gc, x - circle_size / 2, y - circle_size / 2, circle_size, circle_size, 0, 360 * 64);
+    }
+  }
+
+  // Stroke-size / dash-pattern indicator to the left of the first color.
+  int indicator_w = circle_size * 3;
+  int indicator_right = start_x - circle_size / 2 - gap;
+  int indicator_left = indicator_right - indicator_w;
+  // Clear previous indicator. CapButt keeps the drawn pixels strictly inside
+  // [indicator_left, indicator_right], so a tight horizontal clear is enough
+  // — extending further right would erase the first color circle.
+  XSetForeground(d, gc, 0x00000000);
+  XFillRectangle(d, w, gc, indicator_left - 2, y - 12, indicator_w + 4, 24);
+  // Draw indicator in current color with current thickness and dash pattern.
+  // CapButt keeps the line strictly within [indicator_left, indicator_right]
+  // so the gap to the first color circle stays constant as thickness grows.
+  XSetForeground(d, gc, color_list[selected_color_index]);
+  if (dashed)
+  {
+    char dp[] = {8, 6};
+    XSetDashes(d, gc, 0, dp, 2);
+  }
+  XSetLineAttributes(d, gc, thickness, dashed ? LineOnOffDash : LineSolid, CapButt, JoinMiter);
+  XDrawLine(d, w, gc, indicator_left, y, indicator_right, y);
+
+  // Restore original GC state
+  XSetForeground(d, gc, original_color);
+  XSetLineAttributes(d, gc, values.line_width, values.line_style, values.cap_style, values.join_style);
+
+  int right = start_x + (MAX_COLORS - 1) * (circle_size + gap) + circle_size / 2 + 4;
+  return (XRectangle){indicator_left - 2, y - 12, right - (indicator_left - 2), 24};
+}
+
+/**
+ * Draw the "saving..." note above the palette while screenshots are being
+ * written, "redacting..." while text redactions wait for OCR, or clear it.
+ * Returns the area of the note.
+ */
+XRectangle drawSavingIndicator(Display *d, Drawable w, GC gc, int screen_width, int screen_height, int saving,
+                               int redacting)
+{
+  const char *label = redacting ? "redacting..." : "saving...";
+  XRectangle r = {screen_width - 88, screen_height - 40, 84, 16};
+  XGCValues values;
+  XGetGCValues(d, gc, GCForeground, &values);
+  int shown = saving || redacting;
+  XSetForeground(d, gc, shown ? 0xA0000000 : 0x00000000);
+  XFillRectangle(d, w, gc, r.x, r.y, r.width, r.height);
+  if (shown)
+  {
+    XSetForeground(d, gc, 0xFFFFFFFF);
+    XDrawString(d, w, gc, r.x + 6, r.y + 12, label, strlen(label));
+  }
+  XSetForeground(d, gc, values.foreground);
+  return r;
+}
+
+/**
+ * Build an opening curly brace
+ * x0, y0 : top point of the brace
+ * x1, y1 : bottom point of the brace
+ * */
+void buildOpeningBrace(ShapeGeometry *g, int x0, int y0, int x1, int y1)
+{
+  int height = abs(y1 - y0);
+  int width = abs(x1 - x0);
+  int midY = (y0 + y1) / 2;
+  int leftX = (x0 < x1) ? x0 : x1;
+  int topY = (y0 < y1) ? y0 : y1;
+  int rightX = leftX + width;
+  int bottomY = topY + height;
+  int quarterH = height / 4;
+  int sixthW = width / 6;
+  int indentAmount = width / 4; // Shallow indent, not all the way to left
+
+  // Opening brace { with shallow middle indent
+  // Top horizontal section
+  addSegment(g, leftX + width / 3, topY, rightX - sixthW / 2, topY);
+  // Top right curve downward
+  addSegment(g, rightX - sixthW / 2, topY, rightX - sixthW / 3, topY + sixthW / 2);
+  addSegment(g, rightX - sixthW / 3, topY + sixthW / 2, rightX - sixthW / 4, topY + sixthW);
+  // Right side to upper middle
+  addSegment(g, rightX - sixthW / 4, topY + sixthW, rightX - sixthW / 4, midY - quarterH / 2);
+  // Gentle curve outward for upper middle (angle RIGHT - inverted)
+  addSegment(g, rightX - sixthW / 4, midY - quarterH / 2, rightX + indentAmount, midY - sixthW / 3);
+  addSegment(g, rightX + indentAmount, midY - sixthW / 3, rightX + indentAmount + sixthW / 4, midY);
+  // Gentle curve inward for lower middle (back from right bulge)
+  addSegment(g, rightX + indentAmount + sixthW / 4, midY, rightX + indentAmount, midY + sixthW / 3);
+  addSegment(g, rightX + indentAmount, midY + sixthW / 3, rightX - sixthW / 4, midY + quarterH / 2);
+  // Right side from lower middle to bottom
+  addSegment(g, rightX - sixthW / 4, midY + quarterH / 2, rightX - sixthW / 4, bottomY - sixthW);
+  // Bottom right curve upward
+  addSegment(g, rightX - sixthW / 4, bottomY - sixthW, rightX - sixthW / 3, bottomY - sixthW / 2);
+  addSegment(g, rightX - sixthW / 3, bottomY - sixthW / 2, rightX - sixthW / 2, bottomY);
+  // Bottom horizontal section
+  addSegment(g, rightX - sixthW / 2, bottomY, leftX + width / 3, bottomY);
+}
+
+/**
+ * Build a closing curly brace
+ * x0, y0 : top point of the brace
+ * x1, y1 : bottom point of the brace
+ * */
+void buildClosingBrace(ShapeGeometry *g, int x0, int y0, int x1, int y1)
+{
+  int height = abs(y1 - y0);
+  int width = abs(x1 - x0);
+  int midY = (y0 + y1) / 2;
+  int leftX = (x0 < x1) ? x0 : x1;
+  int topY = (y0 < y1) ? y0 : y1;
+  int rightX = leftX + width;
+  int bottomY = topY + height;
+  int quarterH = height / 4;
+  int sixthW = width / 6;
+  int bulgeAmount = width / 4; // Shallow bulge, not all the way to right
+
+  // Closing brace } with shallow middle bulge
+  // Top horizontal section
+  addSegment(g, rightX - width / 3, topY, leftX + sixthW / 2, topY);
+  // Top left curve downward
+  addSegment(g, leftX + sixthW / 2, topY, leftX + sixthW / 3, topY + sixthW / 2);
+  addSegment(g, leftX + sixthW / 3, topY + sixthW / 2, leftX + sixthW / 4, topY + sixthW);
+  // Left side to upper middle
+  addSegment(g, leftX + sixthW / 4, topY + sixthW, leftX + sixthW / 4, midY - quarterH / 2);
+  // Gentle curve outward for upper middle (angle LEFT - inverted)
+  addSegment(g, leftX + sixthW / 4, midY - quarterH / 2, leftX - bulgeAmount, midY - sixthW / 3);
+  addSegment(g, leftX - bulgeAmount, midY - sixthW / 3, leftX - bulgeAmount - sixthW / 4, midY);
+  // Gentle curve inward for lower middle (back from left indent)
+  addSegment(g, leftX - bulgeAmount - sixthW / 4, midY, leftX - bulgeAmount, midY + sixthW / 3);
+  addSegment(g, leftX - bulgeAmount, midY + sixthW / 3, leftX + sixthW / 4, midY + quarterH / 2);
+  // Left side from lower middle to bottom
+  addSegment(g, leftX + sixthW / 4, midY + quarterH / 2, leftX + sixthW / 4, bottomY - sixthW);
+  // Bottom left curve upward
+  addSegment(g, leftX + sixthW / 4, bottomY - sixthW, leftX + sixthW / 3, bottomY - sixthW / 2);
+  addSegment(g, leftX + sixthW / 3, bottomY - sixthW / 2, leftX + sixthW / 2, bottomY);
+  // Bottom horizontal section
+  addSegment(g, leftX + sixthW / 2, bottomY, rightX - width / 3, bottomY);
+}
+
+/**
+ * Build an opening square bracket
+ * x0, y0 : top point of the bracket
+ * x1, y1 : bottom point of the bracket
+ * */
+void buildOpeningBracket(ShapeGeometry *g, int x0, int y0, int x1, int y1)
+{
+  int height = abs(y1 - y0);
+  int width = abs(x1 - x0);
+  int leftX = (x0 < x1) ? x0 : x1;
+  int topY = (y0 < y1) ? y0 : y1;
+  int rightX = leftX + width;
+  int bottomY = topY + height;
+  int sixthW = width / 6;
+
+  // Opening bracket [ - simple rectangular shape
+  // Top horizontal line
+  addSegment(g, leftX + width / 3, topY, rightX - sixthW / 2, topY);
+  // Top right curve downward
+  addSegment(g, rightX - sixthW / 2, topY, rightX - sixthW / 3, topY + sixthW / 2);
+  addSegment(g, rightX - sixthW / 3, topY + sixthW / 2, rightX - sixthW / 4, topY + sixthW);
+  // Right side vertical line (no middle angle)
+  addSegment(g, rightX - sixthW / 4, topY + sixthW, rightX - sixthW / 4, bottomY - sixthW);
+  // Bottom right curve upward
+  addSegment(g, rightX - sixthW / 4, bottomY - sixthW, rightX - sixthW / 3, bottomY - sixthW / 2);
+  addSegment(g, rightX - sixthW / 3, bottomY - sixthW / 2, rightX - sixthW / 2, bottomY);
+  // Bottom horizontal line
+  addSegment(g, rightX - sixthW / 2, bottomY, leftX + width / 3, bottomY);
+}
+
+/**
+ * Build a closing square bracket
+ * x0, y0 : top point of the bracket
+ * x1, y1 : bottom point of the bracket
+ * */
+void buildClosingBracket(ShapeGeometry *g, int x0, int y0, int x1, int y1)
+{
+  int height = abs(y1 - y0);
+  int width = abs(x1 - x0);
+  int leftX = (x0 < x1) ? x0 : x1;
+  int topY = (y0 < y1) ? y0 : y1;
+  int rightX = leftX + width;
+  int bottomY = topY + height;
+  int sixthW = width / 6;
+
+  // Closing bracket ] - simple rectangular shape
+  // Top horizontal line
+  addSegment(g, rightX - width / 3, topY, leftX + sixthW / 2, topY);
+  // Top left curve downward
+  addSegment(g, leftX + sixthW / 2, topY, leftX + sixthW / 3, topY + sixthW / 2);
+  addSegment(g, leftX + sixthW / 3, topY + sixthW / 2, leftX + sixthW / 4, topY + sixthW);
+  // Left side vertical line (no middle angle)
+  addSegment(g, leftX + sixthW / 4, topY + sixthW, leftX + sixthW / 4, bottomY - sixthW);
+  // Bottom left curve upward
+  addSegment(g, leftX + sixthW / 4, bottomY - sixthW, leftX + sixthW / 3, bottomY - sixthW / 2);
+  addSegment(g, leftX + sixthW / 3, bottomY - sixthW / 2, leftX + sixthW / 2, bottomY);
+  // Bottom horizontal line
+  addSegment(g, leftX + sixthW / 2, bottomY, rightX - width / 3, bottomY);
+}
+
+/**
+ * Build a square bracket (auto-detects opening/closing based on direction)
+ * x0, y0 : first point of the bracket
+ * x1, y1 : second point of the bracket
+ * */
+void buildBracket(ShapeGeometry *g, int x0, int y0, int x1, int y1)
+{
+  // If dragging left to right, build opening bracket
+  // If dragging right to left, build closing bracket
+  if (x1 >= x0)
+  {
+    buildOpeningBracket(g, x0, y0, x1, y1);
+  }
+  else
+  {
+    buildClosingBracket(g, x0, y0, x1, y1);
+  }
+}
+
+/**
+ * Build a curly brace (auto-detects opening/closing based on direction)
+ * x0, y0 : first point of the brace
+ * x1, y1 : second point of the brace
+ * */
+void buildBrace(ShapeGeometry *g, int x0, int y0, int x1, int y1)
+{
+  // If dragging left to right, build opening brace
+  // If dragging right to left, build closing brace
+  if (x1 >= x0)
+  {
+    buildOpeningBrace(g, x0, y0, x1, y1);
+  }
+  else
+  {
+    buildClosingBrace(g, x0, y0, x1, y1);
+  }
+}
+
+void drawBracket(Display *d, Window w, GC gc, int x0, int y0, int x1, int y1)
+{
+  ShapeGeometry g;
+  geometryReset(&g);
+  buildBracket(&g, x0, y0, x1, y1);
+  drawGeometry(d, w, gc, &g);
+}
+
+void drawBrace(Display *d, Window w, GC gc, int x0, int y0, int x1, int y1)
+{
+  ShapeGeometry g;
+  geometryReset(&g);
+  buildBrace(&g, x0, y0, x1, y1);
+  drawGeometry(d, w, gc, &g);
+}
+
+/**
+ * Build the rubber-band shape of a drag tool between two points
+ * shape : tool id ('l', 'a', 'r', 'B', 'X', 'c', '{' or '[')
+ * rounded : build rectangles with rounded corners
+ * */
+void buildShape(ShapeGeometry *g, char shape, int rounded, int x0, int y0, int x1, int y1)
+{
+  geometryReset(g);
+  switch (shape)
+  {
+  case 'l':
+    buildLine(g, x0, y0, x1, y1);
+    break;
+  case 'a':
+    buildArrow(g, x0, y0, x1, y1, ARROW_SIZE);
+    break;
+  case 'r':
+    if (rounded)
+      buildRoundedRectangle(g, x0, y0, x1, y1);
+    else
+      buildRectangle(g, x0, y0, x1, y1);
+    break;
+  case 'B':
+  case 'X':
+    buildRectangle(g, x0, y0, x1, y1);
+    break;
+  case 'c':
+    buildCircle(g, x0, y0, abs(x1 - x0));
+    break;
+  case '{':
+    buildBrace(g, x0, y0, x1, y1);
+    break;
+  case '[':
+    buildBracket(g, x0, y0, x1, y1);
+    break;
+  }
+}
+
+/**
+ * draws the rubber-band shape of a drag tool between two points
+ * shape : tool id ('l', 'a', 'r', 'B', 'X', 'c', '{' or '[')
+ * rounded : draw rectangles with rounded corners
+ * */
+void drawShape(Display *d, Window w, GC gc, char shape, int rounded, int x0, int y0, int x1, int y1)
+{
+  ShapeGeometry g;
+  buildShape(&g, shape, rounded, x0, y0, x1, y1);
+  drawGeometry(d, w, gc, &g);
+}
+
+/**
+ * Bounding box of everything drawShape() paints for a tool, padded by the
+ * line width. Returns an empty rectangle for unknown tools.
+ */
+XRectangle shapeBounds(char shape, int x0, int y0, int x1, int y1, int lineWidth)
+{
+  ShapeGeometry g;
+  buildShape(&g, shape, 0, x0, y0, x1, y1);
+  return geometryBounds(&g, lineWidth);
+}
+
+/**
+ * Smallest rectangle containing a and b (empty rectangles are ignored),
+ * clipped to the screen.
+ */
+XRectangle unionRect(XRectangle a, XRectangle b, unsigned int screenW, unsigned int screenH)
+{
+  if (a.width == 0 || a.height == 0)
+    a = b;
+  else if (b.width != 0 && b.height != 0)
+  {
+    int l = a.x < b.x ? a.x : b.x, t = a.y < b.y ? a.y : b.y;
+    int r = (a.x + a.width > b.x + b.width) ? a.x + a.width : b.x + b.width;
+    int btm = (a.y + a.height > b.y + b.height) ? a.y + a.height : b.y + b.height;
+    a = (XRectangle){l, t, r - l, btm - t};
+  }
+  int l = a.x < 0 ? 0 : a.x, t = a.y < 0 ? 0 : a.y;
+  int r = a.x + a.width, btm = a.y + a.height;
+  if (r > (int)screenW)
+    r = screenW;
+  if (btm > (int)screenH)
+    btm = screenH;
+  if (r <= l || btm <= t)
+    return (XRectangle){0, 0, 0, 0};
+  return (XRectangle){l, t, r - l, btm - t};
+}
+
+/**
+ * Dirty regions of the screen waiting to be composited. Overlapping
+ * rectangles are merged; when the list is full the new area is merged into
+ * the last entry. A rectangle is `changed` when the annotations may differ
+ * there, rather than the window only needing a repaint.
+ */
+typedef struct
+{
+  XRectangle rects[DAMAGE_MAX];
+  unsigned char changed[DAMAGE_MAX];
+  int count;
+} DamageList;
+
+static inline int rectsTouch(XRectangle a, XRectangle b)
+{
+  return a.x <= b.x + b.width && b.x <= a.x + a.width &&
+         a.y <= b.y + b.height && b.y <= a.y + a.height;
+}
+
+static void damageRect(DamageList *dl, XRectangle r, int changed, unsigned int screenW, unsigned int screenH)
+{
+  r = unionRect(r, (XRectangle){0, 0, 0, 0}, screenW, screenH);
+  if (!r.width)
+    return;
+  // Grow r over every rectangle it touches, then store it once
+  for (int i = 0; i < dl->count;)
+  {
+    if (rectsTouch(r, dl->rects[i]))
+    {
+      r = unionRect(r, dl->rects[i], screenW, screenH);
+      changed |= dl->changed[i];
+      dl->count--;
+      dl->rects[i] = dl->rects[dl->count];
+      dl->changed[i] = dl->changed[dl->count];
+      i = 0;
+    }
+    else
+    {
+      i++;
+    }
+  }
+  if (dl->count == DAMAGE_MAX)
+  {
+    dl->rects[DAMAGE_MAX - 1] = unionRect(dl->rects[DAMAGE_MAX - 1], r, screenW, screenH);
+    dl->changed[DAMAGE_MAX - 1] |= changed;
+  }
+  else
+  {
+    dl->rects[dl->count] = r;
+    dl->changed[dl->count++] = changed;
+  }
+}
+
+/**
+ * Mark `r` dirty after the annotations changed there
+ */
+void addDamage(DamageList *dl, XRectangle r, unsigned int screenW, unsigned int screenH)
+{
+  damageRect(dl, r, 1, screenW, screenH);
+}
+
+/**
+ * Mark `r` dirty when only the window needs repainting: previews, the UI
+ * layer, exposure, or annotations restored from the undo history
+ */
+void addRepaint(DamageList *dl, XRectangle r, unsigned int screenW, unsigned int screenH)
+{
+  damageRect(dl, r, 0, screenW, screenH);
+}
+
+/**
+ * Layered compositor. What is on screen is rebuilt from independent layers:
+ * the frozen desktop capture, the committed annotations (transparent where
+ * nothing was drawn) and the UI overlay (palette, text cursor). `scene`
+ * caches background + annotations, which is what screenshots and the blur
+ * brush read; the UI is only ever composited onto the window. Live previews
+ * are composed from the scene in the preview layer.
+ */
+typedef struct
+{
+  Pixmap background, annotations, ui, scene;
+  Picture backgroundPic, annotationsPic, uiPic, scenePic, windowPic;
+  Visual *visual;
+  XRenderPictFormat *format;
+  int depth;
+  int showAnnotations;       // 'h' hides every annotation
+  int showUi;                // 'H' hides the palette and text cursor
+  unsigned char *touched;    // TOUCH_CELL cells where annotations were ever drawn
+  int touchCols, touchRows;
+} Layers;
+
+static Picture clearedLayer(Display *d, Window w, Pixmap *pix, XRenderPictFormat *fmt,
+                            unsigned int width, unsigned int height, int depth)
+{
+  *pix = XCreatePixmap(d, w, width, height, depth);
+  Picture pic = XRenderCreatePicture(d, *pix, fmt, 0, NULL);
+  XRenderColor clear = {0, 0, 0, 0};
+  XRenderFillRectangle(d, PictOpSrc, pic, &clear, 0, 0, width, height);
+  return pic;
+}
+
+/**
+ * Create the layers over `background`, which the layer stack takes over
+ */
+void layersInit(Display *d, Window w, Visual *visual, int depth, Pixmap background,
+                unsigned int width, unsigned int height, Layers *ly)
+{
+  XRenderPictFormat *fmt = XRenderFindVisualFormat(d, visual);
+  ly->visual = visual;
+  ly->format = fmt;
+  ly->depth = depth;
+  ly->background = background;
+  ly->backgroundPic = XRenderCreatePicture(d, background, fmt, 0, NULL);
+  ly->annotationsPic = clearedLayer(d, w, &ly->annotations, fmt, width, height, depth);
+  ly->uiPic = clearedLayer(d, w, &ly->ui, fmt, width, height, depth);
+  ly->scenePic = clearedLayer(d, w, &ly->scene, fmt, width, height, depth);
+  ly->windowPic = XRenderCreatePicture(d, w, fmt, 0, NULL);
+  ly->showAnnotations = 1;
+  ly->showUi = 1;
+  ly->touchCols = (width + TOUCH_CELL - 1) / TOUCH_CELL;
+  ly->touchRows = (height + TOUCH_CELL - 1) / TOUCH_CELL;
+  ly->touched = calloc((size_t)ly->touchCols * ly->touchRows, 1);
+  XRenderComposite(d, PictOpSrc, ly->backgroundPic, None, ly->scenePic, 0, 0, 0, 0, 0, 0, width, height);
+}
+
+/**
+ * Remember that annotations may cover `r`. Cells are never cleared again:
+ * undo only goes back to annotations drawn in touched cells.
+ */
+void layersTouch(Layers *ly, XRectangle r)
+{
+  if (!ly->touched || !r.width || !r.height)
+    return;
+  for (int y = r.y / TOUCH_CELL; y <= (r.y + r.height - 1) / TOUCH_CELL && y < ly->touchRows; y++)
+    for (int x = r.x / TOUCH_CELL; x <= (r.x + r.width - 1) / TOUCH_CELL && x < ly->touchCols; x++)
+      ly->touched[y * ly->touchCols + x] = 1;
+}
+
+/**
+ * Whether the scene in `r` is still the frozen desktop
+ */
+int layersPristine(const Layers *ly, XRectangle r)
+{
+  if (!ly->touched)
+    return 0;
+  for (int y = r.y / TOUCH_CELL; y <= (r.y + r.height - 1) / TOUCH_CELL && y < ly->touchRows; y++)
+    for (int x = r.x / TOUCH_CELL; x <= (r.x + r.width - 1) / TOUCH_CELL && x < ly->touchCols; x++)
+      if (ly->touched[y * ly->touchCols + x])
+        return 0;
+  return 1;
+}
+
+/**
+ * Make `r` of a layer transparent again
+ */
+void clearLayer(Display *d, Picture layer, XRectangle r)
+{
+  XRenderColor clear = {0, 0, 0, 0};
+  if (r.width && r.height)
+    XRenderFillRectangle(d, PictOpSrc, layer, &clear, r.x, r.y, r.width, r.height);
+}
+
+/**
+ * Rebuild the scene for `r` from the background and annotation layers
+ */
+void layersUpdateScene(Display *d, Layers *ly, XRectangle r)
+{
+  XRenderComposite(d, PictOpSrc, ly->backgroundPic, None, ly->scenePic,
+                   r.x, r.y, 0, 0, r.x, r.y, r.width, r.height);
+  if (ly->showAnnotations)
+    XRenderComposite(d, PictOpOver, ly->annotationsPic, None, ly->scenePic,
+                     r.x, r.y, 0, 0, r.x, r.y, r.width, r.height);
+}
+
+/**
+ * Show hidden annotations again before they are drawn on. While hidden,
+ * the scene is the desktop alone: filters reading it would write it over
+ * the annotations, and new strokes would not be seen.
+ */
+void layersRevealAnnotations(Layers *ly, DamageList *dl, unsigned int screenW, unsigned int screenH)
+{
+  if (ly->showAnnotations)
+    return;
+  ly->showAnnotations = 1;
+  addRepaint(dl, (XRectangle){0, 0, screenW, screenH}, screenW, screenH);
+}
+
+/**
+ * Composite every dirty rectangle onto the window and clear the list
+ */
+void composeDamage(Display *d, Layers *ly, DamageList *dl)
+{
+  for (int i = 0; i < dl->count; i++)
+  {
+    XRectangle r = dl->rects[i];
+    if (dl->changed[i])
+      layersTouch(ly, r);
+    layersUpdateScene(d, ly, r);
+    XRenderComposite(d, PictOpSrc, ly->scenePic, None, ly->windowPic,
+                     r.x, r.y, 0, 0, r.x, r.y, r.width, r.height);
+    if (ly->showUi)
+      XRenderComposite(d, PictOpOver, ly->uiPic, None, ly->windowPic,
+                       r.x, r.y, 0, 0, r.x, r.y, r.width, r.height);
+  }
+  dl->count = 0;
+}
+
+/**
+ * Save the (x0,y0)-(x1,y1) area of the canvas. Reading the scene instead of
+ * the screen keeps previews, cursors and the compositor out of the capture,
+ * with no wait for the compositor to catch up. The format follows the
+ * action: OCR input is always PNG.
+ */
+void saveScreenshot(Display *d, Layers *ly, const Settings *st, int x0, int y0, int x1, int y1, int clipMode)
+{
+  int x = (x0 < x1) ? x0 : x1;
+  int y = (y0 < y1) ? y0 : y1;
+  int width = abs(x1 - x0) + 1;
+  int height = abs(y1 - y0) + 1;
+
+  XImage *image;
+  if (st->screenshotUi && ly->showUi)
+  {
+    // Flatten the UI over the scene for the area only, on the server
+    Pixmap flat;
+    Picture flatPic = clearedLayer(d, ly->scene, &flat, ly->format, width, height, ly->depth);
+    XRenderComposite(d, PictOpSrc, ly->scenePic, None, flatPic, x, y, 0, 0, 0, 0, width, height);
+    XRenderComposite(d, PictOpOver, ly->uiPic, None, flatPic, x, y, 0, 0, 0, 0, width, height);
+    image = XGetImage(d, flat, 0, 0, width, height, AllPlanes, ZPixmap);
+    XRenderFreePicture(d, flatPic);
+    XFreePixmap(d, flat);
+  }
+  else
+    image = XGetImage(d, ly->scene, x, y, width, height, AllPlanes, ZPixmap);
+  if (image == NULL)
+  {
+    fprintf(stderr, "Failed to capture screenshot.\n");
+    return;
+  }
+
+  ImageFormat format = clipMode == 0 ? st->format : clipMode == 1 ? st->clipboardFormat : IMAGE_PNG;
+  if (!screenshotQueue(image, clipMode, format, st->jpegQuality))
+  {
+    saveScreenshotFile(image, clipMode, format, st->jpegQuality);
+    XDestroyImage(image);
+  }
+}
+
+/**
+ * Copy the screen into a new pixmap without the pixels leaving the server,
+ * for remote displays where reading the root window back costs the whole
+ * framebuffer on the wire. The root has no alpha channel, so XRender makes
+ * the copy opaque.
+ */
+Pixmap captureRootRender(Display *d, Window root, Visual *visual, int depth,
+                         unsigned int width, unsigned int height)
+{
+  Pixmap pix = XCreatePixmap(d, root, width, height, depth);
+  XRenderPictureAttributes pa;
+  pa.subwindow_mode = IncludeInferiors;
+  Picture src = XRenderCreatePicture(d, root, XRenderFindVisualFormat(d, DefaultVisual(d, DefaultScreen(d))),
+                                     CPSubwindowMode, &pa);
+  Picture dst = XRenderCreatePicture(d, pix, XRenderFindVisualFormat(d, visual), 0, NULL);
+  XRenderComposite(d, PictOpSrc, src, None, dst, 0, 0, 0, 0, 0, 0, width, height);
+  XRenderFreePicture(d, src);
+  XRenderFreePicture(d, dst);
+  return pix;
+}
+
+/**
+ * Vsync-aware presentation through the Present extension. Frames are
+ * submitted with XPresentPixmap so the server shows them at the next
+ * vertical blank instead of whenever the copy happens to run, and
+ * PresentCompleteNotify reports when each frame actually reached the screen.
+ */
+typedef struct
+{
+  int enabled;        // Present extension in use
+  int opcode;         // major opcode, to recognize its GenericEvents
+  uint32_t serial;    // serial of the last submitted frame
+  uint32_t completed; // serial of the last frame known to be on screen
+  uint64_t lastUst;   // on-screen time of that frame (microseconds)
+  uint64_t lastMsc;   // vblank counter of that frame
+} Presenter;
+
+/**
+ * Enable the Present path when the server supports it, unless ZPEN_PRESENT=0.
+ */
+void presenterInit(Display *d, Window w, Presenter *pr)
+{
+  memset(pr, 0, sizeof(*pr));
+#ifdef HAVE_XPRESENT
+  const char *env = getenv("ZPEN_PRESENT");
+  int ev, err, major = 1, minor = 0;
+  if ((env && strcmp(env, "0") == 0) ||
+      !XPresentQueryExtension(d, &pr->opcode, &ev, &err) ||
+      !XPresentQueryVersion(d, &major, &minor))
+    return;
+  XPresentSelectInput(d, w, PresentCompleteNotifyMask | PresentIdleNotifyMask);
+  pr->enabled = 1;
+#else
+  (void)d;
+  (void)w;
+#endif
+}
+
+/**
+ * Input-to-screen latency. Every input event that changes the drawing is
+ * queued with its X server timestamp and resolved when the rendering it
+ * caused has been flushed, or reported complete by the Present extension.
+ * Samples go into a log-linear histogram per tool: values below
+ * LAT_SUB_BUCKETS microseconds are exact, above that each power of two is
+ * split into LAT_SUB_BUCKETS buckets, so any value is off by at most 1/16.
+ */
+#define LAT_SUB_BUCKETS 16
+#define LAT_BUCKETS (LAT_SUB_BUCKETS * 28) // up to ~2^31 us
+#define LAT_QUEUE 512
+
+typedef enum
+{
+  LAT_PEN,
+  LAT_BLUR,
+  LAT_SHAPE,
+  LAT_TEXT,
+  LAT_TOOLS
+} LatencyTool;
+
+typedef struct
+{
+  uint32_t counts[LAT_BUCKETS];
+  uint64_t total;
+  uint64_t sum;
+  uint64_t max;
+} LatencyHist;
+
+typedef struct
+{
+  LatencyHist hist[LAT_TOOLS];
+  int64_t serverBase;            // server time (ms) at calibration
+  int64_t localBase;             // CLOCK_MONOTONIC (us) at calibration
+  Time queued[LAT_QUEUE];        // inputs not flushed yet
+  unsigned char queuedTool[LAT_QUEUE];
+  int nQueued;
+  Time inflight[LAT_QUEUE];      // inputs flushed in frames still waiting for vblank
+  unsigned char inflightTool[LAT_QUEUE];
+  int nInflight;
+  uint32_t awaitSerial;          // Present serial that resolves `inflight`
+} LatencyStats;
+
+static LatencyStats latencyStats;
+
+static int64_t monotonicMicros(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int latencyBucket(uint64_t v)
+{
+  if (v < LAT_SUB_BUCKETS)
+    return (int)v;
+  int shift = 63 - __builtin_clzll(v) - 4; // keep the top 5 bits
+  int idx = (shift + 1) * LAT_SUB_BUCKETS + (int)((v >> shift) - LAT_SUB_BUCKETS);
+  return idx < LAT_BUCKETS ? idx : LAT_BUCKETS - 1;
+}
+
+/**
+ * Largest value that falls in bucket `idx`
+ */
+static uint64_t latencyBucketValue(int idx)
+{
+  if (idx < LAT_SUB_BUCKETS)
+    return (uint64_t)idx;
+  int shift = idx / LAT_SUB_BUCKETS - 1;
+  return (((uint64_t)(LAT_SUB_BUCKETS + idx % LAT_SUB_BUCKETS) + 1) << shift) - 1;
+}
+
+static void latencyRecord(LatencyHist *h, uint64_t us)
+{
+  h->counts[latencyBucket(us)]++;
+  h->total++;
+  h->sum += us;
+  if (us > h->max)
+    h->max = us;
+}
+
+static uint64_t latencyPercentile(const LatencyHist *h, double pct)
+{
+  uint64_t rank = (uint64_t)ceil(pct / 100.0 * h->total), seen = 0;
+  for (int i = 0; i < LAT_BUCKETS; i++)
+  {
+    seen += h->counts[i];
+    if (seen >= rank && seen > 0)
+      return latencyBucketValue(i) < h->max ? latencyBucketValue(i) : h->max;
+  }
+  return h->max;
+}
+
+/**
+ * Map X server time to the local monotonic clock. The server stamps a
+ * PropertyNotify for a zero-length append to our own window; the round
+ * trip bounds the error to its own latency.
+ */
+void latencyInit(Display *d, Window w, long eventMask)
+{
+  XEvent ev;
+  Atom prop = XInternAtom(d, "_ZPEN_TIMESTAMP", False);
+  memset(&latencyStats, 0, sizeof(latencyStats));
+  XSelectInput(d, w, eventMask | PropertyChangeMask);
+  int64_t sent = monotonicMicros();
+  XChangeProperty(d, w, prop, XA_INTEGER, 32, PropModeAppend, NULL, 0);
+  XWindowEvent(d, w, PropertyChangeMask, &ev);
+  int64_t now = monotonicMicros();
+  XSelectInput(d, w, eventMask);
+  XDeleteProperty(d, w, prop);
+  latencyStats.serverBase = ev.xproperty.time;
+  latencyStats.localBase = sent + (now - sent) / 2;
+}
+
+/**
+ * Histogram an input event is counted in, given the active tool
+ */
+LatencyTool latencyTool(char shape, int freehand)
+{
+  if (shape == 'b' || shape == 'x')
+    return LAT_BLUR;
+  return (shape == 'p' || freehand) ? LAT_PEN : LAT_SHAPE;
+}
+
+/**
+ * Queue an input event whose effect will reach the window on the next flush
+ */
+void latencyInput(LatencyTool tool, Time t)
+{
+  LatencyStats *ls = &latencyStats;
+  if (ls->nQueued < LAT_QUEUE)
+  {
+    ls->queued[ls->nQueued] = t;
+    ls->queuedTool[ls->nQueued++] = tool;
+  }
+}
+
+static void latencyResolve(Time *times, unsigned char *tools, int n, int64_t shownAt)
+{
+  LatencyStats *ls = &latencyStats;
+  for (int i = 0; i < n; i++)
+  {
+    // 32-bit server milliseconds wrap after ~49 days; the difference does not
+    int64_t at = ls->localBase + (int64_t)(int32_t)(times[i] - (Time)ls->serverBase) * 1000;
+    latencyRecord(&ls->hist[tools[i]], shownAt > at ? (uint64_t)(shownAt - at) : 0);
+  }
+}
+
+/**
+ * Called after XFlush. Inputs rendered directly are resolved now; if frames
+ * are waiting for vblank they are resolved when the last of them completes.
+ */
+void latencyFlushed(const Presenter *pr)
+{
+  LatencyStats *ls = &latencyStats;
+  if (!ls->nQueued)
+    return;
+  if (pr->enabled && pr->serial != pr->completed)
+  {
+    int n = ls->nQueued;
+    if (n > LAT_QUEUE - ls->nInflight)
+      n = LAT_QUEUE - ls->nInflight;
+    memcpy(ls->inflight + ls->nInflight, ls->queued, n * sizeof(Time));
+    memcpy(ls->inflightTool + ls->nInflight, ls->queuedTool, n);
+    ls->nInflight += n;
+    ls->awaitSerial = pr->serial;
+  }
+  else
+  {
+    latencyResolve(ls->queued, ls->queuedTool, ls->nQueued, monotonicMicros());
+  }
+  ls->nQueued = 0;
+}
+
+/**
+ * Called after a Present event was handled
+ */
+void latencyPresented(const Presenter *pr)
+{
+  LatencyStats *ls = &latencyStats;
+  if (!ls->nInflight || (int32_t)(pr->completed - ls->awaitSerial) < 0)
+    return;
+  // ust is CLOCK_MONOTONIC on Linux; drivers without vblank report 0
+  latencyResolve(ls->inflight, ls->inflightTool, ls->nInflight,
+                 pr->lastUst ? (int64_t)pr->lastUst : monotonicMicros());
+  ls->nInflight = 0;
+}
+
+/**
+ * Print p50/p99/max per tool to stderr
+ */
+void latencyDump(void)
+{
+  static const char *names[LAT_TOOLS] = {"pen", "blur", "shape", "text"};
+  fprintf(stderr, "zpen input-to-screen latency (ms)\n%-6s %8s %8s %8s %8s %8s\n",
+          "tool", "samples", "mean", "p50", "p99", "max");
+  for (int i = 0; i < LAT_TOOLS; i++)
+  {
+    const LatencyHist *h = &latencyStats.hist[i];
+    if (!h->total)
+      continue;
+    fprintf(stderr, "%-6s %8llu %8.2f %8.2f %8.2f %8.2f\n", names[i], (unsigned long long)h->total,
+            h->sum / 1000.0 / h->total, latencyPercentile(h, 50) / 1000.0,
+            latencyPercentile(h, 99) / 1000.0, h->max / 1000.0);
+  }
+}
+
+/**
+ * Whether the X connection crosses a network (ssh -X, a display on another
+ * host), where every pixel read back or pushed costs bandwidth. ZPEN_REMOTE
+ * overrides the config setting, which overrides detection; displays such as
+ * VNC that are local to the X server but remote to the user must opt in.
+ */
+int displayIsRemote(Display *d, RemoteMode mode)
+{
+  const char *env = getenv("ZPEN_REMOTE");
+  if (env && *env)
+    return atoi(env) != 0;
+  if (mode != REMOTE_AUTO)
+    return mode == REMOTE_ON;
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  if (getsockname(ConnectionNumber(d), (struct sockaddr *)&addr, &len) != 0)
+    return 0;
+  return addr.ss_family == AF_INET || addr.ss_family == AF_INET6;
+}
+
+/**
+ * Bytes sent to and received from the X server per user action, read from
+ * the kernel's TCP counters of the display socket. Each mark syncs with the
+ * server and charges the traffic since the previous mark to the action in
+ * progress, so an action covers everything up to the next press. Enabled
+ * by ZPEN_STATS on TCP connections only.
+ */
+typedef enum
+{
+  TRAFFIC_STARTUP,
+  TRAFFIC_PEN,
+  TRAFFIC_BLUR,
+  TRAFFIC_SHAPE,
+  TRAFFIC_SCREENSHOT,
+  TRAFFIC_TEXT,
+  TRAFFIC_KEYS, // undo, redo, paste and settings
+  TRAFFIC_ACTIONS,
+} TrafficAction;
+
+typedef struct
+{
+  int enabled;
+  TrafficAction current;
+  uint64_t sent, received; // counters at the previous mark
+  uint64_t count[TRAFFIC_ACTIONS];
+  uint64_t bytesSent[TRAFFIC_ACTIONS];
+  uint64_t bytesReceived[TRAFFIC_ACTIONS];
+} TrafficStats;
+
+static TrafficStats trafficStats;
+
+static int trafficCounters(Display *d, uint64_t *sent, uint64_t *received)
+{
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
+  memset(&info, 0, sizeof(info));
+  if (getsockopt(ConnectionNumber(d), IPPROTO_TCP, TCP_INFO, &info, &len) != 0 ||
+      len < offsetof(struct tcp_info, tcpi_bytes_received) + sizeof(info.tcpi_bytes_received))
+    return 0;
+  *sent = info.tcpi_bytes_acked;
+  *received = info.tcpi_bytes_received;
+  return 1;
+}
+
+/**
+ * Start counting; everything since the connection opened is startup
+ */
+void trafficInit(Display *d)
+{
+  TrafficStats *ts = &trafficStats;
+  if (!getenv("ZPEN_STATS"))
+    return;
+  ts->current = TRAFFIC_STARTUP;
+  ts->count[TRAFFIC_STARTUP] = 1;
+  ts->enabled = trafficCounters(d, &ts->sent, &ts->received);
+  // Counted from zero at the next mark
+  ts->sent = ts->received = 0;
+}
+
+/**
+ * Charge the traffic since the previous mark and begin `next`
+ */
+void trafficMark(Display *d, TrafficAction next)
+{
+  TrafficStats *ts = &trafficStats;
+  uint64_t sent, received;
+  if (!ts->enabled)
+    return;
+  XSync(d, False);
+  if (!trafficCounters(d, &sent, &received))
+    return;
+  ts->bytesSent[ts->current] += sent - ts->sent;
+  ts->bytesReceived[ts->current] += received - ts->received;
+  ts->sent = sent;
+  ts->received = received;
+  ts->count[next]++;
+  ts->current = next;
+}
+
+/**
+ * Traffic action for a press with the current tool
+ */
+TrafficAction trafficTool(char shape, int freehand, int screenshot)
+{
+  if (screenshot)
+    return TRAFFIC_SCREENSHOT;
+  if (shape == 'p' || freehand)
+    return TRAFFIC_PEN;
+  return (shape == 'b' || shape == 'x') ? TRAFFIC_BLUR : TRAFFIC_SHAPE;
+}
+
+/**
+ * Print bytes on the wire per action to stderr
+ */
+void trafficDump(void)
+{
+  static const char *names[TRAFFIC_ACTIONS] = {"startup", "pen", "blur", "shape", "screenshot", "text", "keys"};
+  const TrafficStats *ts = &trafficStats;
+  if (!ts->enabled)
+  {
+    fprintf(stderr, "zpen X traffic: not a TCP display connection\n");
+    return;
+  }
+  fprintf(stderr, "zpen X traffic (KiB)\n%-10s %8s %10s %10s %10s\n",
+          "action", "count", "sent", "received", "per action");
+  for (int i = 0; i < TRAFFIC_ACTIONS; i++)
+  {
+    if (!ts->count[i])
+      continue;
+    fprintf(stderr, "%-10s %8llu %10.1f %10.1f %10.1f\n", names[i], (unsigned long long)ts->count[i],
+            ts->bytesSent[i] / 1024.0, ts->bytesReceived[i] / 1024.0,
+            (ts->bytesSent[i] + ts->bytesReceived[i]) / 1024.0 / ts->count[i]);
+  }
+}
+
+/**
+ * Off-screen preview layer. Rubber-band previews are composed in a scratch
+ * pixmap holding a copy of the committed image for the damaged area only,
+ * then copied to the window in one request, so moving a preview never
+ * flickers and never mixes pixels with the background the way XOR does.
+ * With Present the scratch pixmaps are the back buffers of each frame; a
+ * submitted one stays busy until the server reports it idle.
+ */
+typedef struct
+{
+  Pixmap pix[PRESENT_BUFFERS];       // scratch pixmaps, grown on demand
+  unsigned int w[PRESENT_BUFFERS];   // allocated size of each pixmap
+  unsigned int h[PRESENT_BUFFERS];
+  int busy[PRESENT_BUFFERS];         // still owned by the Present extension
+  int cur;                           // buffer handed out by previewPrepare()
+  int depth;                         // depth of the window
+  Presenter *presenter;              // submits frames, or NULL to copy directly
+  Picture pic[PRESENT_BUFFERS];      // XRender pictures of the scratch pixmaps
+  XRenderPictFormat *format;         // format for pic[], NULL without an overlay
+  Picture overlay;                   // layer composited over every frame, or None
+} PreviewLayer;
+
+#ifdef HAVE_XPRESENT
+static Bool isPresentEvent(Display *d, XEvent *e, XPointer arg)
+{
+  (void)d;
+  return e->type == GenericEvent && e->xcookie.extension == ((Presenter *)arg)->opcode;
+}
+#endif
+
+/**
+ * Consume a Present event: record completed frames and release idle
+ * buffers. Returns 1 when the event belonged to the Present extension.
+ */
+int presenterHandleEvent(Display *d, Presenter *pr, PreviewLayer *pl, XEvent *e)
+{
+#ifdef HAVE_XPRESENT
+  if (!pr->enabled || e->type != GenericEvent || e->xcookie.extension != pr->opcode)
+    return 0;
+  if (XGetEventData(d, &e->xcookie))
+  {
+    if (e->xcookie.evtype == PresentCompleteNotify)
+    {
+      XPresentCompleteNotifyEvent *ce = (XPresentCompleteNotifyEvent *)e->xcookie.data;
+      pr->completed = ce->serial_number;
+      pr->lastUst = ce->ust;
+      pr->lastMsc = ce->msc;
+      latencyPresented(pr);
+    }
+    else if (e->xcookie.evtype == PresentIdleNotify)
+    {
+      XPresentIdleNotifyEvent *ie = (XPresentIdleNotifyEvent *)e->xcookie.data;
+      for (int i = 0; i < PRESENT_BUFFERS; i++)
+      {
+        if (pl->pix[i] == ie->pixmap)
+          pl->busy[i] = 0;
+      }
+    }
+    XFreeEventData(d, &e->xcookie);
+  }
+  return 1;
+#else
+  (void)d;
+  (void)pr;
+  (void)pl;
+  (void)e;
+  return 0;
+#endif
+}
+
+#ifdef HAVE_XPRESENT
+/**
+ * Handle the next Present event, waiting for it until `deadline`
+ * (monotonicMicros). Other events stay queued. Returns 0 on timeout.
+ */
+static int presentNextEvent(Display *d, Presenter *pr, PreviewLayer *pl, int64_t deadline)
+{
+  XEvent ev;
+  while (!XCheckIfEvent(d, &ev, isPresentEvent, (XPointer)pr))
+  {
+    int64_t left = deadline - monotonicMicros();
+    struct pollfd fd = {ConnectionNumber(d), POLLIN, 0};
+    if (left <= 0 || (poll(&fd, 1, (int)((left + 999) / 1000)) < 0 && errno != EINTR))
+      return 0;
+  }
+  presenterHandleEvent(d, pr, pl, &ev);
+  return 1;
+}
+
+/**
+ * Stop waiting for submitted frames: the server did not report them in
+ * time, as when the window is unmapped or the screen is off
+ */
+static void presentAbandon(Presenter *pr, PreviewLayer *pl)
+{
+  pr->completed = pr->serial;
+  for (int i = 0; i < PRESENT_BUFFERS; i++)
+    pl->busy[i] = 0;
+}
+#endif
+
+/**
+ * Block until every submitted frame is on screen, or PRESENT_TIMEOUT_MS at
+ * most. Direct drawing on the window must wait for this, otherwise a frame
+ * still queued for the next vblank would be shown on top of it.
+ */
+void presentWait(Display *d, Presenter *pr, PreviewLayer *pl)
+{
+#ifdef HAVE_XPRESENT
+  int64_t deadline = monotonicMicros() + PRESENT_TIMEOUT_MS * 1000;
+  while (pr->enabled && (int32_t)(pr->serial - pr->completed) > 0)
+  {
+    if (!presentNextEvent(d, pr, pl, deadline))
+      presentAbandon(pr, pl);
+  }
+#else
+  (void)d;
+  (void)pr;
+  (void)pl;
+#endif
+}
+
+/**
+ * composeDamage() once the frames queued for vblank are on screen, so they
+ * do not land over what it draws on the window
+ */
+void composeDamagePresented(Display *d, Layers *ly, DamageList *dl, Presenter *pr, PreviewLayer *pl)
+{
+  if (dl->count)
+    presentWait(d, pr, pl);
+  composeDamage(d, ly, dl);
+}
+
+/**
+ * Load `area` of the committed image `base` into a free scratch pixmap (at
+ * its origin) and return it, ready for the preview to be drawn on it with
+ * coordinates translated by (-area.x, -area.y).
+ */
+Pixmap previewPrepare(Display *d, Window w, GC gc, PreviewLayer *pl, Drawable base, XRectangle area)
+{
+  int idx = -1;
+#ifdef HAVE_XPRESENT
+  int64_t deadline = monotonicMicros() + PRESENT_TIMEOUT_MS * 1000;
+#endif
+  while (idx < 0)
+  {
+    for (int i = 1; i <= PRESENT_BUFFERS && idx < 0; i++)
+    {
+      int c = (pl->cur + i) % PRESENT_BUFFERS;
+      if (!pl->busy[c])
+        idx = c;
+    }
+#ifdef HAVE_XPRESENT
+    if (idx < 0)
+    {
+      // Every back buffer is queued for display: wait for one to go idle
+      if (!presentNextEvent(d, pl->presenter, pl, deadline))
+        presentAbandon(pl->presenter, pl);
+    }
+#endif
+  }
+  pl->cur = idx;
+  if (area.width > pl->w[idx] || area.height > pl->h[idx])
+  {
+    // Grow in 256px steps so a growing drag does not reallocate every event
+    unsigned int nw = area.width > pl->w[idx] ? (area.width + 255u) & ~255u : pl->w[idx];
+    unsigned int nh = area.height > pl->h[idx] ? (area.height + 255u) & ~255u : pl->h[idx];
+    if (pl->pic[idx])
+      XRenderFreePicture(d, pl->pic[idx]);
+    if (pl->pix[idx])
+      XFreePixmap(d, pl->pix[idx]);
+    pl->pix[idx] = XCreatePixmap(d, w, nw, nh, pl->depth);
+    pl->pic[idx] = pl->format ? XRenderCreatePicture(d, pl->pix[idx], pl->format, 0, NULL) : None;
+    pl->w[idx] = nw;
+    pl->h[idx] = nh;
+  }
+  XCopyArea(d, base, pl->pix[idx], gc, area.x, area.y, area.width, area.height, 0, 0);
+  return pl->pix[idx];
+}
+
+/**
+ * Show the scratch pixmap prepared for `area` on the window, synchronized
+ * to vblank when the Present extension is in use.
+ */
+void previewPresent(Display *d, Window w, GC gc, PreviewLayer *pl, XRectangle area)
+{
+  if (pl->overlay && pl->pic[pl->cur])
+    XRenderComposite(d, PictOpOver, pl->overlay, None, pl->pic[pl->cur],
+                     area.x, area.y, 0, 0, 0, 0, area.width, area.height);
+#ifdef HAVE_XPRESENT
+  Presenter *pr = pl->presenter;
+  if (pr && pr->enabled)
+  {
+    // valid and update regions are in pixmap coordinates
+    XRectangle r = {0, 0, area.width, area.height};
+    XserverRegion region = XFixesCreateRegion(d, &r, 1);
+    XPresentPixmap(d, w, pl->pix[pl->cur], ++pr->serial, region, region, area.x, area.y,
+                   None, None, None, PresentOptionNone, 0, 0, 0, NULL, 0);
+    XFixesDestroyRegion(d, region);
+    pl->busy[pl->cur] = 1;
+    return;
+  }
+#endif
+  XCopyArea(d, pl->pix[pl->cur], w, gc, 0, 0, area.width, area.height, area.x, area.y);
+}
+
+/**
+ * Move the rubber-band preview of `shape` to (x0,y0)-(x1,y1). Only the union
+ * of the previous box (*box) and the new one is repainted; *box is updated.
+ */
+void showShapePreview(Display *d, Window w, GC gc, GC gcPreDraw, PreviewLayer *pl, Drawable base,
+                      XRectangle *box, char shape, int rounded, int x0, int y0, int x1, int y1,
+                      int lineWidth, unsigned int screenW, unsigned int screenH)
+{
+  XRectangle next = unionRect(shapeBounds(shape, x0, y0, x1, y1, lineWidth),
+                              (XRectangle){0, 0, 0, 0}, screenW, screenH);
+  XRectangle area = unionRect(*box, next, screenW, screenH);
+  if (area.width == 0)
+    return;
+  Pixmap scratch = previewPrepare(d, w, gc, pl, base, area);
+  drawShape(d, scratch, gcPreDraw, shape, rounded, x0 - area.x, y0 - area.y, x1 - area.x, y1 - area.y);
+  previewPresent(d, w, gc, pl, area);
+  *box = next;
+}
+
+/**
+ * Remove the preview: the box it covered is recomposited from the layers
+ * with the rest of the damage.
+ */
+void hideShapePreview(DamageList *damage, XRectangle *box, unsigned int screenW, unsigned int screenH)
+{
+  addRepaint(damage, *box, screenW, screenH);
+  box->width = box->height = 0;
+}
+
+typedef enum
+{
+  FIT_NONE,
+  FIT_LINE,
+  FIT_ARROW,
+  FIT_CIRCLE,
+  FIT_ELLIPSE,
+  FIT_RECT
+} FitKind;
+
+/**
+ * Result of fitting a freehand stroke to a primitive.
+ * LINE/ARROW: (x0, y0) -> (x1, y1)
+ * CIRCLE: center (x0, y0), diameter x1
+ * ELLIPSE/RECT: opposite corners (x0, y0) and (x1, y1)
+ */
+typedef struct
+{
+  FitKind kind;
+  int x0, y0, x1, y1;
+} ShapeFit;
+
+static inline double pointDistance(Point a, Point b)
+{
+  double dx = a.x - b.x, dy = a.y - b.y;
+  return sqrt(dx * dx + dy * dy);
+}
+
+/**
+ * Fit a finished freehand stroke to a line, arrow, circle, ellipse or
+ * rectangle. Every test is a constant number of linear passes over the
+ * points (centered moments for the least-squares circle, distances for the
+ * residuals), so a 10k point stroke fits in well under a millisecond.
+ * Returns the detected kind (FIT_NONE when nothing is close enough).
+ */
+FitKind fitStroke(const Path *p, ShapeFit *fit)
+{
+  fit->kind = FIT_NONE;
+  size_t n = p->count;
+  if (n < 5)
+    return FIT_NONE;
+
+  const Point *pt = p->items;
+  int minX = pt[0].x, maxX = pt[0].x, minY = pt[0].y, maxY = pt[0].y;
+  double sx = 0, sy = 0, length = 0, far = 0;
+  Point farthest = pt[0];
+  for (size_t i = 0; i < n; i++)
+  {
+    if (pt[i].x < minX) minX = pt[i].x;
+    if (pt[i].x > maxX) maxX = pt[i].x;
+    if (pt[i].y < minY) minY = pt[i].y;
+    if (pt[i].y > maxY) maxY = pt[i].y;
+    sx += pt[i].x;
+    sy += pt[i].y;
+    if (i > 0)
+      length += pointDistance(pt[i], pt[i - 1]);
+    double dist = pointDistance(pt[i], pt[0]);
+    if (dist > far)
+    {
+      far = dist;
+      farthest = pt[i];
+    }
+  }
+  int bw = maxX - minX, bh = maxY - minY;
+  int extent = bw > bh ? bw : bh;
+  if (extent < 10 || length <= 0)
+    return FIT_NONE;
+
+  // Centered second and third moments: covariance for the total least
+  // squares line, and the terms of the algebraic (Kasa) circle fit.
+  double mx = sx / n, my = sy / n;
+  double suu = 0, svv = 0, suv = 0, suuu = 0, svvv = 0, suvv = 0, svuu = 0;
+  for (size_t i = 0; i < n; i++)
+  {
+    double u = pt[i].x - mx, v = pt[i].y - my;
+    suu += u * u;
+    svv += v * v;
+    suv += u * v;
+    suuu += u * u * u;
+    svvv += v * v * v;
+    suvv += u * v * v;
+    svuu += v * u * u;
+  }
+
+  double gap = pointDistance(pt[n - 1], pt[0]);
+  int closed = gap < 0.25 * extent && length > 2.0 * extent;
+
+  if (!closed)
+  {
+    // The tip is where the stroke first gets (almost) as far from the start
+    // as it will ever get. A straight shaft up to it with nothing after is a
+    // line; a short scribble that stays around the tip is an arrow head.
+    size_t tipIdx = 0;
+    double lengthToTip = 0;
+    for (size_t i = 1; i < n; i++)
+    {
+      lengthToTip += pointDistance(pt[i], pt[i - 1]);
+      if (pointDistance(pt[i], pt[0]) >= 0.97 * far)
+      {
+        tipIdx = i;
+        break;
+      }
+    }
+    Point tip = pt[tipIdx];
+    double dx = tip.x - pt[0].x, dy = tip.y - pt[0].y;
+    double dev = 0;
+    for (size_t i = 0; i <= tipIdx; i++)
+      dev += fabs((pt[i].x - pt[0].x) * dy - (pt[i].y - pt[0].y) * dx) / far;
+    if (far < 20 || dev / (tipIdx + 1) > 3 + 0.03 * far)
+      return FIT_NONE;
+
+    double tailLength = length - lengthToTip;
+    if (tailLength < 0.15 * far)
+    {
+      // Principal axis through the centroid, clipped to the projections
+      // of the stroke and oriented from its start to its end
+      double angle = 0.5 * atan2(2 * suv, suu - svv);
+      double c = cos(angle), s = sin(angle);
+      double lo = INFINITY, hi = -INFINITY;
+      for (size_t i = 0; i < n; i++)
+      {
+        double t = (pt[i].x - mx) * c + (pt[i].y - my) * s;
+        if (t < lo) lo = t;
+        if (t > hi) hi = t;
+      }
+      if ((pt[0].x - mx) * c + (pt[0].y - my) * s > (pt[n - 1].x - mx) * c + (pt[n - 1].y - my) * s)
+      {
+        double swap = lo;
+        lo = hi;
+        hi = swap;
+      }
+      *fit = (ShapeFit){FIT_LINE, (int)lround(mx + lo * c), (int)lround(my + lo * s), (int)lround(mx + hi * c),
+                        (int)lround(my + hi * s)};
+      return FIT_LINE;
+    }
+    for (size_t i = tipIdx; i < n; i++)
+    {
+      if (pointDistance(pt[i], tip) > 0.5 * far)
+        return FIT_NONE;
+    }
+    if (far > 40 && tailLength < far)
+    {
+      *fit = (ShapeFit){FIT_ARROW, pt[0].x, pt[0].y, farthest.x, farthest.y};
+      return FIT_ARROW;
+    }
+    return FIT_NONE;
+  }
+
+  // Closed strokes: compare an axis-aligned ellipse inscribed in the
+  // bounding box against the box itself and keep whichever fits better.
+  double a = bw / 2.0, b = bh / 2.0;
+  double ecx = minX + a, ecy = minY + b;
+  double ellipseErr = 0, rectErr = 0;
+  for (size_t i = 0; i < n; i++)
+  {
+    if (a > 0 && b > 0)
+    {
+      double ex = (pt[i].x - ecx) / a, ey = (pt[i].y - ecy) / b;
+      ellipseErr += fabs(sqrt(ex * ex + ey * ey) - 1);
+    }
+    int dl = abs(pt[i].x - minX), dr = abs(maxX - pt[i].x);
+    int dt = abs(pt[i].y - minY), db = abs(maxY - pt[i].y);
+    int m = dl < dr ? dl : dr;
+    if (dt < m) m = dt;
+    if (db < m) m = db;
+    rectErr += m;
+  }
+  ellipseErr = (a > 0 && b > 0) ? ellipseErr / n : INFINITY;
+  rectErr = rectErr / n / ((bw + bh) / 4.0);
+
+  if (rectErr < ellipseErr && rectErr < SNAP_TOLERANCE / 2)
+  {
+    *fit = (ShapeFit){FIT_RECT, minX, minY, maxX, maxY};
+    return FIT_RECT;
+  }
+  if (ellipseErr >= SNAP_TOLERANCE)
+    return FIT_NONE;
+
+  double aspect = (double)bw / (bh > 0 ? bh : 1);
+  double det = suu * svv - suv * suv;
+  if (aspect > 0.8 && aspect < 1.25 && fabs(det) > 1e-9)
+  {
+    double uc = ((suuu + suvv) * svv - (svvv + svuu) * suv) / (2 * det);
+    double vc = ((svvv + svuu) * suu - (suuu + suvv) * suv) / (2 * det);
+    double r = sqrt(uc * uc + vc * vc + (suu + svv) / n);
+    *fit = (ShapeFit){FIT_CIRCLE, (int)lround(mx + uc), (int)lround(my + vc), (int)lround(2 * r), 0};
+    return FIT_CIRCLE;
+  }
+  *fit = (ShapeFit){FIT_ELLIPSE, minX, minY, maxX, maxY};
+  return FIT_ELLIPSE;
+}
+
+/**
+ * Build a fitted primitive using the regular shape builders.
+ * rounded: build rectangles with rounded corners
+ */
+void buildShapeFit(ShapeGeometry *g, const ShapeFit *fit, int rounded)
+{
+  geometryReset(g);
+  switch (fit->kind)
+  {
+  case FIT_LINE:
+    buildLine(g, fit->x0, fit->y0, fit->x1, fit->y1);
+    break;
+  case FIT_ARROW:
+    buildArrow(g, fit->x0, fit->y0, fit->x1, fit->y1, ARROW_SIZE);
+    break;
+  case FIT_CIRCLE:
+    buildCircle(g, fit->x0, fit->y0, fit->x1);
+    break;
+  case FIT_ELLIPSE:
+    buildEllipse(g, fit->x0, fit->y0, fit->x1, fit->y1);
+    break;
+  case FIT_RECT:
+    if (rounded)
+      buildRoundedRectangle(g, fit->x0, fit->y0, fit->x1, fit->y1);
+    else
+      buildRectangle(g, fit->x0, fit->y0, fit->x1, fit->y1);
+    break;
+  case FIT_NONE:
+    break;
+  }
+}
+
+/**
+ * Initializes undo levels that will contain "screenshots" of the state of the undo
+ */
+void initUndo(Pixmap *p, Display *d, Window w, unsigned int width, unsigned int height, int depth, int undoMax)
+{
+  for (int i = 0; i < undoMax; i++)
+  {
+    p[i] = XCreatePixmap(d, w, width, height, depth);
+  }
+}
+
+void bye(Display *d, Window w, int color_index, char shape, int thickness, int font_size, int dashed,
+         const Settings *settings)
+{
+  save_config(color_index, shape, thickness, font_size, dashed, settings);
+  screenshotsWait();
+  if (getenv("ZPEN_STATS"))
+  {
+    latencyDump();
+    trafficDump();
+  }
+  XUndefineCursor(d, w);
+  XCloseDisplay(d);
+  exit(0);
+}
+
+/**
+ * Create a fontset (helvetica, medium, roman) at the requested pixel size.
+ * Caller owns the result and must XFreeFontSet it.
+ */
+XFontSet createTextFontSet(Display *d, int size)
+{
+  char pattern[256];
+  snprintf(pattern, sizeof(pattern),
+           "-*-helvetica-medium-r-*-*-%d-*-*-*-*-*-*-*,-*-*-medium-r-*-*-%d-*-*-*-*-*-*-*",
+           size, size);
+  char **missing_list;
+  int missing_count;
+  char *default_string;
+  XFontSet fs = XCreateFontSet(d, pattern, &missing_list, &missing_count, &default_string);
+  if (missing_count > 0)
+    XFreeStringList(missing_list);
+  return fs;
+}
+
+/**
+ * Horizontal band of the screen a line of text at baseline y can touch,
+ * cursor included
+ */
+XRectangle textLineBounds(int y, int fontSize, unsigned int screenW)
+{
+  return (XRectangle){0, y - 2 * fontSize, screenW, 3 * fontSize + 8};
+}
+
+/**
+ * Draw text on `w` with a cursor at the end drawn on `cursorLayer`.
+ * Returns the area of the cursor.
+ */
+XRectangle drawTextWithCursor(Display *d, Drawable w, Drawable cursorLayer, GC gc, XFontSet fontset, int x, int y, const char *text, int cursor_height)
+{
+  int text_width = 0;
+  if (fontset && text && strlen(text) > 0)
+  {
+    XRectangle ink, logical;
+    XmbTextExtents(fontset, text, strlen(text), &ink, &logical);
+    text_width = logical.width;
+    XmbDrawString(d, w, fontset, gc, x, y, text, strlen(text));
+  }
+  // Draw cursor (vertical line)
+  XGCValues values;
+  XGetGCValues(d, gc, GCLineWidth, &values);
+  int pad = values.line_width / 2 + 2;
+  XDrawLine(d, cursorLayer, gc, x + text_width + 2, y - cursor_height + 4, x + text_width + 2, y + 4);
+  return (XRectangle){x + text_width + 2 - pad, y - cursor_height + 4 - pad, 2 * pad, cursor_height + 2 * pad};
+}
+
+/**
+ * Scratch memory reused by every blur so a stroke does not allocate per
+ * motion event. Grows to the largest request and is never shrunk.
+ */
+static uint32_t *blurScratch(size_t words)
+{
+  static uint32_t *buf;
+  static size_t cap;
+  if (words > cap)
+  {
+    uint32_t *grown = realloc(buf, words * sizeof(uint32_t));
+    if (!grown)
+      return NULL;
+    buf = grown;
+    cap = words;
+  }
+  return buf;
+}
+
+/**
+ * Number of taps of a box of `radius` centred at `i` that fall in [0, n)
+ */
+static inline uint32_t boxTaps(int i, int radius, int n)
+{
+  int lo = i - radius < 0 ? 0 : i - radius;
+  int hi = i + radius >= n ? n - 1 : i + radius;
+  return hi - lo + 1;
+}
+
+/**
+ * The two passes of the box blur, as scalar reference code and as vector
+ * kernels picked at runtime from what the CPU supports. Channels stay
+ * interleaved, so widening bytes to 32-bit sums and narrowing the averages
+ * back are the only channel shuffles. Vector kernels divide in single
+ * precision, which is exact here because sums stay below 2^24 and the
+ * divisor is at most (2r+1)^2, so they match the scalar code bit for bit.
+ *
+ * horizontal: running sums of one row of `w` pixels into `out`, 4 words
+ * per pixel.
+ * vertical: slide the column sums by `addRow`/`subRow` (either may be NULL)
+ * and write one row of averages, the divisor of pixel x being
+ * rows * taps[x].
+ */
+typedef struct
+{
+  const char *name;
+  int (*supported)(void);
+  void (*horizontal)(const uint8_t *row, int w, int radius, uint32_t *out);
+  void (*vertical)(uint32_t *colSum, const uint32_t *addRow, const uint32_t *subRow,
+                   const uint32_t *taps, uint32_t rows, uint8_t *out, int w);
+} BlurKernels;
+
+static int blurAlways(void)
+{
+  return 1;
+}
+
+static void blurHorizontalScalar(const uint8_t *row, int w, int radius, uint32_t *out)
+{
+  uint32_t sum[4] = {0, 0, 0, 0};
+  for (int x = 0; x < radius && x < w; x++)
+    for (int c = 0; c < 4; c++)
+      sum[c] += row[x * 4 + c];
+  for (int x = 0; x < w; x++)
+  {
+    int add = x + radius, sub = x - radius - 1;
+    for (int c = 0; c < 4; c++)
+    {
+      if (add < w)
+        sum[c] += row[add * 4 + c];
+      if (sub >= 0)
+        sum[c] -= row[sub * 4 + c];
+      out[x * 4 + c] = sum[c];
+    }
+  }
+}
+
+static void blurVerticalScalar(uint32_t *colSum, const uint32_t *addRow, const uint32_t *subRow,
+                               const uint32_t *taps, uint32_t rows, uint8_t *out, int w)
+{
+  for (int x = 0; x < w; x++)
+  {
+    uint32_t count = rows * taps[x];
+    for (int c = 0; c < 4; c++)
+    {
+      int i = x * 4 + c;
+      if (addRow)
+        colSum[i] += addRow[i];
+      if (subRow)
+        colSum[i] -= subRow[i];
+      out[i] = colSum[i] / count;
+    }
+  }
+}
 
-  int wrote = stbi_write_png(filename, image->width, image->height, 3,
-                             data, (int)row);
-  free(data);
-  if (!wrote)
+#if defined(__x86_64__) || defined(__i386__)
+static int blurHasSse2(void)
+{
+  return __builtin_cpu_supports("sse2");
+}
+
+static int blurHasAvx2(void)
+{
+  return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("sse2"))) static inline __m128i widenPixel(const uint8_t *p)
+{
+  int32_t v;
+  memcpy(&v, p, 4);
+  __m128i zero = _mm_setzero_si128();
+  return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(v), zero), zero);
+}
+
+__attribute__((target("sse2"))) static void blurHorizontalSse2(const uint8_t *row, int w, int radius, uint32_t *out)
+{
+  __m128i sum = _mm_setzero_si128();
+  for (int x = 0; x < radius && x < w; x++)
+    sum = _mm_add_epi32(sum, widenPixel(row + x * 4));
+  for (int x = 0; x < w; x++)
   {
-    fprintf(stderr, "Failed to save PNG: %s\n", filename);
-    return;
+    int add = x + radius, sub = x - radius - 1;
+    if (add < w)
+      sum = _mm_add_epi32(sum, widenPixel(row + add * 4));
+    if (sub >= 0)
+      sum = _mm_sub_epi32(sum, widenPixel(row + sub * 4));
+    _mm_storeu_si128((__m128i *)(out + x * 4), sum);
   }
+}
 
-  if (clipMode == 1)
+__attribute__((target("sse2"))) static void blurVerticalSse2(uint32_t *colSum, const uint32_t *addRow, const uint32_t *subRow,
+                                                             const uint32_t *taps, uint32_t rows, uint8_t *out, int w)
+{
+  for (int x = 0; x < w; x++)
   {
-    const char *argv[] = {
-        "xclip", "-selection", "clipboard", "-t", "image/png", "-i", filename, NULL};
-    int status = spawn_wait(argv);
-    if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
-      fprintf(stderr, "xclip failed to copy image to clipboard.\n");
+    __m128i c = _mm_loadu_si128((__m128i *)(colSum + x * 4));
+    if (addRow)
+      c = _mm_add_epi32(c, _mm_loadu_si128((const __m128i *)(addRow + x * 4)));
+    if (subRow)
+      c = _mm_sub_epi32(c, _mm_loadu_si128((const __m128i *)(subRow + x * 4)));
+    _mm_storeu_si128((__m128i *)(colSum + x * 4), c);
+    __m128i avg = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(c), _mm_set1_ps((float)(rows * taps[x]))));
+    avg = _mm_packus_epi16(_mm_packs_epi32(avg, avg), avg);
+    int32_t v = _mm_cvtsi128_si32(avg);
+    memcpy(out + x * 4, &v, 4);
   }
-  else if (clipMode == 2)
+}
+
+// Two pixels per step; the horizontal pass is a serial running sum, so
+// it has nothing wider to gain than SSE2
+__attribute__((target("avx2"))) static void blurVerticalAvx2(uint32_t *colSum, const uint32_t *addRow, const uint32_t *subRow,
+                                                             const uint32_t *taps, uint32_t rows, uint8_t *out, int w)
+{
+  int x = 0;
+  for (; x + 2 <= w; x += 2)
   {
-    runTesseractOCR(filename);
+    __m256i c = _mm256_loadu_si256((__m256i *)(colSum + x * 4));
+    if (addRow)
+      c = _mm256_add_epi32(c, _mm256_loadu_si256((const __m256i *)(addRow + x * 4)));
+    if (subRow)
+      c = _mm256_sub_epi32(c, _mm256_loadu_si256((const __m256i *)(subRow + x * 4)));
+    _mm256_storeu_si256((__m256i *)(colSum + x * 4), c);
+    __m256 div = _mm256_setr_m128(_mm_set1_ps((float)(rows * taps[x])), _mm_set1_ps((float)(rows * taps[x + 1])));
+    __m256i avg = _mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(c), div));
+    __m128i lo = _mm256_castsi256_si128(avg), hi = _mm256_extracti128_si256(avg, 1);
+    __m128i packed = _mm_packs_epi32(lo, hi);
+    _mm_storel_epi64((__m128i *)(out + x * 4), _mm_packus_epi16(packed, packed));
   }
+  if (x < w)
+    blurVerticalSse2(colSum + x * 4, addRow ? addRow + x * 4 : NULL, subRow ? subRow + x * 4 : NULL,
+                     taps + x, rows, out + x * 4, w - x);
 }
+#endif
 
-void saveScreenshot(Display *d, Window w, int screen, int x0, int y0, int x1, int y1, int clipMode)
+#if defined(__aarch64__)
+static inline uint32x4_t widenPixelNeon(const uint8_t *p)
 {
-  XImage *image;
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return vmovl_u16(vget_low_u16(vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(v)))));
+}
 
-  // Capture from root window instead of application window for Cinnamon compatibility
-  Window root = DefaultRootWindow(d);
+static void blurHorizontalNeon(const uint8_t *row, int w, int radius, uint32_t *out)
+{
+  uint32x4_t sum = vdupq_n_u32(0);
+  for (int x = 0; x < radius && x < w; x++)
+    sum = vaddq_u32(sum, widenPixelNeon(row + x * 4));
+  for (int x = 0; x < w; x++)
+  {
+    int add = x + radius, sub = x - radius - 1;
+    if (add < w)
+      sum = vaddq_u32(sum, widenPixelNeon(row + add * 4));
+    if (sub >= 0)
+      sum = vsubq_u32(sum, widenPixelNeon(row + sub * 4));
+    vst1q_u32(out + x * 4, sum);
+  }
+}
+
+static void blurVerticalNeon(uint32_t *colSum, const uint32_t *addRow, const uint32_t *subRow,
+                             const uint32_t *taps, uint32_t rows, uint8_t *out, int w)
+{
+  for (int x = 0; x < w; x++)
+  {
+    uint32x4_t c = vld1q_u32(colSum + x * 4);
+    if (addRow)
+      c = vaddq_u32(c, vld1q_u32(addRow + x * 4));
+    if (subRow)
+      c = vsubq_u32(c, vld1q_u32(subRow + x * 4));
+    vst1q_u32(colSum + x * 4, c);
+    uint32x4_t avg = vcvtq_u32_f32(vdivq_f32(vcvtq_f32_u32(c), vdupq_n_f32((float)(rows * taps[x]))));
+    uint16x4_t narrow = vmovn_u32(avg);
+    uint8x8_t bytes = vmovn_u16(vcombine_u16(narrow, narrow));
+    uint32_t v = vget_lane_u32(vreinterpret_u32_u8(bytes), 0);
+    memcpy(out + x * 4, &v, 4);
+  }
+}
+#endif
+
+// Best first; the scalar entry is the reference and always last
+static const BlurKernels blurKernelSets[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    {"avx2", blurHasAvx2, blurHorizontalSse2, blurVerticalAvx2},
+    {"sse2", blurHasSse2, blurHorizontalSse2, blurVerticalSse2},
+#endif
+#if defined(__aarch64__)
+    {"neon", blurAlways, blurHorizontalNeon, blurVerticalNeon},
+#endif
+    {"scalar", blurAlways, blurHorizontalScalar, blurVerticalScalar},
+};
+#define BLUR_KERNEL_SETS (int)(sizeof(blurKernelSets) / sizeof(blurKernelSets[0]))
 
-  // Translate window-relative coordinates to root window coordinates
-  Window child;
-  int root_x0, root_y0, root_x1, root_y1;
-  XTranslateCoordinates(d, w, root, x0, y0, &root_x0, &root_y0, &child);
-  XTranslateCoordinates(d, w, root, x1, y1, &root_x1, &root_y1, &child);
+/**
+ * Fastest kernels this CPU runs, chosen once
+ */
+const BlurKernels *blurKernels(void)
+{
+  static const BlurKernels *chosen;
+  for (int i = 0; !chosen && i < BLUR_KERNEL_SETS; i++)
+    if (blurKernelSets[i].supported())
+      chosen = &blurKernelSets[i];
+  return chosen;
+}
 
-  // Ensure coordinates are properly ordered
-  int x = (root_x0 < root_x1) ? root_x0 : root_x1;
-  int y = (root_y0 < root_y1) ? root_y0 : root_y1;
-  int width = abs(root_x1 - root_x0) + 1;
-  int height = abs(root_y1 - root_y0) + 1;
+/**
+ * Words of scratch a box blur of a w x h block needs
+ */
+static inline size_t boxBlurScratchWords(int w, int h)
+{
+  return ((size_t)w * h + w) * 4 + w;
+}
 
-  // Make sure we have valid dimensions
-  if (width <= 0 || height <= 0)
+/**
+ * Box blur of a 32 bpp pixel block in place with the given kernels, each
+ * byte being a channel. The kernel is separable: a horizontal pass keeps a
+ * running sum per row and stores the sums, and a vertical pass slides a
+ * running sum per column over them, so each pixel costs the same whatever
+ * the radius. Taps outside the block are left out of the average, matching
+ * the former 2D loop. `scratch` must hold boxBlurScratchWords(w, h) words.
+ */
+void boxBlur32With(const BlurKernels *k, uint8_t *data, int w, int h, size_t stride, int radius, uint32_t *scratch)
+{
+  uint32_t *rowSums = scratch;                    // w * h * 4 horizontal sums
+  uint32_t *colSum = scratch + (size_t)w * h * 4; // w * 4 vertical window
+  uint32_t *taps = colSum + (size_t)w * 4;        // w horizontal tap counts
+
+  for (int y = 0; y < h; y++)
+    k->horizontal(data + y * stride, w, radius, rowSums + (size_t)y * w * 4);
+  for (int x = 0; x < w; x++)
+    taps[x] = boxTaps(x, radius, w);
+
+  memset(colSum, 0, (size_t)w * 4 * sizeof(uint32_t));
+  for (int y = 0; y < radius && y < h; y++)
+    for (int i = 0; i < w * 4; i++)
+      colSum[i] += rowSums[(size_t)y * w * 4 + i];
+  for (int y = 0; y < h; y++)
   {
-    fprintf(stderr, "Invalid screenshot dimensions: %dx%d\n", width, height);
-    return;
+    int add = y + radius, sub = y - radius - 1;
+    k->vertical(colSum, add < h ? rowSums + (size_t)add * w * 4 : NULL,
+                sub >= 0 ? rowSums + (size_t)sub * w * 4 : NULL, taps, boxTaps(y, radius, h),
+                data + y * stride, w);
   }
+}
 
-  image = XGetImage(d, root, x, y, width, height, AllPlanes, ZPixmap);
-  if (image == NULL)
+/**
+ * boxBlur32With the fastest kernels available
+ */
+void boxBlur32(uint8_t *data, int w, int h, size_t stride, int radius, uint32_t *scratch)
+{
+  boxBlur32With(blurKernels(), data, w, h, stride, radius, scratch);
+}
+
+/**
+ * Gaussian blur approximated by BLUR_PASSES box blurs of `radius`, so the
+ * cost stays linear in the pixels whatever the strength. Same scratch as
+ * boxBlur32.
+ */
+void gaussBlur32(uint8_t *data, int w, int h, size_t stride, int radius, uint32_t *scratch)
+{
+  for (int i = 0; i < BLUR_PASSES; i++)
+    boxBlur32(data, w, h, stride, radius, scratch);
+}
+
+/**
+ * Summed-area table of the frozen desktop, built on a thread the first
+ * time a pixelation asks for it. The sum of any rectangle of it is four
+ * lookups, so pixelate cells over untouched background cost O(1) per pixel
+ * and need no read back from the server. Sums wrap at 32 bits, which stays
+ * exact for the difference over any rectangle of less than 2^24 pixels.
+ * Until then only the 4 bytes per pixel of the capture are kept, not the
+ * 12 of the table, and sessions that never pixelate never build it.
+ */
+typedef struct
+{
+  int width, height;
+  uint32_t *sums;   // (width + 1) * (height + 1) blue, green and red sums
+  uint32_t *pixels; // the capture, owned by the builder once it started
+  size_t stride;    // pixels per row of `pixels`
+  int started;      // the builder was started; main thread only
+  int ready;        // `sums` is complete; written by the builder thread
+} BackgroundSums;
+
+static BackgroundSums backgroundSums;
+
+static void *backgroundSumsBuild(void *arg)
+{
+  BackgroundSums *bs = arg;
+  size_t row = (size_t)(bs->width + 1) * 3;
+  uint32_t *sums = malloc(row * (bs->height + 1) * sizeof(uint32_t));
+  if (sums)
   {
-    // Fallback to application window if root capture fails
-    image = XGetImage(d, w, x, y, width, height, AllPlanes, ZPixmap);
-    if (image == NULL)
+    memset(sums, 0, row * sizeof(uint32_t));
+    for (int y = 0; y < bs->height; y++)
     {
-      fprintf(stderr, "Failed to capture screenshot.\n");
-      return;
+      const uint32_t *px = bs->pixels + (size_t)y * bs->stride;
+      const uint32_t *above = sums + (size_t)y * row;
+      uint32_t *out = sums + (size_t)(y + 1) * row;
+      uint32_t b = 0, g = 0, r = 0;
+      out[0] = out[1] = out[2] = 0;
+      for (int x = 0; x < bs->width; x++)
+      {
+        b += px[x] & 0xFF;
+        g += (px[x] >> 8) & 0xFF;
+        r += (px[x] >> 16) & 0xFF;
+        out[x * 3 + 3] = above[x * 3 + 3] + b;
+        out[x * 3 + 4] = above[x * 3 + 4] + g;
+        out[x * 3 + 5] = above[x * 3 + 5] + r;
+      }
     }
+    bs->sums = sums;
   }
+  free(bs->pixels);
+  bs->pixels = NULL;
+  if (sums)
+    __atomic_store_n(&bs->ready, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
 
-  saveScreenshotFile(image, clipMode);
-  XDestroyImage(image);
+/**
+ * Keep the 32 bpp desktop capture `img` for the sums, taking its pixels
+ * over. Nothing is kept when its pixels are not native words.
+ */
+void backgroundSumsKeep(XImage *img)
+{
+  const uint16_t one = 1;
+  int lsbHost = *(const uint8_t *)&one;
+  if (img->bits_per_pixel != 32 || img->byte_order != (lsbHost ? LSBFirst : MSBFirst))
+    return;
+  backgroundSums.width = img->width;
+  backgroundSums.height = img->height;
+  backgroundSums.stride = img->bytes_per_line / 4;
+  backgroundSums.pixels = (uint32_t *)img->data;
+  img->data = NULL; // XDestroyImage leaves the pixels to the sums
 }
 
-void pasteClipboard(Display *d, Window w, GC gc, XVisualInfo *vinfo, int mouse_x, int mouse_y, unsigned int win_width, unsigned int win_height)
+/**
+ * Start building the sums from the kept capture, once
+ */
+void backgroundSumsStart(void)
 {
-  // Receive xclip output into a secure temp file (no shell, no fixed path).
-  char tmp_path[1024];
-  snprintf(tmp_path, sizeof(tmp_path), "%s/zpen-paste-XXXXXX", tmp_dir());
-  int tmp_fd = mkstemp(tmp_path);
-  if (tmp_fd == -1)
+  if (backgroundSums.started || !backgroundSums.pixels)
+    return;
+  backgroundSums.started = 1;
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, backgroundSumsBuild, &backgroundSums) != 0)
   {
-    fprintf(stderr, "Paste: failed to create temp file: %s\n", strerror(errno));
+    free(backgroundSums.pixels);
+    backgroundSums.pixels = NULL;
     return;
   }
+  pthread_detach(thread);
+}
 
-  pid_t pid = fork();
-  if (pid == -1)
+static inline int backgroundSumsReady(void)
+{
+  return __atomic_load_n(&backgroundSums.ready, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Mean opaque colour of the desktop in [x0, x1) x [y0, y1)
+ */
+static inline uint32_t backgroundMean(int x0, int y0, int x1, int y1)
+{
+  size_t row = (size_t)(backgroundSums.width + 1) * 3;
+  const uint32_t *top = backgroundSums.sums + (size_t)y0 * row;
+  const uint32_t *bottom = backgroundSums.sums + (size_t)y1 * row;
+  uint32_t count = (uint32_t)(x1 - x0) * (y1 - y0);
+  uint32_t mean = 0xFF000000;
+  for (int c = 0; c < 3; c++)
   {
-    close(tmp_fd);
-    unlink(tmp_path);
-    return;
+    uint32_t sum = bottom[x1 * 3 + c] - bottom[x0 * 3 + c] - top[x1 * 3 + c] + top[x0 * 3 + c];
+    mean |= sum / count << (8 * c);
   }
-  if (pid == 0)
+  return mean;
+}
+
+/**
+ * pixelate32() of the desktop in the screen rectangle `r`, into
+ * r.width * r.height words at `out`
+ */
+void backgroundPixelate32(uint32_t *out, XRectangle r, int block)
+{
+  for (int cy = 0; cy < r.height; cy += block)
   {
-    dup2(tmp_fd, STDOUT_FILENO);
-    close(tmp_fd);
-    int devnull = open("/dev/null", O_WRONLY);
-    if (devnull != -1)
+    int rows = cy + block > r.height ? r.height - cy : block;
+    for (int cx = 0; cx < r.width; cx += block)
     {
-      dup2(devnull, STDERR_FILENO);
-      close(devnull);
+      int cols = cx + block > r.width ? r.width - cx : block;
+      uint32_t mean = backgroundMean(r.x + cx, r.y + cy, r.x + cx + cols, r.y + cy + rows);
+      for (int y = cy; y < cy + rows; y++)
+        for (int x = cx; x < cx + cols; x++)
+          out[(size_t)y * r.width + x] = mean;
     }
-    execlp("xclip", "xclip", "-selection", "clipboard", "-t", "image/png", "-o", (char *)NULL);
-    _exit(127);
-  }
-  close(tmp_fd);
-  int status = 0;
-  while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {}
-  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
-  {
-    fprintf(stderr, "No image in clipboard or xclip failed\n");
-    unlink(tmp_path);
-    return;
   }
+}
 
-  // Load the PNG image using stb_image (force RGBA)
-  int img_w, img_h, channels;
-  unsigned char *data = stbi_load(tmp_path, &img_w, &img_h, &channels, 4);
-  unlink(tmp_path);
-  if (!data)
+/**
+ * Words of scratch pixelate32 needs for a block of width `w`
+ */
+static inline size_t pixelateScratchWords(int w, int block)
+{
+  return (size_t)(w / block + 1) * 4;
+}
+
+/**
+ * Replace every `block` x `block` cell of a 32 bpp pixel block with its
+ * average, in place, each byte being a channel. Cells start at the block
+ * origin; the last row and column of cells may be partial. Each block row
+ * is summed in one pass over its pixels, then filled.
+ */
+void pixelate32(uint8_t *data, int w, int h, size_t stride, int block, uint32_t *sums)
+{
+  int cells = (w + block - 1) / block;
+  for (int y0 = 0; y0 < h; y0 += block)
   {
-    fprintf(stderr, "Failed to load clipboard image\n");
-    return;
+    int rows = y0 + block > h ? h - y0 : block;
+    memset(sums, 0, (size_t)cells * 4 * sizeof(uint32_t));
+    for (int y = y0; y < y0 + rows; y++)
+    {
+      const uint8_t *px = data + y * stride;
+      uint32_t *sum = sums;
+      for (int x0 = 0; x0 < w; x0 += block, sum += 4)
+        for (int x = x0; x < x0 + block && x < w; x++, px += 4)
+        {
+          sum[0] += px[0];
+          sum[1] += px[1];
+          sum[2] += px[2];
+          sum[3] += px[3];
+        }
+    }
+    for (int i = 0; i < cells; i++)
+    {
+      uint32_t count = rows * (i * block + block > w ? w - i * block : block);
+      for (int c = 0; c < 4; c++)
+        sums[i * 4 + c] /= count;
+    }
+    for (int y = y0; y < y0 + rows; y++)
+    {
+      uint8_t *px = data + y * stride;
+      const uint32_t *avg = sums;
+      for (int x0 = 0; x0 < w; x0 += block, avg += 4)
+      {
+        uint8_t cell[4] = {avg[0], avg[1], avg[2], avg[3]};
+        for (int x = x0; x < x0 + block && x < w; x++, px += 4)
+          memcpy(px, cell, 4);
+      }
+    }
   }
+}
 
-  // Bound dimensions before allocating; rejects malformed PNGs that would
-  // demand absurd memory.
-  const int MAX_PASTE_DIM = 8192;
-  if (img_w <= 0 || img_h <= 0 || img_w > MAX_PASTE_DIM || img_h > MAX_PASTE_DIM)
+/**
+ * Square covered by a brush of `brushSize` centred at (cx, cy), clamped to
+ * the window
+ */
+XRectangle brushRect(int cx, int cy, int brushSize, unsigned int winW, unsigned int winH)
+{
+  int x0 = cx - brushSize / 2;
+  int y0 = cy - brushSize / 2;
+  int x1 = x0 + brushSize;
+  int y1 = y0 + brushSize;
+  if (x0 < 0)
+    x0 = 0;
+  if (y0 < 0)
+    y0 = 0;
+  if (x1 > (int)winW)
+    x1 = (int)winW;
+  if (y1 > (int)winH)
+    y1 = (int)winH;
+  if (x1 <= x0 || y1 <= y0)
+    return (XRectangle){0, 0, 0, 0};
+  return (XRectangle){x0, y0, x1 - x0, y1 - y0};
+}
+
+/**
+ * Redaction filters of the brush tools
+ */
+typedef enum
+{
+  FILTER_BLUR,     // Gaussian blur, strength is the box pass radius
+  FILTER_PIXELATE, // mosaic, strength is the cell size
+} AreaFilter;
+
+/**
+ * One filter over a large area, cut in tiles for the worker pool. A tile
+ * reads `src` with an apron of `apron` pixels around it, as far as the
+ * area goes, and writes only its own pixels to `dst`, so tiles do not
+ * depend on each other and the result is the same as in one piece.
+ */
+typedef struct
+{
+  const uint8_t *src; // 32 bpp pixels of the area, left untouched
+  size_t stride;      // bytes per row of src
+  uint32_t *dst;      // w * h filtered pixels
+  int w, h;
+  AreaFilter filter;
+  int strength;
+  int passes;       // box passes of a blur
+  int tileW, tileH; // pixelate tiles are whole cells
+  int apron;
+  int cols, tiles;
+  int next;    // next tile to take
+  int pending; // tiles not finished yet
+} TileJob;
+
+/**
+ * Growing scratch memory of one thread of the pool
+ */
+typedef struct
+{
+  uint32_t *words;
+  size_t size;
+} TileScratch;
+
+/**
+ * Worker threads filtering the tiles of the posted job, together with the
+ * thread that posted it. Started on first use, one per extra core.
+ */
+static struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t wake; // a job was posted
+  pthread_cond_t done; // the last tile of the job finished
+  TileJob *job;
+  int started;
+} tilePool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0};
+
+/**
+ * Filter tile `t` of `job`
+ */
+static void filterTile(TileJob *job, int t, TileScratch *scratch)
+{
+  int tx = t % job->cols * job->tileW, ty = t / job->cols * job->tileH;
+  int tw = job->w - tx < job->tileW ? job->w - tx : job->tileW;
+  int th = job->h - ty < job->tileH ? job->h - ty : job->tileH;
+  int ax = tx - job->apron < 0 ? 0 : tx - job->apron;
+  int ay = ty - job->apron < 0 ? 0 : ty - job->apron;
+  int aw = (tx + tw + job->apron > job->w ? job->w : tx + tw + job->apron) - ax;
+  int ah = (ty + th + job->apron > job->h ? job->h : ty + th + job->apron) - ay;
+
+  size_t kernelWords = job->filter == FILTER_PIXELATE ? pixelateScratchWords(aw, job->strength)
+                                                       : boxBlurScratchWords(aw, ah);
+  size_t words = (size_t)aw * ah + kernelWords;
+  if (words > scratch->size)
   {
-    fprintf(stderr, "Pasted image dimensions out of range: %dx%d\n", img_w, img_h);
-    stbi_image_free(data);
-    return;
+    uint32_t *grown = realloc(scratch->words, words * sizeof(uint32_t));
+    if (!grown)
+      return; // the tile keeps the unfiltered pixels
+    scratch->words = grown;
+    scratch->size = words;
   }
 
-  // Create XImage from loaded data
-  XImage *img = XCreateImage(d, vinfo->visual, 32, ZPixmap, 0, NULL, img_w, img_h, 32, 0);
-  if (!img)
+  uint32_t *pixels = scratch->words;
+  for (int y = 0; y < ah; y++)
+    memcpy(pixels + (size_t)y * aw, job->src + (size_t)(ay + y) * job->stride + (size_t)ax * 4, (size_t)aw * 4);
+  if (job->filter == FILTER_PIXELATE)
+    pixelate32((uint8_t *)pixels, aw, ah, (size_t)aw * 4, job->strength, pixels + (size_t)aw * ah);
+  else
+    for (int i = 0; i < job->passes; i++)
+      boxBlur32((uint8_t *)pixels, aw, ah, (size_t)aw * 4, job->strength, pixels + (size_t)aw * ah);
+  for (int y = 0; y < th; y++)
+    memcpy(job->dst + (size_t)(ty + y) * job->w + tx, pixels + (size_t)(ty - ay + y) * aw + (tx - ax),
+           (size_t)tw * 4);
+}
+
+/**
+ * Take and filter tiles of the posted job until none is left. Called and
+ * returns with the pool lock held.
+ */
+static void takeTiles(TileJob *job, TileScratch *scratch)
+{
+  while (job->next < job->tiles)
   {
-    fprintf(stderr, "Paste: XCreateImage failed\n");
-    stbi_image_free(data);
-    return;
+    int t = job->next++;
+    pthread_mutex_unlock(&tilePool.lock);
+    filterTile(job, t, scratch);
+    pthread_mutex_lock(&tilePool.lock);
+    if (--job->pending == 0)
+      pthread_cond_signal(&tilePool.done);
   }
-  size_t img_data_size = (size_t)img->bytes_per_line * (size_t)img_h;
-  img->data = malloc(img_data_size);
-  if (!img->data)
+}
+
+static void *tileWorker(void *arg)
+{
+  (void)arg;
+  TileScratch scratch = {NULL, 0};
+  pthread_mutex_lock(&tilePool.lock);
+  for (;;)
   {
-    fprintf(stderr, "Paste: out of memory\n");
-    XDestroyImage(img);
-    stbi_image_free(data);
-    return;
+    if (tilePool.job)
+      takeTiles(tilePool.job, &scratch);
+    pthread_cond_wait(&tilePool.wake, &tilePool.lock);
   }
+  return NULL;
+}
 
-  for (int y = 0; y < img_h; y++)
+/**
+ * Filter the w x h 32 bpp pixels at `data` in tiles on all cores, through
+ * `dst`, which must hold w * h words. Same result as pixelate32() or
+ * `passes` boxBlur32() on the whole area; BLUR_PASSES make the Gaussian.
+ */
+void filterTiled(uint8_t *data, int w, int h, size_t stride, AreaFilter filter, int strength, int passes,
+                 uint32_t *dst)
+{
+  static TileScratch scratch;
+  TileJob job = {data, stride, dst, w, h, filter, strength, passes, TILE_SIZE, TILE_SIZE, 0, 0, 0, 0, 0};
+  if (filter == FILTER_PIXELATE)
   {
-    for (int x = 0; x < img_w; x++)
-    {
-      int idx = (y * img_w + x) * 4;
-      unsigned char r = data[idx + 0];
-      unsigned char g = data[idx + 1];
-      unsigned char b = data[idx + 2];
-      unsigned char a = data[idx + 3];
-      unsigned long pixel = ((unsigned long)a << 24) | ((unsigned long)r << 16) | ((unsigned long)g << 8) | b;
-      XPutPixel(img, x, y, pixel);
-    }
+    // Tiles of whole cells, anchored like the area, need no apron
+    job.tileW = job.tileH = TILE_SIZE > strength ? TILE_SIZE / strength * strength : strength;
   }
-
-  // Draw gradient drop shadow on bottom and right edges
+  else
   {
-    int shadow_size = 6;
-    XRenderPictFormat *fmt = XRenderFindVisualFormat(d, vinfo->visual);
-    Picture dst = XRenderCreatePicture(d, w, fmt, 0, NULL);
-    for (int i = 1; i <= shadow_size; i++)
-    {
-      unsigned short alpha = (unsigned short)(0x4000 * (shadow_size - i + 1) / shadow_size);
-      XRenderColor rc = {0, 0, 0, alpha};
-      // Bottom edge strip
-      int bx = mouse_x + i;
-      int by = mouse_y + img_h + i - 1;
-      int bw = img_w + shadow_size - i;
-      if (bx + bw > (int)win_width)
-        bw = (int)win_width - bx;
-      if (by < (int)win_height && bw > 0)
-        XRenderFillRectangle(d, PictOpOver, dst, &rc, bx, by, bw, 1);
-      // Right edge strip
-      int rx = mouse_x + img_w + i - 1;
-      int ry = mouse_y + i;
-      int rh = img_h + shadow_size - i;
-      if (ry + rh > (int)win_height)
-        rh = (int)win_height - ry;
-      if (rx < (int)win_width && rh > 0)
-        XRenderFillRectangle(d, PictOpOver, dst, &rc, rx, ry, 1, rh);
-    }
-    XRenderFreePicture(d, dst);
+    // The box passes reach passes * radius away; wide aprons get bigger
+    // tiles so that they do not dominate the work
+    job.apron = passes * strength;
+    if (job.tileW < 4 * job.apron)
+      job.tileW = job.tileH = 4 * job.apron;
+    blurKernels(); // chosen once, before the workers race for it
   }
+  job.cols = (w + job.tileW - 1) / job.tileW;
+  job.tiles = job.pending = job.cols * ((h + job.tileH - 1) / job.tileH);
 
-  // Clip image to window bounds
-  int paste_w = img_w;
-  int paste_h = img_h;
-  if (mouse_x + paste_w > (int)win_width)
-    paste_w = (int)win_width - mouse_x;
-  if (mouse_y + paste_h > (int)win_height)
-    paste_h = (int)win_height - mouse_y;
-  if (paste_w > 0 && paste_h > 0)
-    XPutImage(d, w, gc, img, 0, 0, mouse_x, mouse_y, paste_w, paste_h);
-
-  // Draw a subtle 1px border on top and left edges
+  pthread_mutex_lock(&tilePool.lock);
+  if (!tilePool.started)
   {
-    XRenderPictFormat *fmt = XRenderFindVisualFormat(d, vinfo->visual);
-    Picture dst = XRenderCreatePicture(d, w, fmt, 0, NULL);
-    XRenderColor rc = {0, 0, 0, 0x1800};                                         // Black at ~9% opacity
-    XRenderFillRectangle(d, PictOpOver, dst, &rc, mouse_x, mouse_y, paste_w, 1); // top edge
-    XRenderFillRectangle(d, PictOpOver, dst, &rc, mouse_x, mouse_y, 1, paste_h); // left edge
-    XRenderFreePicture(d, dst);
+    tilePool.started = 1;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    for (long i = 1; i < cores; i++)
+    {
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, tileWorker, NULL) != 0)
+        break; // the posting thread can do it all alone
+      pthread_detach(thread);
+    }
   }
+  tilePool.job = &job;
+  pthread_cond_broadcast(&tilePool.wake);
+  takeTiles(&job, &scratch);
+  while (job.pending)
+    pthread_cond_wait(&tilePool.done, &tilePool.lock);
+  tilePool.job = NULL;
+  pthread_mutex_unlock(&tilePool.lock);
+
+  for (int y = 0; y < h; y++)
+    memcpy(data + (size_t)y * stride, dst + (size_t)y * w, (size_t)w * 4);
+}
 
-  XDestroyImage(img); // This also frees img->data
-  stbi_image_free(data);
-  XFlush(d);
+/**
+ * Whether a w x h area is filtered in tiles. Only with more than one core:
+ * the aprons of blur tiles add work that only other cores can pay back.
+ */
+static int filterTiles(int w, int h)
+{
+  static long cores;
+  if (!cores)
+    cores = sysconf(_SC_NPROCESSORS_ONLN);
+  return cores > 1 && (w > TILE_SIZE || h > TILE_SIZE);
 }
 
-static inline void addPoint(Path *p, int x, int y)
+/**
+ * Write `area` of the filtered image `img`, from (srcX, srcY) in it, to the
+ * annotation layer `w` and to `scene`, only inside `clip` when given
+ */
+static void putFiltered(Display *d, Drawable scene, Drawable w, GC gc, XImage *img, int srcX, int srcY,
+                        XRectangle area, const XRectangle *clip, int nClip)
 {
-  da_append(p, ((Point){x, y}));
+  if (nClip)
+    XSetClipRectangles(d, gc, 0, 0, (XRectangle *)clip, nClip, Unsorted);
+  XPutImage(d, w, gc, img, srcX, srcY, area.x, area.y, area.width, area.height);
+  XPutImage(d, scene, gc, img, srcX, srcY, area.x, area.y, area.width, area.height);
+  if (nClip)
+    XSetClipMask(d, gc, None);
 }
 
-void smoothPath(Path *path, int smoothing_level)
+/**
+ * Filter `area` of what is visible in `scene`, in one read and one write.
+ * Only the `nClip` rectangles of `clip` inside it are written, or all of it
+ * when there are none. The result goes to the annotation layer `w` and to
+ * the scene, so following stamps see it. Blur reads a margin around the
+ * area, within the winW x winH window, so the kernel sees the real
+ * neighbours as blurAreaConvolve() does.
+ * strength: blur box pass radius or pixelate cell size (higher = stronger)
+ * Returns the rectangle that was modified.
+ */
+XRectangle filterArea(Display *d, Drawable scene, Drawable w, GC gc, XRectangle area,
+                      const XRectangle *clip, int nClip, AreaFilter filter, int strength,
+                      unsigned int winW, unsigned int winH)
 {
-  if (smoothing_level <= 1 || path->count < 3)
-    return;
+  if (area.width <= 0 || area.height <= 0)
+    return (XRectangle){0, 0, 0, 0};
+  XRectangle read = area;
+  if (filter == FILTER_BLUR)
+  {
+    int margin = BLUR_PASSES * strength;
+    read = (XRectangle){area.x - margin, area.y - margin, area.width + 2 * margin, area.height + 2 * margin};
+    read = unionRect((XRectangle){0, 0, 0, 0}, read, winW, winH);
+  }
+  int bw = read.width;
+  int bh = read.height;
 
-  Path smoothed_path = {0};
+  XImage *img = XGetImage(d, scene, read.x, read.y, bw, bh, AllPlanes, ZPixmap);
+  if (!img)
+    return (XRectangle){0, 0, 0, 0};
+
+  // Native 32 bpp rows are filtered where they are; other layouts are
+  // converted to scratch words first
+  PixelFormat pf;
+  pixelFormatInit(&pf, img);
+  int packed = pf.fromArgb != xrgb32FromArgb;
+  int tiled = filterTiles(bw, bh);
+  size_t kernelWords = tiled                      ? (size_t)bw * bh
+                       : filter == FILTER_PIXELATE ? pixelateScratchWords(bw, strength)
+                                                   : boxBlurScratchWords(bw, bh);
+  uint32_t *scratch = blurScratch(kernelWords + (packed ? (size_t)bw * bh : 0));
+  if (!scratch)
+  {
+    XDestroyImage(img);
+    return (XRectangle){0, 0, 0, 0};
+  }
 
-  for (int i = 0; i < path->count; i++)
+  uint8_t *pixels = (uint8_t *)img->data;
+  size_t stride = img->bytes_per_line;
+  if (packed)
   {
-    if (i == 0 || i == path->count - 1)
+    uint32_t *words = scratch + kernelWords;
+    for (int iy = 0; iy < bh; iy++)
+      pf.toArgb(&pf, img, iy, words + (size_t)iy * bw);
+    pixels = (uint8_t *)words;
+    stride = (size_t)bw * 4;
+  }
+  if (tiled)
+    filterTiled(pixels, bw, bh, stride, filter, strength, BLUR_PASSES, scratch);
+  else if (filter == FILTER_PIXELATE)
+    pixelate32(pixels, bw, bh, stride, strength, scratch);
+  else
+    gaussBlur32(pixels, bw, bh, stride, strength, scratch);
+  if (packed)
+    for (int iy = 0; iy < bh; iy++)
+      pf.fromArgb(&pf, img, iy, (uint32_t *)pixels + (size_t)iy * bw);
+
+  putFiltered(d, scene, w, gc, img, area.x - read.x, area.y - read.y, area, clip, nClip);
+  XDestroyImage(img);
+  return area;
+}
+
+/**
+ * Composite `src` onto the annotation layer and the scene at `area`,
+ * limited to `clip` when given
+ */
+static void writeFiltered(Display *d, Layers *ly, Picture src, int srcX, int srcY, XRectangle area,
+                          const XRectangle *clip, int nClip)
+{
+  Picture targets[2] = {ly->annotationsPic, ly->scenePic};
+  for (int t = 0; t < 2; t++)
+  {
+    if (nClip)
+      XRenderSetPictureClipRectangles(d, targets[t], 0, 0, clip, nClip);
+    XRenderComposite(d, PictOpSrc, src, None, targets[t], srcX, srcY, 0, 0, area.x, area.y, area.width, area.height);
+    if (nClip)
     {
-      // Preserve first and last points exactly to avoid gaps
-      addPoint(&smoothed_path, path->items[i].x, path->items[i].y);
+      XRenderPictureAttributes noClip;
+      noClip.clip_mask = None;
+      XRenderChangePicture(d, targets[t], CPClipMask, &noClip);
     }
+  }
+}
+
+/**
+ * Server-side blur by scaling, for servers without the convolution filter
+ * or when configured. The area is halved
+ * with bilinear filtering until a pixel spans about `radius`, each step
+ * averaging 2x2 pixels, then scaled back up, all by XRender, so no pixels
+ * cross the connection.
+ * Returns the rectangle that was modified.
+ */
+XRectangle blurAreaRender(Display *d, Layers *ly, XRectangle area, const XRectangle *clip, int nClip, int radius)
+{
+  int bw = area.width;
+  int bh = area.height;
+  if (bw <= 0 || bh <= 0)
+    return (XRectangle){0, 0, 0, 0};
+  int levels = 1;
+  while ((1 << levels) < radius && levels < REMOTE_BLUR_LEVELS)
+    levels++;
+
+  // Level 0 is a copy of the area, each following one half the size;
+  // pad repeat keeps the borders from fading to transparent
+  Pixmap pix[REMOTE_BLUR_LEVELS + 1];
+  Picture pic[REMOTE_BLUR_LEVELS + 1];
+  XRenderPictureAttributes pa;
+  pa.repeat = RepeatPad;
+  int lw = bw, lh = bh;
+  XTransform halve = {{{XDoubleToFixed(2), 0, 0}, {0, XDoubleToFixed(2), 0}, {0, 0, XDoubleToFixed(1)}}};
+  for (int i = 0; i <= levels; i++)
+  {
+    pix[i] = XCreatePixmap(d, ly->scene, lw, lh, ly->depth);
+    pic[i] = XRenderCreatePicture(d, pix[i], ly->format, CPRepeat, &pa);
+    if (i == 0)
+      XRenderComposite(d, PictOpSrc, ly->scenePic, None, pic[0], area.x, area.y, 0, 0, 0, 0, bw, bh);
     else
-    {
-      // Apply smoothing only to interior points
-      int sum_x = 0, sum_y = 0, count = 0;
-      for (int j = -smoothing_level; j <= smoothing_level; j++)
-      {
-        int index = i + j;
-        if (index >= 0 && index < path->count)
-        {
-          sum_x += path->items[index].x;
-          sum_y += path->items[index].y;
-          count++;
-        }
-      }
-      addPoint(&smoothed_path, sum_x / count, sum_y / count);
-    }
+      XRenderComposite(d, PictOpSrc, pic[i - 1], None, pic[i], 0, 0, 0, 0, 0, 0, lw, lh);
+    XRenderSetPictureTransform(d, pic[i], &halve);
+    XRenderSetPictureFilter(d, pic[i], FilterBilinear, NULL, 0);
+    lw = (lw + 1) / 2;
+    lh = (lh + 1) / 2;
   }
 
-  // Copy back the smoothed points
-  path->count = 0;
-  for (int i = 0; i < smoothed_path.count; i++)
+  double shrink = 1.0 / (1 << levels);
+  XTransform grow = {{{XDoubleToFixed(shrink), 0, 0}, {0, XDoubleToFixed(shrink), 0}, {0, 0, XDoubleToFixed(1)}}};
+  XRenderSetPictureTransform(d, pic[levels], &grow);
+  writeFiltered(d, ly, pic[levels], 0, 0, area, clip, nClip);
+  for (int i = 0; i <= levels; i++)
   {
-    addPoint(path, smoothed_path.items[i].x, smoothed_path.items[i].y);
+    XRenderFreePicture(d, pic[i]);
+    XFreePixmap(d, pix[i]);
   }
-  free(smoothed_path.items);
+  return area;
 }
 
-// Build guide line XOR color: alpha=0 so XOR with 0xFF background alpha
-// produces 0xFF (opaque), and halved RGB for mid-range contrast
-static unsigned long guideColor(unsigned long c)
+/**
+ * Gaussian blur of `area` with the XRender convolution filter, entirely on
+ * the server. The area is copied with a margin so the kernel sees the real
+ * neighbours, then each of the BLUR_PASSES box passes is a horizontal and a
+ * vertical 1D kernel, which keeps the cost linear in the radius like the
+ * client code.
+ * Returns the rectangle that was modified.
+ */
+XRectangle blurAreaConvolve(Display *d, Layers *ly, XRectangle area, const XRectangle *clip, int nClip,
+                            int radius, unsigned int winW, unsigned int winH)
+{
+  if (!area.width || !area.height)
+    return (XRectangle){0, 0, 0, 0};
+  int margin = BLUR_PASSES * radius;
+  XRectangle grown = {area.x - margin, area.y - margin, area.width + 2 * margin, area.height + 2 * margin};
+  grown = unionRect((XRectangle){0, 0, 0, 0}, grown, winW, winH);
+
+  int taps = 2 * radius + 1;
+  XFixed *params = malloc((taps + 2) * sizeof(XFixed));
+  if (!params)
+    return (XRectangle){0, 0, 0, 0};
+  for (int i = 0; i < taps; i++)
+    params[i + 2] = XDoubleToFixed(1.0 / taps);
+
+  XRenderPictureAttributes pa;
+  pa.repeat = RepeatPad;
+  Pixmap pix[2];
+  Picture pic[2];
+  for (int i = 0; i < 2; i++)
+  {
+    pix[i] = XCreatePixmap(d, ly->scene, grown.width, grown.height, ly->depth);
+    pic[i] = XRenderCreatePicture(d, pix[i], ly->format, CPRepeat, &pa);
+  }
+  XRenderComposite(d, PictOpSrc, ly->scenePic, None, pic[0], grown.x, grown.y, 0, 0, 0, 0,
+                   grown.width, grown.height);
+  for (int pass = 0; pass < BLUR_PASSES; pass++)
+  {
+    params[0] = XDoubleToFixed(taps);
+    params[1] = XDoubleToFixed(1);
+    XRenderSetPictureFilter(d, pic[0], FilterConvolution, params, taps + 2);
+    XRenderComposite(d, PictOpSrc, pic[0], None, pic[1], 0, 0, 0, 0, 0, 0, grown.width, grown.height);
+    params[0] = XDoubleToFixed(1);
+    params[1] = XDoubleToFixed(taps);
+    XRenderSetPictureFilter(d, pic[1], FilterConvolution, params, taps + 2);
+    if (pass == BLUR_PASSES - 1)
+      writeFiltered(d, ly, pic[1], area.x - grown.x, area.y - grown.y, area, clip, nClip);
+    else
+      XRenderComposite(d, PictOpSrc, pic[1], None, pic[0], 0, 0, 0, 0, 0, 0, grown.width, grown.height);
+  }
+  for (int i = 0; i < 2; i++)
+  {
+    XRenderFreePicture(d, pic[i]);
+    XFreePixmap(d, pix[i]);
+  }
+  free(params);
+  return area;
+}
+
+/**
+ * Whether the X server offers the XRender filter `name`
+ */
+int renderHasFilter(Display *d, Drawable drawable, const char *name)
 {
-  unsigned long r = ((c >> 16) & 0xFF) / 2;
-  unsigned long g = ((c >> 8) & 0xFF) / 2;
-  unsigned long b = (c & 0xFF) / 2;
-  return (r << 16) | (g << 8) | b;
+  XFilters *filters = XRenderQueryFilters(d, drawable);
+  int found = 0;
+  if (!filters)
+    return 0;
+  for (int i = 0; i < filters->nfilter && !found; i++)
+    found = strcmp(filters->filter[i], name) == 0;
+  XFree(filters);
+  return found;
 }
 
 /**
- * Draw an path
- * p: array of points (x,y)
+ * Resolve the configured blur backend. Auto keeps blur on the server for
+ * remote displays and on the CPU kernels otherwise; convolution falls back
+ * to the client kernels when the server lacks the filter.
  */
-void drawPath(Display *d, Window w, GC gc, Path *p)
+BlurBackend blurBackendSelect(Display *d, Drawable drawable, BlurBackend wanted, int remote)
 {
-  for (int i = 1; i < p->count; i++)
+  int convolution = renderHasFilter(d, drawable, FilterConvolution);
+  if (wanted == BLUR_BACKEND_AUTO)
+    wanted = !remote ? BLUR_BACKEND_CLIENT : convolution ? BLUR_BACKEND_CONVOLUTION : BLUR_BACKEND_SCALE;
+  if (wanted == BLUR_BACKEND_CONVOLUTION && !convolution)
   {
-    XDrawLine(d, w, gc,
-              p->items[i - 1].x, p->items[i - 1].y,
-              p->items[i].x, p->items[i].y);
+    fprintf(stderr, "zpen: the X server has no convolution filter, blurring on the client\n");
+    wanted = BLUR_BACKEND_CLIENT;
   }
+  return wanted;
 }
 
 /**
- * Draw an line on the screen
- * x0, y0: point that marks the tip of the line
- * x1, y1: point that marks the end of the line
+ * Pixelate `area` from the background sums when nothing was drawn over it
+ * yet, with no read back. The first call starts building the sums; until
+ * they are ready, and whenever they cannot be used, it returns 0.
  */
-void drawLine(Display *d, Window w, GC gc, int x0, int y0, int x1, int y1)
+int filterBackground(Display *d, Layers *ly, GC gc, XRectangle area, const XRectangle *clip, int nClip, int block)
 {
-  XDrawLine(d, w, gc, x0, y0, x1, y1);
+  backgroundSumsStart();
+  if (!area.width || !area.height || !backgroundSumsReady() || !layersPristine(ly, area))
+    return 0;
+
+  uint32_t *pixels = blurScratch((size_t)area.width * area.height);
+  if (!pixels)
+    return 0;
+  backgroundPixelate32(pixels, area, block);
+
+  size_t stride = (size_t)area.width * 4;
+  XImage *img = XCreateImage(d, ly->visual, ly->depth, ZPixmap, 0, (char *)pixels, area.width, area.height, 32, stride);
+  if (!img)
+    return 0;
+  putFiltered(d, ly->scene, ly->annotations, gc, img, 0, 0, area, clip, nClip);
+  img->data = NULL; // the scratch stays
+  XDestroyImage(img);
+  return 1;
 }
 
 /**
- * Draw an arrow on the screen
- * x0, y0: point that marks the tip of the line
- * x1, y1: point that marks the end of the line
+ * Apply the filter of redaction tool `tool` ('b' or 'B' blur, 'x' or 'X'
+ * pixelate) to `area`, limited to `clip` when given. Blur runs where
+ * `backend` says and, on the client, reads the area back with the margin
+ * its passes reach. Pixelation over untouched desktop comes from the
+ * background sums; elsewhere it reads the area back.
  */
-void drawArrowHead(Display *d, Window w, GC gc, int x1, int y1, float angle, int arrowSize)
+XRectangle filterRegion(Display *d, Layers *ly, GC gc, const Settings *st, BlurBackend backend, char tool,
+                        XRectangle area, const XRectangle *clip, int nClip, unsigned int winW, unsigned int winH)
 {
-  float arrowAngle = PI / 4;
-  int f_x1 = x1 - arrowSize * cos(angle + arrowAngle);
-  int f_y1 = y1 - arrowSize * sin(angle + arrowAngle);
-  int f_x2 = x1 - arrowSize * cos(angle - arrowAngle);
-  int f_y2 = y1 - arrowSize * sin(angle - arrowAngle);
-  drawLine(d, w, gc, x1, y1, f_x1, f_y1);
-  drawLine(d, w, gc, x1, y1, f_x2, f_y2);
+  XRectangle done;
+  if (tool == 'x' || tool == 'X')
+    done = filterBackground(d, ly, gc, area, clip, nClip, st->pixelBlock)
+               ? area
+               : filterArea(d, ly->scene, ly->annotations, gc, area, clip, nClip, FILTER_PIXELATE, st->pixelBlock,
+                            winW, winH);
+  else if (backend == BLUR_BACKEND_CONVOLUTION)
+    done = blurAreaConvolve(d, ly, area, clip, nClip, st->blurRadius, winW, winH);
+  else if (backend == BLUR_BACKEND_SCALE)
+    done = blurAreaRender(d, ly, area, clip, nClip, st->blurRadius);
+  else
+    done = filterArea(d, ly->scene, ly->annotations, gc, area, clip, nClip, FILTER_BLUR, st->blurRadius, winW, winH);
+  // Following stamps of the same frame must not take the area for desktop
+  layersTouch(ly, done);
+  return done;
 }
 
-void drawArrow(Display *d, Window w, GC gc, int x0, int y0, int x1, int y1, int arrowSize)
+/**
+ * Grow `r` to whole cells of the pixelate grid, which is anchored at the
+ * screen origin so overlapping stamps agree on their cells
+ */
+XRectangle snapToCells(XRectangle r, int block, unsigned int winW, unsigned int winH)
 {
-  drawLine(d, w, gc, x0, y0, x1, y1);
-  float angle = atan2(y0 - y1, x0 - x1) + PI;
-  drawArrowHead(d, w, gc, x1, y1, angle, arrowSize);
+  if (!r.width)
+    return r;
+  int x0 = r.x / block * block;
+  int y0 = r.y / block * block;
+  int x1 = (r.x + r.width + block - 1) / block * block;
+  int y1 = (r.y + r.height + block - 1) / block * block;
+  if (x1 > (int)winW)
+    x1 = winW;
+  if (y1 > (int)winH)
+    y1 = winH;
+  return (XRectangle){x0, y0, x1 - x0, y1 - y0};
 }
 
 /**
- * draws a rectangle on the screen
- * x0, y0 : point that marks a corner of the rectangle
- * x1, y1 : point that marks the opposite corner of the rectangle
- * */
-void drawRetangle(Display *d, Window w, GC gc, int x0, int y0, int x1, int y1)
+ * Blur ('B' tool) or pixelate ('X' tool) the rectangle dragged from
+ * (x0, y0) to (x1, y1) at once. Large rectangles are filtered in tiles
+ * on all cores and written back in one upload.
+ */
+XRectangle redactDrag(Display *d, Layers *ly, GC gc, const Settings *st, BlurBackend backend, char tool,
+                      int x0, int y0, int x1, int y1, unsigned int winW, unsigned int winH)
 {
-  int height = abs(y1 - y0);
-  int width = abs(x1 - x0);
+  XRectangle r = {x0 < x1 ? x0 : x1, y0 < y1 ? y0 : y1, abs(x1 - x0) + 1, abs(y1 - y0) + 1};
+  r = unionRect((XRectangle){0, 0, 0, 0}, r, winW, winH);
+  if (tool == 'X')
+    r = snapToCells(r, st->pixelBlock, winW, winH);
+  return filterRegion(d, ly, gc, st, backend, tool, r, NULL, 0, winW, winH);
+}
+
+/**
+ * Start the text redaction of the rectangle dragged from (x0, y0) to
+ * (x1, y1) with the 'B' (blur) or 'X' (pixelate) tool: the region is read
+ * now and recognised by the encoder thread, and redactOcrApply() filters
+ * the words once it is done. Returns 0 when it could not be started.
+ */
+int redactOcrStart(Display *d, Layers *ly, const Settings *st, char tool, int x0, int y0, int x1, int y1,
+                   unsigned int winW, unsigned int winH)
+{
+  XRectangle r = {x0 < x1 ? x0 : x1, y0 < y1 ? y0 : y1, abs(x1 - x0) + 1, abs(y1 - y0) + 1};
+  r = unionRect((XRectangle){0, 0, 0, 0}, r, winW, winH);
+  if (!r.width)
+    return 0;
+  XImage *img = XGetImage(d, ly->scene, r.x, r.y, r.width, r.height, AllPlanes, ZPixmap);
+  if (!img)
+    return 0;
+  if (redactionQueue(img, r, tool, st))
+    return 1;
+  XDestroyImage(img);
+  return 0;
+}
 
-  if (x0 <= x1)
+/**
+ * Blur or pixelate every word that the text redaction `job` found, all in
+ * one filter pass, and free the job. Returns the modified area.
+ */
+XRectangle redactOcrApply(Display *d, Layers *ly, GC gc, const Settings *st, BlurBackend backend,
+                          ScreenshotJob *job, unsigned int winW, unsigned int winH)
+{
+  XRectangle none = {0, 0, 0, 0};
+  XRectangle r = job->area;
+  XRectangle *boxes = job->boxes;
+  int n = job->count;
+  char tool = job->tool;
+  free(job);
+  if (n <= 0)
   {
-    if (y0 <= y1)
-    {
-      XDrawRectangle(d, w, gc, x0, y0, width, height);
-    }
-    else
-    {
-      XDrawRectangle(d, w, gc, x0, y1, width, height);
-    }
+    if (n == 0)
+      fprintf(stderr, "zpen: no text to redact\n");
+    free(boxes);
+    return none;
   }
-  else
+
+  XRectangle area = none;
+  for (int i = 0; i < n; i++)
   {
-    if (y0 <= y1)
-    {
-      XDrawRectangle(d, w, gc, x1, y0, width, height);
-    }
-    else
-    {
-      XDrawRectangle(d, w, gc, x1, y1, width, height);
-    }
+    XRectangle *b = &boxes[i];
+    *b = unionRect(none, (XRectangle){r.x + b->x - 2, r.y + b->y - 2, b->width + 4, b->height + 4}, winW, winH);
+    if (tool == 'X')
+      *b = snapToCells(*b, st->pixelBlock, winW, winH);
+    area = unionRect(area, *b, winW, winH);
   }
+  fprintf(stderr, "zpen: redacted %d word%s\n", n, n == 1 ? "" : "s");
+  area = filterRegion(d, ly, gc, st, backend, tool, area, boxes, n, winW, winH);
+  free(boxes);
+  return area;
 }
 
 /**
- * draws a rounded rectangle on the screen
- * x0, y0 : point that marks a corner of the rectangle
- * x1, y1 : point that marks the opposite corner of the rectangle
- * */
-void drawRoundedRetangle(Display *d, Window w, GC gc, int x0, int y0, int x1, int y1)
+ * Size of the brush of `tool`
+ */
+static inline int brushSize(const Settings *st, char tool)
 {
-  int height = abs(y1 - y0);
-  int width = abs(x1 - x0);
-  int x = (x0 < x1) ? x0 : x1;
-  int y = (y0 < y1) ? y0 : y1;
-
-  // Corner radius is proportional to the smaller dimension
-  int radius = (width < height ? width : height) / 10;
-  if (radius < 3)
-    radius = 3;
-  if (radius > 15)
-    radius = 15;
-
-  int diameter = radius * 2;
+  return tool == 'x' ? PIXELATE_BRUSH : st->blurBrush;
+}
 
-  // Draw four corners (arcs)
-  // Top-left corner
-  XDrawArc(d, w, gc, x, y, diameter, diameter, 90 * 64, 90 * 64);
-  // Top-right corner
-  XDrawArc(d, w, gc, x + width - diameter, y, diameter, diameter, 0, 90 * 64);
-  // Bottom-right corner
-  XDrawArc(d, w, gc, x + width - diameter, y + height - diameter, diameter, diameter, 270 * 64, 90 * 64);
-  // Bottom-left corner
-  XDrawArc(d, w, gc, x, y + height - diameter, diameter, diameter, 180 * 64, 90 * 64);
-
-  // Draw four sides (lines)
-  // Top side
-  XDrawLine(d, w, gc, x + radius, y, x + width - radius, y);
-  // Right side
-  XDrawLine(d, w, gc, x + width, y + radius, x + width, y + height - radius);
-  // Bottom side
-  XDrawLine(d, w, gc, x + radius, y + height, x + width - radius, y + height);
-  // Left side
-  XDrawLine(d, w, gc, x, y + radius, x, y + height - radius);
-}
-
-/**
- * draws a circle on the screen
- * x0, y0 : point that marks a corner of the rectangle
- * x1, y1 : point that marks the opposite corner of the rectangle
- * */
-void drawCircle(Display *d, Window w, GC gc, int x0, int y0, int width)
+/**
+ * Area one stamp of brush `tool` at (cx, cy) covers
+ */
+XRectangle stampRect(const Settings *st, char tool, int cx, int cy, unsigned int winW, unsigned int winH)
 {
-  XDrawArc(d, w, gc, x0 - (int)(width / 2), y0 - (int)(width / 2), width, width, 0, 360 * 64);
+  XRectangle r = brushRect(cx, cy, brushSize(st, tool), winW, winH);
+  return tool == 'x' ? snapToCells(r, st->pixelBlock, winW, winH) : r;
 }
 
 /**
- * draws the horizontal color palette at the bottom-right of the screen
- * */
-void drawColorPalette(Display *d, Window w, GC gc, int screen_width, int screen_height, unsigned long color_list[], int selected_color_index, int thickness, int dashed)
+ * Apply one stamp of brush `tool` at (cx, cy)
+ */
+XRectangle brushStamp(Display *d, Layers *ly, GC gc, const Settings *st, BlurBackend backend, char tool,
+                      int cx, int cy, unsigned int winW, unsigned int winH)
 {
-  int circle_size = 8; // Small circle size
-  int gap = 4;         // Small gap between circles
-  int palette_width = MAX_COLORS * circle_size + (MAX_COLORS - 1) * gap;
-  int start_x = screen_width - palette_width - 4; // 4px margin from right edge
-  int y = screen_height - 10;                     // Position from bottom edge (accounting for -35 window offset)
-
-  // Save current GC color and line attributes (the palette shares its GC with
-  // the pen, so we need to neutralize the user's thickness/dash settings while
-  // drawing the selection ring and restore them on the way out).
-  XGCValues values;
-  XGetGCValues(d, gc, GCForeground | GCLineWidth | GCLineStyle | GCCapStyle | GCJoinStyle, &values);
-  unsigned long original_color = values.foreground;
+  return filterRegion(d, ly, gc, st, backend, tool, stampRect(st, tool, cx, cy, winW, winH), NULL, 0, winW, winH);
+}
 
-  XSetLineAttributes(d, gc, 1, LineSolid, CapButt, JoinMiter);
+/**
+ * Queue brush stamps from `from`, which is already stamped, to `to`, at
+ * most half a brush apart so a fast drag leaves no gap between two motion
+ * events
+ */
+void addBrushSegment(Path *stamps, const Settings *st, char tool, Point from, Point to)
+{
+  int spacing = brushSize(st, tool) / 2;
+  int dx = to.x - from.x, dy = to.y - from.y;
+  int steps = (int)ceil(sqrt((double)dx * dx + (double)dy * dy) / spacing);
+  for (int i = 1; i <= steps; i++)
+    addPoint(stamps, from.x + (int)lround((double)dx * i / steps), from.y + (int)lround((double)dy * i / steps));
+}
 
-  for (int i = 0; i < MAX_COLORS; i++)
+/**
+ * Apply brush `tool` at every queued position and empty the queue.
+ * Consecutive stamps are merged into one region while its bounding box
+ * stays within BLUR_REGION_SLACK times the area they cover, and each
+ * region is blurred with a single read and write clipped to its stamps,
+ * so overlapping stamps are blurred once and cost follows the covered
+ * area rather than the number of events.
+ * Returns the area that was modified.
+ */
+XRectangle flushBrushStamps(Display *d, Layers *ly, GC gc, const Settings *st, BlurBackend backend, char tool, Path *stamps,
+                            unsigned int winW, unsigned int winH)
+{
+  XRectangle area = {0, 0, 0, 0};
+  XRectangle clip[BLUR_REGION_STAMPS];
+  XRectangle region = {0, 0, 0, 0};
+  long covered = 0;
+  int nClip = 0;
+  for (size_t i = 0; i <= stamps->count; i++)
   {
-    int x = start_x + i * (circle_size + gap);
-
-    // Clear the border area first with fully transparent black to erase any previous selection indicator
-    XSetForeground(d, gc, 0x00000000);
-    XFillArc(d, w, gc, x - circle_size / 2 - 3, y - circle_size / 2 - 3, circle_size + 6, circle_size + 6, 0, 360 * 64);
-
-    // Set color for this circle
-    XSetForeground(d, gc, color_list[i]);
-
-    // Draw filled circle
-    XFillArc(d, w, gc, x - circle_size / 2, y - circle_size / 2, circle_size, circle_size, 0, 360 * 64);
+    XRectangle r = {0, 0, 0, 0};
+    if (i < stamps->count)
+    {
+      r = stampRect(st, tool, stamps->items[i].x, stamps->items[i].y, winW, winH);
+      if (!r.width)
+        continue;
+      XRectangle grown = unionRect(region, r, winW, winH);
+      if (nClip < BLUR_REGION_STAMPS &&
+          (long)grown.width * grown.height <= BLUR_REGION_SLACK * (covered + (long)r.width * r.height))
+      {
+        region = grown;
+        covered += (long)r.width * r.height;
+        clip[nClip++] = r;
+        continue;
+      }
+    }
+    if (nClip)
+      area = unionRect(area, filterRegion(d, ly, gc, st, backend, tool, region, clip, nClip, winW, winH), winW, winH);
+    region = r;
+    covered = (long)r.width * r.height;
+    nClip = 0;
+    if (r.width)
+      clip[nClip++] = r;
+  }
+  stamps->count = 0;
+  return area;
+}
 
-    if (i == selected_color_index)
+/**
+ * Refresh rate of the monitor, used to pace rendering. Falls back to
+ * FRAME_RATE_DEFAULT when XRandR is not available.
+ */
+int displayRefreshRate(Display *d, Window root)
+{
+  int rate = 0;
+#ifdef HAVE_XRANDR
+  int ev, err;
+  if (XRRQueryExtension(d, &ev, &err))
+  {
+    XRRScreenConfiguration *sc = XRRGetScreenInfo(d, root);
+    if (sc)
     {
-      // Add white border for selected color
-      XSetForeground(d, gc, 0xFFFFFFFF);
-      XDrawArc(d, w, gc, x - circle_size / 2, y - circle_size / 2, circle_size, circle_size, 0, 360 * 64);
+      rate = XRRConfigCurrentRate(sc);
+      XRRFreeScreenConfigInfo(sc);
     }
   }
+#else
+  (void)d;
+  (void)root;
+#endif
+  if (rate < 24 || rate > 500)
+    rate = FRAME_RATE_DEFAULT;
+  return rate;
+}
 
-  // Stroke-size / dash-pattern indicator to the left of the first color.
-  int indicator_w = circle_size * 3;
-  int indicator_right = start_x - circle_size / 2 - gap;
-  int indicator_left = indicator_right - indicator_w;
-  // Clear previous indicator. CapButt keeps the drawn pixels strictly inside
-  // [indicator_left, indicator_right], so a tight horizontal clear is enough
-  // — extending further right would erase the first color circle.
-  XSetForeground(d, gc, 0x00000000);
-  XFillRectangle(d, w, gc, indicator_left - 2, y - 12, indicator_w + 4, 24);
-  // Draw indicator in current color with current thickness and dash pattern.
-  // CapButt keeps the line strictly within [indicator_left, indicator_right]
-  // so the gap to the first color circle stays constant as thickness grows.
-  XSetForeground(d, gc, color_list[selected_color_index]);
-  if (dashed)
+void setCursor(Display *d, Window w, Cursor *cursor, int cursorId)
+{
+  *cursor = XCreateFontCursor(d, cursorId);
+  XDefineCursor(d, w, *cursor);
+  XSync(d, False);
+}
+
+void setShapeCursor(Display *d, Window w, Cursor *cursor, char shape)
+{
+  switch (shape)
   {
-    char dp[] = {8, 6};
-    XSetDashes(d, gc, 0, dp, 2);
+  case 'c':
+    setCursor(d, w, cursor, XC_dot);
+    break;
+  case 'p':
+    setCursor(d, w, cursor, XC_pencil);
+    break;
+  case 'r':
+    setCursor(d, w, cursor, XC_sizing);
+    break;
+  case 'a':
+    setCursor(d, w, cursor, XC_ur_angle);
+    break;
+  case 'l':
+    setCursor(d, w, cursor, XC_tcross);
+    break;
+  case '{':
+    setCursor(d, w, cursor, XC_left_side);
+    break;
+  case '[':
+    setCursor(d, w, cursor, XC_left_side);
+    break;
+  case 'b':
+    setCursor(d, w, cursor, XC_spraycan);
+    break;
+  case 'x':
+    setCursor(d, w, cursor, XC_dotbox);
+    break;
+  case 'B':
+  case 'X':
+    setCursor(d, w, cursor, XC_sizing);
+    break;
   }
-  XSetLineAttributes(d, gc, thickness, dashed ? LineOnOffDash : LineSolid, CapButt, JoinMiter);
-  XDrawLine(d, w, gc, indicator_left, y, indicator_right, y);
-
-  // Restore original GC state
-  XSetForeground(d, gc, original_color);
-  XSetLineAttributes(d, gc, values.line_width, values.line_style, values.cap_style, values.join_style);
 }
 
 /**
- * draws an opening curly brace on the screen
- * x0, y0 : top point of the brace
- * x1, y1 : bottom point of the brace
- * */
-void drawOpeningBrace(Display *d, Window w, GC gc, int x0, int y0, int x1, int y1)
+ * State of one finger on a touchscreen. Every active touch owns its own
+ * path and rubber-band preview so several people can draw at once.
+ */
+typedef struct
 {
-  int height = abs(y1 - y0);
-  int width = abs(x1 - x0);
-  int midY = (y0 + y1) / 2;
-  int leftX = (x0 < x1) ? x0 : x1;
-  int topY = (y0 < y1) ? y0 : y1;
-  int rightX = leftX + width;
-  int bottomY = topY + height;
-  int quarterH = height / 4;
-  int sixthW = width / 6;
-  int indentAmount = width / 4; // Shallow indent, not all the way to left
+  int active;   // slot in use
+  int id;       // XI2 touch id
+  Path path;    // points of a freehand stroke
+  XPoint start; // anchor of a rubber-band shape
+  XPoint last;  // currently previewed end point, x = -1 when none
+  XRectangle box; // screen area covered by the preview
+  size_t drawn; // points of `path` already on screen
+  int dirty;    // moved since the last frame
+} TouchStroke;
 
-  // Opening brace { with shallow middle indent
-  // Top horizontal section
-  XDrawLine(d, w, gc, leftX + width / 3, topY, rightX - sixthW / 2, topY);
-  // Top right curve downward
-  XDrawLine(d, w, gc, rightX - sixthW / 2, topY, rightX - sixthW / 3, topY + sixthW / 2);
-  XDrawLine(d, w, gc, rightX - sixthW / 3, topY + sixthW / 2, rightX - sixthW / 4, topY + sixthW);
-  // Right side to upper middle
-  XDrawLine(d, w, gc, rightX - sixthW / 4, topY + sixthW, rightX - sixthW / 4, midY - quarterH / 2);
-  // Gentle curve outward for upper middle (angle RIGHT - inverted)
-  XDrawLine(d, w, gc, rightX - sixthW / 4, midY - quarterH / 2, rightX + indentAmount, midY - sixthW / 3);
-  XDrawLine(d, w, gc, rightX + indentAmount, midY - sixthW / 3, rightX + indentAmount + sixthW / 4, midY);
-  // Gentle curve inward for lower middle (back from right bulge)
-  XDrawLine(d, w, gc, rightX + indentAmount + sixthW / 4, midY, rightX + indentAmount, midY + sixthW / 3);
-  XDrawLine(d, w, gc, rightX + indentAmount, midY + sixthW / 3, rightX - sixthW / 4, midY + quarterH / 2);
-  // Right side from lower middle to bottom
-  XDrawLine(d, w, gc, rightX - sixthW / 4, midY + quarterH / 2, rightX - sixthW / 4, bottomY - sixthW);
-  // Bottom right curve upward
-  XDrawLine(d, w, gc, rightX - sixthW / 4, bottomY - sixthW, rightX - sixthW / 3, bottomY - sixthW / 2);
-  XDrawLine(d, w, gc, rightX - sixthW / 3, bottomY - sixthW / 2, rightX - sixthW / 2, bottomY);
-  // Bottom horizontal section
-  XDrawLine(d, w, gc, rightX - sixthW / 2, bottomY, leftX + width / 3, bottomY);
+/**
+ * Returns the slot tracking touch `id`, or NULL when it is not tracked.
+ */
+TouchStroke *findTouch(TouchStroke touches[], int id)
+{
+  for (int i = 0; i < MAX_TOUCHES; i++)
+  {
+    if (touches[i].active && touches[i].id == id)
+      return &touches[i];
+  }
+  return NULL;
 }
 
 /**
- * draws a closing curly brace on the screen
- * x0, y0 : top point of the brace
- * x1, y1 : bottom point of the brace
- * */
-void drawClosingBrace(Display *d, Window w, GC gc, int x0, int y0, int x1, int y1)
+ * Input accumulated between two display frames. Motion only updates this
+ * state; the frame tick draws the result once and flushes the connection.
+ */
+typedef struct
 {
-  int height = abs(y1 - y0);
-  int width = abs(x1 - x0);
-  int midY = (y0 + y1) / 2;
-  int leftX = (x0 < x1) ? x0 : x1;
-  int topY = (y0 < y1) ? y0 : y1;
-  int rightX = leftX + width;
-  int bottomY = topY + height;
-  int quarterH = height / 4;
-  int sixthW = width / 6;
-  int bulgeAmount = width / 4; // Shallow bulge, not all the way to right
+  int pending;      // something changed since the last frame
+  XPoint pointer;   // latest drag position for the preview, x = -1 when none
+  size_t pathDrawn; // points of the freehand path already on screen
+  Path brushStamps; // blur/pixelate brush positions not applied yet
+  Point brushLast;  // latest brush position, already queued or applied
+} FrameInput;
 
-  // Closing brace } with shallow middle bulge
-  // Top horizontal section
-  XDrawLine(d, w, gc, rightX - width / 3, topY, leftX + sixthW / 2, topY);
-  // Top left curve downward
-  XDrawLine(d, w, gc, leftX + sixthW / 2, topY, leftX + sixthW / 3, topY + sixthW / 2);
-  XDrawLine(d, w, gc, leftX + sixthW / 3, topY + sixthW / 2, leftX + sixthW / 4, topY + sixthW);
-  // Left side to upper middle
-  XDrawLine(d, w, gc, leftX + sixthW / 4, topY + sixthW, leftX + sixthW / 4, midY - quarterH / 2);
-  // Gentle curve outward for upper middle (angle LEFT - inverted)
-  XDrawLine(d, w, gc, leftX + sixthW / 4, midY - quarterH / 2, leftX - bulgeAmount, midY - sixthW / 3);
-  XDrawLine(d, w, gc, leftX - bulgeAmount, midY - sixthW / 3, leftX - bulgeAmount - sixthW / 4, midY);
-  // Gentle curve inward for lower middle (back from left indent)
-  XDrawLine(d, w, gc, leftX - bulgeAmount - sixthW / 4, midY, leftX - bulgeAmount, midY + sixthW / 3);
-  XDrawLine(d, w, gc, leftX - bulgeAmount, midY + sixthW / 3, leftX + sixthW / 4, midY + quarterH / 2);
-  // Left side from lower middle to bottom
-  XDrawLine(d, w, gc, leftX + sixthW / 4, midY + quarterH / 2, leftX + sixthW / 4, bottomY - sixthW);
-  // Bottom left curve upward
-  XDrawLine(d, w, gc, leftX + sixthW / 4, bottomY - sixthW, leftX + sixthW / 3, bottomY - sixthW / 2);
-  XDrawLine(d, w, gc, leftX + sixthW / 3, bottomY - sixthW / 2, leftX + sixthW / 2, bottomY);
-  // Bottom horizontal section
-  XDrawLine(d, w, gc, leftX + sixthW / 2, bottomY, rightX - width / 3, bottomY);
+////////////////////////
+// MAIN
+////////////////////////
+#ifdef ZPEN_BENCH
+/**
+ * Microbenchmarks, built by `make bench` instead of the application. They
+ * need no X server: images are plain client-side XImages.
+ */
+static XImage benchImage(int w, int h, uint32_t *pixels)
+{
+  XImage img = {0};
+  img.width = w;
+  img.height = h;
+  img.format = ZPixmap;
+  img.data = (char *)pixels;
+  img.byte_order = LSBFirst;
+  img.bitmap_unit = 32;
+  img.bitmap_bit_order = LSBFirst;
+  img.bitmap_pad = 32;
+  img.depth = 32;
+  img.bytes_per_line = w * 4;
+  img.bits_per_pixel = 32;
+  img.red_mask = 0xFF0000;
+  img.green_mask = 0xFF00;
+  img.blue_mask = 0xFF;
+  XInitImage(&img);
+  return img;
 }
 
 /**
- * draws an opening square bracket on the screen
- * x0, y0 : top point of the bracket
- * x1, y1 : bottom point of the bracket
- * */
-void drawOpeningBracket(Display *d, Window w, GC gc, int x0, int y0, int x1, int y1)
+ * The former blur: (2r+1)^2 XGetPixel taps per pixel, kept as the
+ * reference the kernels must match bit for bit
+ */
+static void benchBlurReference(XImage *img, int radius, unsigned long *buf)
 {
-  int height = abs(y1 - y0);
-  int width = abs(x1 - x0);
-  int leftX = (x0 < x1) ? x0 : x1;
-  int topY = (y0 < y1) ? y0 : y1;
-  int rightX = leftX + width;
-  int bottomY = topY + height;
-  int sixthW = width / 6;
+  int bw = img->width, bh = img->height;
+  for (int iy = 0; iy < bh; iy++)
+  {
+    for (int ix = 0; ix < bw; ix++)
+    {
+      unsigned long ra = 0, ga = 0, ba = 0, aa = 0;
+      int count = 0;
+      for (int dy = -radius; dy <= radius; dy++)
+      {
+        for (int dx = -radius; dx <= radius; dx++)
+        {
+          int sx = ix + dx, sy = iy + dy;
+          if (sx >= 0 && sx < bw && sy >= 0 && sy < bh)
+          {
+            unsigned long pixel = XGetPixel(img, sx, sy);
+            aa += (pixel >> 24) & 0xFF;
+            ra += (pixel >> 16) & 0xFF;
+            ga += (pixel >> 8) & 0xFF;
+            ba += pixel & 0xFF;
+            count++;
+          }
+        }
+      }
+      buf[iy * bw + ix] = ((aa / count) << 24) | ((ra / count) << 16) |
+                          ((ga / count) << 8) | (ba / count);
+    }
+  }
+  for (int iy = 0; iy < bh; iy++)
+    for (int ix = 0; ix < bw; ix++)
+      XPutPixel(img, ix, iy, buf[iy * bw + ix]);
+}
 
-  // Opening bracket [ - simple rectangular shape
-  // Top horizontal line
-  XDrawLine(d, w, gc, leftX + width / 3, topY, rightX - sixthW / 2, topY);
-  // Top right curve downward
-  XDrawLine(d, w, gc, rightX - sixthW / 2, topY, rightX - sixthW / 3, topY + sixthW / 2);
-  XDrawLine(d, w, gc, rightX - sixthW / 3, topY + sixthW / 2, rightX - sixthW / 4, topY + sixthW);
-  // Right side vertical line (no middle angle)
-  XDrawLine(d, w, gc, rightX - sixthW / 4, topY + sixthW, rightX - sixthW / 4, bottomY - sixthW);
-  // Bottom right curve upward
-  XDrawLine(d, w, gc, rightX - sixthW / 4, bottomY - sixthW, rightX - sixthW / 3, bottomY - sixthW / 2);
-  XDrawLine(d, w, gc, rightX - sixthW / 3, bottomY - sixthW / 2, rightX - sixthW / 2, bottomY);
-  // Bottom horizontal line
-  XDrawLine(d, w, gc, rightX - sixthW / 2, bottomY, leftX + width / 3, bottomY);
+static void benchFill(uint32_t *pixels, size_t n, unsigned int seed)
+{
+  for (size_t i = 0; i < n; i++)
+  {
+    seed = seed * 1103515245u + 12345u;
+    pixels[i] = seed ^ (seed >> 16);
+  }
 }
 
 /**
- * draws a closing square bracket on the screen
- * x0, y0 : top point of the bracket
- * x1, y1 : bottom point of the bracket
- * */
-void drawClosingBracket(Display *d, Window w, GC gc, int x0, int y0, int x1, int y1)
-{
-  int height = abs(y1 - y0);
-  int width = abs(x1 - x0);
-  int leftX = (x0 < x1) ? x0 : x1;
-  int topY = (y0 < y1) ? y0 : y1;
-  int rightX = leftX + width;
-  int bottomY = topY + height;
-  int sixthW = width / 6;
+ * Microseconds per call of `run`, repeated for at least 100 ms
+ */
+#define BENCH_TIME(usPerCall, setup, run)                       \
+  do                                                            \
+  {                                                             \
+    int64_t benchStart = monotonicMicros(), benchNow;           \
+    long benchCalls = 0;                                        \
+    do                                                          \
+    {                                                           \
+      setup;                                                    \
+      run;                                                      \
+      benchCalls++;                                             \
+      benchNow = monotonicMicros();                             \
+    } while (benchNow - benchStart < 100000);                   \
+    (usPerCall) = (double)(benchNow - benchStart) / benchCalls; \
+  } while (0)
 
-  // Closing bracket ] - simple rectangular shape
-  // Top horizontal line
-  XDrawLine(d, w, gc, rightX - width / 3, topY, leftX + sixthW / 2, topY);
-  // Top left curve downward
-  XDrawLine(d, w, gc, leftX + sixthW / 2, topY, leftX + sixthW / 3, topY + sixthW / 2);
-  XDrawLine(d, w, gc, leftX + sixthW / 3, topY + sixthW / 2, leftX + sixthW / 4, topY + sixthW);
-  // Left side vertical line (no middle angle)
-  XDrawLine(d, w, gc, leftX + sixthW / 4, topY + sixthW, leftX + sixthW / 4, bottomY - sixthW);
-  // Bottom left curve upward
-  XDrawLine(d, w, gc, leftX + sixthW / 4, bottomY - sixthW, leftX + sixthW / 3, bottomY - sixthW / 2);
-  XDrawLine(d, w, gc, leftX + sixthW / 3, bottomY - sixthW / 2, leftX + sixthW / 2, bottomY);
-  // Bottom horizontal line
-  XDrawLine(d, w, gc, leftX + sixthW / 2, bottomY, rightX - width / 3, bottomY);
+static void benchBlur(void)
+{
+  static const int brushes[] = {18, 50, 100, 200};
+  static const int radii[] = {1, 2, 5, 10, 20};
+  int maxSide = 200;
+  uint32_t *source = malloc(sizeof(uint32_t) * maxSide * maxSide);
+  uint32_t *ref = malloc(sizeof(uint32_t) * maxSide * maxSide);
+  uint32_t *out = malloc(sizeof(uint32_t) * maxSide * maxSide);
+  unsigned long *buf = malloc(sizeof(unsigned long) * maxSide * maxSide);
+  benchFill(source, (size_t)maxSide * maxSide, 1);
+
+  // Every kernel set this CPU runs is timed in microseconds per stamp and
+  // checked against the former kernel; the speedup is the selected set's
+  printf("blur (us, * = differs from reference)\n brush radius  reference");
+  for (int k = 0; k < BLUR_KERNEL_SETS; k++)
+    if (blurKernelSets[k].supported())
+      printf(" %10s", blurKernelSets[k].name);
+  printf("  speedup (%s)\n", blurKernels()->name);
+  for (size_t b = 0; b < sizeof(brushes) / sizeof(brushes[0]); b++)
+  {
+    for (size_t r = 0; r < sizeof(radii) / sizeof(radii[0]); r++)
+    {
+      int side = brushes[b], radius = radii[r];
+      size_t n = (size_t)side * side;
+      uint32_t *scratch = blurScratch(boxBlurScratchWords(side, side));
+      XImage img = benchImage(side, side, ref);
+      double refUs, us, chosenUs = 0;
+      BENCH_TIME(refUs, memcpy(ref, source, n * 4), benchBlurReference(&img, radius, buf));
+      printf(" %5d %6d %10.1f", side, radius, refUs);
+      for (int k = 0; k < BLUR_KERNEL_SETS; k++)
+      {
+        const BlurKernels *kernels = &blurKernelSets[k];
+        if (!kernels->supported())
+          continue;
+        BENCH_TIME(us, memcpy(out, source, n * 4),
+                   boxBlur32With(kernels, (uint8_t *)out, side, side, side * 4, radius, scratch));
+        printf(" %9.1f%c", us, memcmp(ref, out, n * 4) ? '*' : ' ');
+        if (kernels == blurKernels())
+          chosenUs = us;
+      }
+      printf("  %6.1fx\n", refUs / chosenUs);
+    }
+  }
+  free(source);
+  free(ref);
+  free(out);
+  free(buf);
 }
 
-/**
- * draws a square bracket on the screen (auto-detects opening/closing based on direction)
- * x0, y0 : first point of the bracket
- * x1, y1 : second point of the bracket
- * */
-void drawBracket(Display *d, Window w, GC gc, int x0, int y0, int x1, int y1)
+static void benchGauss(void)
 {
-  // If dragging left to right, draw opening bracket
-  // If dragging right to left, draw closing bracket
-  if (x1 >= x0)
+  static const int radii[] = {2, 6, 10, 20, 30, 48};
+  int side = 200;
+  size_t n = (size_t)side * side;
+  uint32_t *source = malloc(sizeof(uint32_t) * n);
+  uint32_t *out = malloc(sizeof(uint32_t) * n);
+  uint32_t *scratch = blurScratch(boxBlurScratchWords(side, side));
+  benchFill(source, n, 1);
+
+  // The three box passes should cost the same at any radius
+  printf("gaussian blur (us, %d passes, brush %d)\n radius      time\n", BLUR_PASSES, side);
+  for (size_t r = 0; r < sizeof(radii) / sizeof(radii[0]); r++)
   {
-    drawOpeningBracket(d, w, gc, x0, y0, x1, y1);
+    double us;
+    BENCH_TIME(us, memcpy(out, source, n * 4), gaussBlur32((uint8_t *)out, side, side, side * 4, radii[r], scratch));
+    printf(" %6d %9.1f\n", radii[r], us);
   }
-  else
+  free(source);
+  free(out);
+}
+
+static void benchTiles(void)
+{
+  static const struct
+  {
+    int w, h;
+  } areas[] = {{1920, 1080}, {3840, 2160}};
+  static const struct
+  {
+    AreaFilter filter;
+    int strength;
+    const char *name;
+  } filters[] = {{FILTER_BLUR, BLUR_RADIUS, "blur"}, {FILTER_BLUR, 30, "blur"}, {FILTER_PIXELATE, PIXELATE_BLOCK, "pixelate"}};
+  size_t maxN = (size_t)3840 * 2160;
+  uint32_t *source = malloc(sizeof(uint32_t) * maxN);
+  uint32_t *ref = malloc(sizeof(uint32_t) * maxN);
+  uint32_t *out = malloc(sizeof(uint32_t) * maxN);
+  uint32_t *dst = malloc(sizeof(uint32_t) * maxN);
+  benchFill(source, maxN, 1);
+
+  // Whole-screen rectangles on the calling thread and in tiles on all cores
+  printf("rectangle (ms, %ld cores, * = differs from one piece)\n      area   filter strength  one piece      tiled\n",
+         sysconf(_SC_NPROCESSORS_ONLN));
+  for (size_t a = 0; a < sizeof(areas) / sizeof(areas[0]); a++)
   {
-    drawClosingBracket(d, w, gc, x0, y0, x1, y1);
+    int w = areas[a].w, h = areas[a].h;
+    size_t n = (size_t)w * h;
+    for (size_t f = 0; f < sizeof(filters) / sizeof(filters[0]); f++)
+    {
+      AreaFilter filter = filters[f].filter;
+      int strength = filters[f].strength;
+      uint32_t *scratch = blurScratch(filter == FILTER_PIXELATE ? pixelateScratchWords(w, strength)
+                                                                : boxBlurScratchWords(w, h));
+      double oneUs, tiledUs;
+      if (filter == FILTER_PIXELATE)
+        BENCH_TIME(oneUs, memcpy(ref, source, n * 4), pixelate32((uint8_t *)ref, w, h, w * 4, strength, scratch));
+      else
+        BENCH_TIME(oneUs, memcpy(ref, source, n * 4), gaussBlur32((uint8_t *)ref, w, h, w * 4, strength, scratch));
+      BENCH_TIME(tiledUs, memcpy(out, source, n * 4), filterTiled((uint8_t *)out, w, h, w * 4, filter, strength, BLUR_PASSES, dst));
+      printf(" %4dx%4d %8s %8d %10.1f %9.1f%c\n", w, h, filters[f].name, strength, oneUs / 1000, tiledUs / 1000,
+             memcmp(ref, out, n * 4) ? '*' : ' ');
+    }
   }
+  free(source);
+  free(ref);
+  free(out);
+  free(dst);
 }
 
-/**
- * draws a curly brace on the screen (auto-detects opening/closing based on direction)
- * x0, y0 : first point of the brace
- * x1, y1 : second point of the brace
- * */
-void drawBrace(Display *d, Window w, GC gc, int x0, int y0, int x1, int y1)
+static void benchBackground(void)
 {
-  // If dragging left to right, draw opening brace
-  // If dragging right to left, draw closing brace
-  if (x1 >= x0)
+  static const int sides[] = {50, 200, 800};
+  int width = 3840, height = 2160;
+  size_t n = (size_t)width * height;
+  uint32_t *screen = malloc(sizeof(uint32_t) * n);
+  uint32_t *out = malloc(sizeof(uint32_t) * n);
+  benchFill(screen, n, 1);
+
+  // The table is built once per run; pixelation is then timed against the
+  // same work on pixels that would have been read back
+  backgroundSums.width = width;
+  backgroundSums.height = height;
+  backgroundSums.stride = width;
+  backgroundSums.pixels = malloc(sizeof(uint32_t) * n);
+  memcpy(backgroundSums.pixels, screen, n * 4);
+  int64_t start = monotonicMicros();
+  backgroundSumsBuild(&backgroundSums);
+  printf("background sums (%dx%d built in %.1f ms; us)\n  side   filter   read back      sums\n", width, height,
+         (monotonicMicros() - start) / 1000.0);
+  for (size_t i = 0; i < sizeof(sides) / sizeof(sides[0]); i++)
   {
-    drawOpeningBrace(d, w, gc, x0, y0, x1, y1);
+    int side = sides[i];
+    XRectangle area = {1000, 500, side, side};
+    size_t an = (size_t)side * side;
+    double readUs, sumsUs;
+    uint32_t *scratch = blurScratch(pixelateScratchWords(side, PIXELATE_BLOCK));
+    BENCH_TIME(readUs, memcpy(out, screen, an * 4), pixelate32((uint8_t *)out, side, side, side * 4, PIXELATE_BLOCK, scratch));
+    BENCH_TIME(sumsUs, , backgroundPixelate32(out, area, PIXELATE_BLOCK));
+    printf(" %5d %8s %10.1f %9.1f\n", side, "pixelate", readUs, sumsUs);
   }
-  else
+  free(backgroundSums.sums);
+  backgroundSums = (BackgroundSums){0};
+  free(screen);
+  free(out);
+}
+
+static void benchPixelate(void)
+{
+  static const int brushes[] = {18, 50, 100, 200};
+  static const int blocks[] = {4, 12, 32};
+  uint32_t *source = malloc(sizeof(uint32_t) * 200 * 200);
+  uint32_t *out = malloc(sizeof(uint32_t) * 200 * 200);
+  benchFill(source, 200 * 200, 2);
+
+  printf("pixelate (us)\n brush  block    time\n");
+  for (size_t b = 0; b < sizeof(brushes) / sizeof(brushes[0]); b++)
   {
-    drawClosingBrace(d, w, gc, x0, y0, x1, y1);
+    for (size_t k = 0; k < sizeof(blocks) / sizeof(blocks[0]); k++)
+    {
+      int side = brushes[b], block = blocks[k];
+      uint32_t *sums = blurScratch(pixelateScratchWords(side, block));
+      double us;
+      BENCH_TIME(us, memcpy(out, source, (size_t)side * side * 4),
+                 pixelate32((uint8_t *)out, side, side, side * 4, block, sums));
+      printf(" %5d %6d %7.1f\n", side, block, us);
+    }
   }
+  free(source);
+  free(out);
 }
 
 /**
- * Initializes undo levels that will contain "screenshots" of the state of the undo
+ * Row converters against the XGetPixel fallback, and their throughput on
+ * a 1080p image in each layout
  */
-void initUndo(Pixmap *p, Display *d, Window w, unsigned int width, unsigned int height, int depth, int undoMax)
+static void benchPixels(void)
 {
-  for (int i = 0; i < undoMax; i++)
+  static const struct
   {
-    p[i] = XCreatePixmap(d, w, width, height, depth);
+    const char *layout;
+    int bpp, depth, byteOrder;
+    unsigned long red, green, blue;
+  } layouts[] = {
+      {"xrgb32", 32, 24, LSBFirst, 0xFF0000, 0xFF00, 0xFF},
+      {"argb32", 32, 32, LSBFirst, 0xFF0000, 0xFF00, 0xFF},
+      {"xrgb32 msb", 32, 24, MSBFirst, 0xFF0000, 0xFF00, 0xFF},
+      {"xbgr32", 32, 24, LSBFirst, 0xFF, 0xFF00, 0xFF0000},
+      {"rgb24", 24, 24, LSBFirst, 0xFF0000, 0xFF00, 0xFF},
+      {"rgb565", 16, 16, LSBFirst, 0xF800, 0x7E0, 0x1F},
+      {"rgb565 msb", 16, 16, MSBFirst, 0xF800, 0x7E0, 0x1F},
+  };
+  int w = 1920, h = 1080;
+  size_t n = (size_t)w * h;
+  uint32_t *source = malloc(n * 4);
+  uint32_t *words = malloc(n * 4);
+  uint32_t *ref = malloc(n * 4);
+  uint8_t *rgb = malloc(n * 3);
+  uint8_t *data = malloc(n * 4);
+  benchFill(source, n, 5);
+
+  printf("pixel conversion (Mpx/s, 1080p)\n %-11s %-12s %8s %8s %8s %8s\n", "layout", "rows", "toArgb", "toRgb",
+         "fromArgb", "XGetPixel");
+  for (size_t l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++)
+  {
+    XImage img = {0};
+    img.width = w;
+    img.height = h;
+    img.format = ZPixmap;
+    img.data = (char *)data;
+    img.byte_order = layouts[l].byteOrder;
+    img.bitmap_unit = 32;
+    img.bitmap_bit_order = MSBFirst;
+    img.bitmap_pad = 32;
+    img.depth = layouts[l].depth;
+    img.bits_per_pixel = layouts[l].bpp;
+    img.bytes_per_line = w * layouts[l].bpp / 8;
+    img.red_mask = layouts[l].red;
+    img.green_mask = layouts[l].green;
+    img.blue_mask = layouts[l].blue;
+    XInitImage(&img);
+    PixelFormat pf, any;
+    pixelFormatInit(&pf, &img);
+    any = pf;
+    any.toArgb = pixelsAnyToArgb;
+    any.fromArgb = pixelsAnyFromArgb;
+    any.toRgb = pixelsAnyToRgb;
+
+    // Reference pixels written and read back through Xlib
+    for (int y = 0; y < h; y++)
+      any.fromArgb(&any, &img, y, source + (size_t)y * w);
+    for (int y = 0; y < h; y++)
+      any.toArgb(&any, &img, y, ref + (size_t)y * w);
+    int ok = 1;
+    for (int y = 0; y < h && ok; y++)
+    {
+      pf.toArgb(&pf, &img, y, words + (size_t)y * w);
+      pf.toRgb(&pf, &img, y, rgb + (size_t)y * w * 3);
+      for (int x = 0; x < w && ok; x++)
+      {
+        uint32_t c = ref[(size_t)y * w + x];
+        const uint8_t *t = rgb + ((size_t)y * w + x) * 3;
+        ok = words[(size_t)y * w + x] == c && t[0] == (uint8_t)(c >> 16) && t[1] == (uint8_t)(c >> 8) &&
+             t[2] == (uint8_t)c;
+      }
+    }
+    for (int y = 0; y < h; y++)
+      pf.fromArgb(&pf, &img, y, ref + (size_t)y * w);
+    for (int y = 0; y < h && ok; y++)
+    {
+      any.toArgb(&any, &img, y, words);
+      ok = memcmp(words, ref + (size_t)y * w, (size_t)w * 4) == 0;
+    }
+
+    double toArgbUs, toRgbUs, fromArgbUs, anyUs;
+    BENCH_TIME(toArgbUs, , for (int y = 0; y < h; y++) pf.toArgb(&pf, &img, y, words + (size_t)y * w));
+    BENCH_TIME(toRgbUs, , for (int y = 0; y < h; y++) pf.toRgb(&pf, &img, y, rgb + (size_t)y * w * 3));
+    BENCH_TIME(fromArgbUs, , for (int y = 0; y < h; y++) pf.fromArgb(&pf, &img, y, ref + (size_t)y * w));
+    BENCH_TIME(anyUs, , for (int y = 0; y < h; y++) any.toRgb(&any, &img, y, rgb + (size_t)y * w * 3));
+    printf(" %-11s %-12s %8.0f %8.0f %8.0f %8.0f%s\n", layouts[l].layout, pf.name, n / toArgbUs, n / toRgbUs,
+           n / fromArgbUs, n / anyUs, ok ? "" : "  MISMATCH");
   }
+  free(source);
+  free(words);
+  free(ref);
+  free(rgb);
+  free(data);
 }
 
-void bye(Display *d, Window w, int color_index, char shape, int thickness, int font_size, int dashed)
+/**
+ * Screenshot-like RGB: flat panels with rows of glyph-sized specks
+ */
+static void benchScreenshot(unsigned char *rgb, int w, int h)
 {
-  save_config(color_index, shape, thickness, font_size, dashed);
-  XUndefineCursor(d, w);
-  XCloseDisplay(d);
-  exit(0);
+  unsigned int seed = 7;
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++)
+    {
+      unsigned char *p = rgb + ((size_t)y * w + x) * 3;
+      int panel = (x / 480 + y / 270) % 3;
+      unsigned char base = panel == 0 ? 0xF4 : panel == 1 ? 0x2B : 0xD0;
+      seed = seed * 1103515245 + 12345;
+      int text = (y % 18) > 4 && (y % 18) < 15 && (x % 400) < 300 && (seed >> 16) % 3 == 0;
+      p[0] = text ? 0x20 : base;
+      p[1] = text ? 0x20 : base + (panel == 2 ? 8 : 0);
+      p[2] = text ? 0x30 : base + (panel == 1 ? 16 : 0);
+    }
 }
 
 /**
- * Create a fontset (helvetica, medium, roman) at the requested pixel size.
- * Caller owns the result and must XFreeFontSet it.
+ * The strip-parallel PNG encoder against stb's, which deflates on one core.
+ * At least two strips even on one core, so the joined stream is always
+ * timed and checked.
  */
-XFontSet createTextFontSet(Display *d, int size)
+static void benchPng(void)
 {
-  char pattern[256];
-  snprintf(pattern, sizeof(pattern),
-           "-*-helvetica-medium-r-*-*-%d-*-*-*-*-*-*-*,-*-*-medium-r-*-*-%d-*-*-*-*-*-*-*",
-           size, size);
-  char **missing_list;
-  int missing_count;
-  char *default_string;
-  XFontSet fs = XCreateFontSet(d, pattern, &missing_list, &missing_count, &default_string);
-  if (missing_count > 0)
-    XFreeStringList(missing_list);
-  return fs;
+  static const int sizes[][2] = {{1920, 1080}, {3840, 2160}, {7680, 4320}};
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int strips = cores < 2 ? 2 : cores;
+  printf("png encode (ms, %ld cores, %d strips)\n %9s %9s %9s %9s %9s\n", cores, strips, "size", "stb", "strips",
+         "stb KiB", "strips KiB");
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+  {
+    int w = sizes[i][0], h = sizes[i][1];
+    unsigned char *rgb = malloc((size_t)w * h * 3);
+    benchScreenshot(rgb, w, h);
+    int stbLen = 0, stripLen = 0;
+    unsigned char *png = NULL;
+    double stbUs, stripUs;
+    BENCH_TIME(stbUs, free(png), png = stbi_write_png_to_mem(rgb, w * 3, w, h, 3, &stbLen));
+    free(png);
+    png = NULL;
+    BENCH_TIME(stripUs, free(png), png = pngEncode(rgb, w * 3, w, h, 3, strips, &stripLen));
+    int bw, bh, bn;
+    unsigned char *back = stbi_load_from_memory(png, stripLen, &bw, &bh, &bn, 3);
+    int ok = back && bw == w && bh == h && memcmp(back, rgb, (size_t)w * h * 3) == 0;
+    char size[16];
+    snprintf(size, sizeof(size), "%dp", h);
+    printf(" %9s %9.0f %9.0f %9d %9d%s\n", size, stbUs / 1000, stripUs / 1000, stbLen / 1024, stripLen / 1024,
+           ok ? "" : "  MISMATCH");
+    stbi_image_free(back);
+    free(png);
+    free(rgb);
+  }
+}
+
+static void benchCount(void *context, void *data, int size)
+{
+  (void)data;
+  *(long *)context += size;
 }
 
 /**
- * Draw text with a cursor at the end
+ * Encode time and size of a 1080p capture in every output format, and the
+ * QOI round trip
  */
-void drawTextWithCursor(Display *d, Window w, GC gc, XFontSet fontset, int x, int y, const char *text, int cursor_height)
+static void benchFormats(void)
 {
-  int text_width = 0;
-  if (fontset && text && strlen(text) > 0)
+  int w = 1920, h = 1080;
+  unsigned char *rgb = malloc((size_t)w * h * 3);
+  benchScreenshot(rgb, w, h);
+  printf("formats (1080p)\n %6s %9s %9s\n", "format", "ms", "KiB");
+  for (int f = 0; f < IMAGE_FORMATS; f++)
   {
-    XRectangle ink, logical;
-    XmbTextExtents(fontset, text, strlen(text), &ink, &logical);
-    text_width = logical.width;
-    XmbDrawString(d, w, fontset, gc, x, y, text, strlen(text));
+    long bytes = 0;
+    double us;
+    unsigned char *out = NULL;
+    int len = 0;
+    switch (f)
+    {
+    case IMAGE_PNG:
+      BENCH_TIME(us, free(out), out = pngEncode(rgb, w * 3, w, h, 3, 0, &len));
+      break;
+    case IMAGE_QOI:
+      BENCH_TIME(us, free(out), out = qoiEncode(rgb, w * 3, w, h, 3, &len));
+      break;
+    case IMAGE_JPG:
+      BENCH_TIME(us, bytes = 0, stbi_write_jpg_to_func(benchCount, &bytes, w, h, 3, rgb, JPEG_QUALITY));
+      break;
+    case IMAGE_BMP:
+      BENCH_TIME(us, bytes = 0, stbi_write_bmp_to_func(benchCount, &bytes, w, h, 3, rgb));
+      break;
+    case IMAGE_TGA:
+      BENCH_TIME(us, bytes = 0, stbi_write_tga_to_func(benchCount, &bytes, w, h, 3, rgb));
+      break;
+    }
+    printf(" %6s %9.1f %9ld\n", imageFormats[f].name, us / 1000, (out ? len : bytes) / 1024);
+    if (f == IMAGE_QOI)
+    {
+      int qw = 0, qh = 0;
+      unsigned char *back = NULL;
+      BENCH_TIME(us, free(back), back = qoiDecode(out, len, &qw, &qh));
+      int ok = back && qw == w && qh == h;
+      for (size_t i = 0; ok && i < (size_t)w * h; i++)
+        ok = !memcmp(back + i * 4, rgb + i * 3, 3) && back[i * 4 + 3] == 255;
+      printf(" %6s %9.1f %9s%s\n", "unqoi", us / 1000, "", ok ? "" : "  MISMATCH");
+      free(back);
+    }
+    free(out);
   }
-  // Draw cursor (vertical line)
-  XDrawLine(d, w, gc, x + text_width + 2, y - cursor_height + 4, x + text_width + 2, y + 4);
+  free(rgb);
 }
 
 /**
- * Blur a circular area around (cx, cy) on the window using a box blur.
- * brushSize: diameter of the blur brush
- * radius: blur kernel radius (higher = stronger blur)
+ * Code editor capture: rows of glyph cells in syntax colours on a dark
+ * background
  */
-void blurArea(Display *d, Window w, GC gc, int cx, int cy,
-              int brushSize, int radius, unsigned int winW, unsigned int winH)
+static void benchCorpusCode(unsigned char *rgb, int w, int h)
 {
-  int half = brushSize / 2;
-  int x0 = cx - half;
-  int y0 = cy - half;
-  int x1 = x0 + brushSize;
-  int y1 = y0 + brushSize;
-
-  // Clamp to window bounds
-  if (x0 < 0)
-    x0 = 0;
-  if (y0 < 0)
-    y0 = 0;
-  if (x1 > (int)winW)
-    x1 = (int)winW;
-  if (y1 > (int)winH)
-    y1 = (int)winH;
-
-  int bw = x1 - x0;
-  int bh = y1 - y0;
-  if (bw <= 0 || bh <= 0)
-    return;
-
-  XImage *img = XGetImage(d, w, x0, y0, bw, bh, AllPlanes, ZPixmap);
-  if (!img)
-    return;
-
-  unsigned long *buf = malloc(bw * bh * sizeof(unsigned long));
-  if (!buf)
+  static const uint32_t colours[] = {0xD4D4D4, 0x569CD6, 0xCE9178, 0x6A9955, 0xC586C0};
+  unsigned int seed = 11;
+  for (size_t i = 0; i < (size_t)w * h; i++)
+    rgb[i * 3] = rgb[i * 3 + 1] = rgb[i * 3 + 2] = 0x1E;
+  for (int line = 0; line * 18 + 14 < h; line++)
   {
-    XDestroyImage(img);
-    return;
+    seed = seed * 1103515245 + 12345;
+    int indent = (seed >> 16) % 5 * 2, length = (seed >> 8) % 90;
+    for (int cell = indent; cell < indent + length && (cell + 1) * 9 < w; cell++)
+    {
+      seed = seed * 1103515245 + 12345;
+      uint32_t colour = colours[(seed >> 16) % 5];
+      if ((seed >> 12) % 7 == 0)
+        continue; // a space
+      for (int gy = 0; gy < 12; gy++)
+        for (int gx = 0; gx < 7; gx++)
+        {
+          seed = seed * 1103515245 + 12345;
+          if ((seed >> 16) % 3)
+            continue;
+          unsigned char *p = rgb + ((size_t)(line * 18 + 3 + gy) * w + cell * 9 + gx) * 3;
+          p[0] = colour >> 16, p[1] = colour >> 8, p[2] = colour;
+        }
+    }
   }
+}
 
-  // Box blur
-  for (int iy = 0; iy < bh; iy++)
-  {
-    for (int ix = 0; ix < bw; ix++)
+/**
+ * Photo-like capture: smooth gradients with sensor noise
+ */
+static void benchCorpusPhoto(unsigned char *rgb, int w, int h)
+{
+  unsigned int seed = 13;
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++)
     {
-      unsigned long ra = 0, ga = 0, ba = 0, aa = 0;
-      int count = 0;
-      for (int dy = -radius; dy <= radius; dy++)
+      unsigned char *p = rgb + ((size_t)y * w + x) * 3;
+      for (int c = 0; c < 3; c++)
       {
-        for (int dx = -radius; dx <= radius; dx++)
-        {
-          int sx = ix + dx, sy = iy + dy;
-          if (sx >= 0 && sx < bw && sy >= 0 && sy < bh)
-          {
-            unsigned long pixel = XGetPixel(img, sx, sy);
-            aa += (pixel >> 24) & 0xFF;
-            ra += (pixel >> 16) & 0xFF;
-            ga += (pixel >> 8) & 0xFF;
-            ba += pixel & 0xFF;
-            count++;
-          }
-        }
+        seed = seed * 1103515245 + 12345;
+        double v = 128 + 90 * sin(x / (60.0 + 25 * c)) * cos(y / (80.0 - 15 * c)) + (int)((seed >> 16) % 13) - 6;
+        p[c] = v < 0 ? 0 : v > 255 ? 255 : (unsigned char)v;
       }
-      buf[iy * bw + ix] = ((aa / count) << 24) | ((ra / count) << 16) |
-                          ((ga / count) << 8) | (ba / count);
     }
-  }
+}
 
-  for (int iy = 0; iy < bh; iy++)
-    for (int ix = 0; ix < bw; ix++)
-      XPutPixel(img, ix, iy, buf[iy * bw + ix]);
+/**
+ * PNG size, encode and decode time of one image for a compression level
+ * and filter
+ */
+static void benchCodecRow(const char *image, const unsigned char *rgb, int w, int h, int level, int filter)
+{
+  stbi_write_png_compression_level = level;
+  stbi_write_force_png_filter = filter;
+  int len = 0;
+  unsigned char *png = NULL;
+  double encodeUs, decodeUs;
+  BENCH_TIME(encodeUs, free(png), png = pngEncode(rgb, w * 3, w, h, 3, 0, &len));
+  unsigned char *back = NULL;
+  int bw, bh, bn;
+  BENCH_TIME(decodeUs, stbi_image_free(back), back = stbi_load_from_memory(png, len, &bw, &bh, &bn, 3));
+  int ok = back && bw == w && bh == h && memcmp(back, rgb, (size_t)w * h * 3) == 0;
+  printf(" %-16.16s %5d %-7s %9ld %9.1f %9.1f%s\n", image, level, filter < 0 ? "auto" : pngFilterNames[filter],
+         (long)len / 1024, encodeUs / 1000, decodeUs / 1000, ok ? "" : "  MISMATCH");
+  stbi_image_free(back);
+  free(png);
+}
 
-  XPutImage(d, w, gc, img, 0, 0, x0, y0, bw, bh);
-  XDestroyImage(img);
-  free(buf);
+/**
+ * Every compression level and filter on one image
+ */
+static void benchCodecImage(const char *image, const unsigned char *rgb, int w, int h)
+{
+  static const int levels[] = {5, 8, 16, 32};
+  for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++)
+    benchCodecRow(image, rgb, w, h, levels[l], -1);
+  for (int f = 0; f < 5; f++)
+    benchCodecRow(image, rgb, w, h, PNG_COMPRESSION_LEVEL, f);
 }
 
-void setCursor(Display *d, Window w, Cursor *cursor, int cursorId)
+/**
+ * PNG settings over a corpus of captures: generated code, UI and photo
+ * images, plus every image in $ZPEN_BENCH_CORPUS
+ */
+static void benchCodec(void)
 {
-  *cursor = XCreateFontCursor(d, cursorId);
-  XDefineCursor(d, w, *cursor);
-  XSync(d, False);
+  int w = 1280, h = 720;
+  unsigned char *rgb = malloc((size_t)w * h * 3);
+  printf("png codec (KiB, ms)\n %-16s %5s %-7s %9s %9s %9s\n", "image", "level", "filter", "size", "encode", "decode");
+  benchCorpusCode(rgb, w, h);
+  benchCodecImage("code", rgb, w, h);
+  benchScreenshot(rgb, w, h);
+  benchCodecImage("ui", rgb, w, h);
+  benchCorpusPhoto(rgb, w, h);
+  benchCodecImage("photo", rgb, w, h);
+  free(rgb);
+
+  const char *corpus = getenv("ZPEN_BENCH_CORPUS");
+  DIR *dir = corpus ? opendir(corpus) : NULL;
+  for (struct dirent *entry; dir && (entry = readdir(dir));)
+  {
+    char path[1024];
+    int iw, ih;
+    if (entry->d_name[0] == '.')
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", corpus, entry->d_name);
+    unsigned char *rgba = loadImage(path, &iw, &ih);
+    if (!rgba)
+      continue;
+    for (size_t i = 0; i < (size_t)iw * ih; i++)
+      memmove(rgba + i * 3, rgba + i * 4, 3);
+    benchCodecImage(entry->d_name, rgba, iw, ih);
+    free(rgba);
+  }
+  if (dir)
+    closedir(dir);
+  stbi_write_png_compression_level = PNG_COMPRESSION_LEVEL;
+  stbi_write_force_png_filter = -1;
 }
 
-void setShapeCursor(Display *d, Window w, Cursor *cursor, char shape)
+/**
+ * Benchmarks by name; `bench_zpen NAME...` runs only those
+ */
+static const struct
 {
-  switch (shape)
+  const char *name;
+  void (*run)(void);
+} benches[] = {
+    {"pixels", benchPixels}, {"png", benchPng},         {"formats", benchFormats},
+    {"blur", benchBlur},     {"gauss", benchGauss},     {"tiles", benchTiles},
+    {"background", benchBackground}, {"pixelate", benchPixelate}, {"codec", benchCodec},
+};
+
+int main(int argc, char **argv)
+{
+  for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
   {
-  case 'c':
-    setCursor(d, w, cursor, XC_dot);
-    break;
-  case 'p':
-    setCursor(d, w, cursor, XC_pencil);
-    break;
-  case 'r':
-    setCursor(d, w, cursor, XC_sizing);
-    break;
-  case 'a':
-    setCursor(d, w, cursor, XC_ur_angle);
-    break;
-  case 'l':
-    setCursor(d, w, cursor, XC_tcross);
-    break;
-  case '{':
-    setCursor(d, w, cursor, XC_left_side);
-    break;
-  case '[':
-    setCursor(d, w, cursor, XC_left_side);
-    break;
-  case 'b':
-    setCursor(d, w, cursor, XC_spraycan);
-    break;
+    int wanted = argc < 2;
+    for (int a = 1; a < argc; a++)
+      wanted |= strcmp(argv[a], benches[i].name) == 0;
+    if (wanted)
+      benches[i].run();
   }
+  return 0;
 }
+#define main zpen_main
+#endif
 
-////////////////////////
-// MAIN
-////////////////////////
 int main()
 {
   // Set up locale for international text input
   setlocale(LC_ALL, "");
 
   // Set up signal handlers
+  quitFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
   signal(SIGINT, signal_handler);
   signal(SIGTERM, signal_handler);
 
@@ -1357,7 +6245,6 @@ int main()
   Cursor cursor;
   GC gcPreDraw;
   XPoint rect[2];
-  XPoint pointPreDraw;
 
   char shape = 'a';
   char prv_shape = shape;
@@ -1366,17 +6253,25 @@ int main()
   int thickness = THICKNESS;
   int font_size = TEXT_FONT_SIZE;
   int dashed = 0;
-  load_config(&color_index, &shape, &thickness, &font_size, &dashed);
+  Settings settings = {REMOTE_AUTO, PIXELATE_BLOCK, BLUR_BACKEND_AUTO, BLUR_RADIUS, BLUR_BRUSH, {{0}}, 0, 0,
+                       IMAGE_PNG, IMAGE_PNG, JPEG_QUALITY, PNG_COMPRESSION_LEVEL, -1};
+  load_config(&color_index, &shape, &thickness, &font_size, &dashed, &settings);
+  // Read by every PNG encoder, including the screenshot thread
+  stbi_write_png_compression_level = settings.pngCompressionLevel;
+  stbi_write_force_png_filter = settings.pngFilter;
+  hasTesseract();
   prv_shape = shape;
   unsigned long color = color_list[color_index];
   char dash_pattern[] = {8, 6}; // Dash pattern for dashed lines (8 pixels on, 6 pixels off)
   int drawing = 0;
   Path path = {0};
   path.count = 0;
-  pointPreDraw.x = -1;
-  pointPreDraw.y = -1;
   int p = 0;
   int stepCnt = 1;
+  // Hold-to-snap: when the pen rests within SNAP_HOLD_SLOP pixels of
+  // holdAnchor since holdStart, the stroke is replaced by a fitted primitive.
+  XPoint holdAnchor = {0, 0};
+  Time holdStart = 0;
 
   d = XOpenDisplay(NULL);
   if (d == NULL)
@@ -1388,10 +6283,16 @@ int main()
   unsigned int height = DisplayHeight(d, screen);
   unsigned int width = DisplayWidth(d, screen);
   Window root = DefaultRootWindow(d);
+  trafficInit(d);
+
+  // Over a network, pixel work stays on the server: the desktop is captured
+  // and blurred with XRender instead of being read back, and frames are paced
+  // slower so more motion is batched into each flush
+  int remote = displayIsRemote(d, settings.remote);
 
   // Capture initial screenshot before creating window to freeze the desktop
-  XImage *bgImage = XGetImage(d, root, 0, 0, width, height, AllPlanes, ZPixmap);
-  if (!bgImage)
+  XImage *bgImage = remote ? NULL : XGetImage(d, root, 0, 0, width, height, AllPlanes, ZPixmap);
+  if (!bgImage && !remote)
   {
     fprintf(stderr, "Failed to capture background screenshot\n");
     XCloseDisplay(d);
@@ -1436,36 +6337,51 @@ int main()
   XSetLineAttributes(d, gc, thickness, dashed ? LineOnOffDash : LineSolid, CapRound, JoinMiter);
 
   XGCValues gcValuesPreDraw;
-  gcValuesPreDraw.function = GXxor;
   gcValuesPreDraw.foreground = guideColor(color);
-  gcPreDraw = XCreateGC(d, w, GCForeground + GCFunction, &gcValuesPreDraw);
+  gcValuesPreDraw.background = 0xFF000000;
+  gcPreDraw = XCreateGC(d, w, GCForeground | GCBackground, &gcValuesPreDraw);
   XSetLineAttributes(d, gcPreDraw, thickness > 2 ? thickness - 2 : 1, LineDoubleDash, CapRound, JoinMiter);
 
   // Prepare background pixmap before mapping so the window appears with correct content instantly
-  Pixmap bgPixmap = XCreatePixmap(d, w, width, height, vinfo.depth);
+  Pixmap bgPixmap = None;
+  if (!remote)
   {
-    GC bgGC = XCreateGC(d, bgPixmap, 0, NULL);
     // Convert 24-bit root window capture to 32-bit (add alpha=0xFF) to match our window depth
     XImage *bg32 = XCreateImage(d, vinfo.visual, 32, ZPixmap, 0, NULL,
                                 width, height, 32, 0);
-    bg32->data = malloc(bg32->bytes_per_line * height);
-    for (unsigned int y = 0; y < height; y++)
+    if (bg32)
+      bg32->data = malloc(bg32->bytes_per_line * height);
+    uint32_t *row = malloc((size_t)width * 4);
+    if (bg32 && bg32->data && row)
     {
-      for (unsigned int x = 0; x < width; x++)
-      {
-        unsigned long pixel = XGetPixel(bgImage, x, y);
-        XPutPixel(bg32, x, y, pixel | 0xFF000000);
-      }
+      bgPixmap = XCreatePixmap(d, w, width, height, vinfo.depth);
+      GC bgGC = XCreateGC(d, bgPixmap, 0, NULL);
+      imageConvert(bg32, bgImage, row);
+      XPutImage(d, bgPixmap, bgGC, bg32, 0, 0, 0, 0, width, height);
+      backgroundSumsKeep(bg32);
+      XFreeGC(d, bgGC);
     }
-    XPutImage(d, bgPixmap, bgGC, bg32, 0, 0, 0, 0, width, height);
-    XDestroyImage(bg32);
-    XFreeGC(d, bgGC);
+    else
+      fprintf(stderr, "zpen: out of memory converting the background, capturing it on the server\n");
+    free(row);
+    if (bg32)
+      XDestroyImage(bg32);
+    XDestroyImage(bgImage);
   }
-  XDestroyImage(bgImage);
+  // The root is still unobscured: our window is not mapped yet
+  if (!bgPixmap)
+    bgPixmap = captureRootRender(d, root, vinfo.visual, vinfo.depth, width, height);
 
   // Set background pixmap so window appears with the desktop screenshot from the first frame
   XSetWindowBackgroundPixmap(d, w, bgPixmap);
-  XFreePixmap(d, bgPixmap);
+
+  // The window is composited from layers (damage, Expose): annotations are
+  // committed to their own layer, so undo snapshots hold only annotations
+  // and screenshots read the scene without any UI.
+  Layers layers;
+  layersInit(d, w, vinfo.visual, vinfo.depth, bgPixmap, width, height, &layers);
+  DamageList damage = {0};
+  BlurBackend blurBackend = blurBackendSelect(d, w, settings.blurBackend, remote);
 
   // Map window - it will display with the background pixmap immediately (no blink)
   XMapWindow(d, w);
@@ -1484,6 +6400,32 @@ int main()
   // Set input focus to our window
   XSetInputFocus(d, w, RevertToParent, CurrentTime);
   XRaiseWindow(d, w);
+  latencyInit(d, w, attrs.event_mask);
+
+#ifdef HAVE_XI2
+  // Touchscreens: XI 2.2 delivers every finger as its own touch sequence.
+  // Selecting touch events also stops the server from emulating pointer
+  // events for them, so the core ButtonPress path only sees the mouse.
+  int xiOpcode = -1;
+  {
+    int xiEvent, xiError, major = 2, minor = 2;
+    if (XQueryExtension(d, "XInputExtension", &xiOpcode, &xiEvent, &xiError) &&
+        XIQueryVersion(d, &major, &minor) == Success &&
+        (major > 2 || (major == 2 && minor >= 2)))
+    {
+      unsigned char bits[XIMaskLen(XI_LASTEVENT)] = {0};
+      XIEventMask mask = {XIAllMasterDevices, sizeof(bits), bits};
+      XISetMask(bits, XI_TouchBegin);
+      XISetMask(bits, XI_TouchUpdate);
+      XISetMask(bits, XI_TouchEnd);
+      XISelectEvents(d, w, &mask, 1);
+    }
+    else
+    {
+      xiOpcode = -1;
+    }
+  }
+#endif
 
   // Set up XIM for international text input (composed characters like ç, á, ã)
   XIM xim = NULL;
@@ -1515,14 +6457,15 @@ int main()
   initUndo(undoStack, d, w, width, height, vinfo.depth, UNDO_MAX);
   initUndo(redoStack, d, w, width, height, vinfo.depth, UNDO_MAX);
 
-  // Draw color palette before initializing undo stack so it's included in saved states
-  drawColorPalette(d, w, gc, width, height, color_list, color_index, thickness, dashed);
-  XSync(d, False); // Ensure palette is drawn before copying to undo stack
+  // The palette lives on the UI layer, outside of undo and screenshots
+  addRepaint(&damage, drawColorPalette(d, layers.ui, gc, width, height, color_list, color_index, thickness, dashed),
+             width, height);
+  composeDamage(d, &layers, &damage);
 
-  // Initialize undo stack with background (including color palette)
+  // Initialize undo stack with the empty annotation layer
   for (int i = 0; i < UNDO_MAX; i++)
   {
-    XCopyArea(d, w, undoStack[i], gc, 0, 0, width, height, 0, 0);
+    XCopyArea(d, layers.annotations, undoStack[i], gc, 0, 0, width, height, 0, 0);
   }
   XFlush(d);
 
@@ -1535,6 +6478,27 @@ int main()
   int x_text = 0;
   int y_text = 0;
   Pixmap textPixMap = XCreatePixmap(d, w, width, height, vinfo.depth);
+  XRectangle textCursor = {0, 0, 0, 0}; // cursor drawn on the UI layer
+
+  // Rubber-band preview: previews are composed over the scene with the UI
+  // layer on top and shown on the window only; previewBox is the area the
+  // preview currently covers.
+  Presenter presenter;
+  presenterInit(d, w, &presenter);
+  PreviewLayer preview = {0};
+  preview.depth = vinfo.depth;
+  preview.presenter = &presenter;
+  preview.format = XRenderFindVisualFormat(d, vinfo.visual);
+  preview.overlay = layers.uiPic;
+  XRectangle previewBox = {0, 0, 0, 0};
+
+#ifdef HAVE_XI2
+  // Concurrent touch strokes. Each finished touch is committed to the
+  // annotation layer with its own undo entry in the order the touches end;
+  // a blur session shares one entry snapshotted when its first finger lands.
+  TouchStroke touches[MAX_TOUCHES] = {0};
+  int activeTouches = 0;
+#endif
 
   enum
   {
@@ -1543,9 +6507,144 @@ int main()
   };
   int key_mods = 0;
 
+  // Frame pacing: events are drained as they arrive but drawing caused by
+  // motion is deferred to a timer running at the monitor refresh rate, so
+  // render and flush cadence follows the display instead of the input rate.
+  // The timer only runs while there is something to present.
+  FrameInput frame = {0};
+  frame.pointer.x = -1;
+  int xfd = ConnectionNumber(d);
+  int frameTimer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  int frameRate = displayRefreshRate(d, root);
+  if (remote && frameRate > REMOTE_FRAME_RATE)
+    frameRate = REMOTE_FRAME_RATE;
+  long frameNs = 1000000000L / frameRate;
+  int timerArmed = 0;
+
   // Main event loop
   while (1)
   {
+    if (quitSignal)
+    {
+      printf("Caught signal %d, exiting...\n", (int)quitSignal);
+      bye(d, w, color_index, shape, thickness, font_size, dashed, &settings);
+    }
+    if (!XPending(d))
+    {
+      if (frame.pending && !timerArmed && frameTimer != -1)
+      {
+        // First tick right away so input after idle is not delayed
+        struct itimerspec its = {{0, frameNs}, {0, 1}};
+        timerfd_settime(frameTimer, 0, &its, NULL);
+        timerArmed = 1;
+      }
+      // Text redactions wait for drags and text input to end, so their
+      // undo step does not split another one
+      for (ScreenshotJob *job; p == 0 && !drawing && !t_text && (job = redactionTake());)
+      {
+        layersRevealAnnotations(&layers, &damage, width, height);
+        // The scene must be current before it is read
+        composeDamagePresented(d, &layers, &damage, &presenter, &preview);
+        XCopyArea(d, layers.annotations, undoStack[undoLevel], gc, 0, 0, width, height, 0, 0);
+        XRectangle area = redactOcrApply(d, &layers, gc, &settings, blurBackend, job, width, height);
+        // Nothing matched or OCR failed: no undo step for an unchanged layer
+        if (area.width)
+        {
+          addDamage(&damage, area, width, height);
+          undoLevel = (undoLevel >= UNDO_MAX - 1) ? 0 : undoLevel + 1;
+          maxUndo = (maxUndo >= UNDO_MAX) ? UNDO_MAX : maxUndo + 1;
+          maxRedo = 0;
+          redoLevel = 0;
+        }
+        addRepaint(&damage, drawSavingIndicator(d, layers.ui, gc, width, height, screenshotsPending(),
+                                                redactionsPending()),
+                   width, height);
+      }
+      composeDamagePresented(d, &layers, &damage, &presenter, &preview);
+      XFlush(d);
+      // Motion still waiting for its frame is resolved after that frame
+      if (!frame.pending)
+        latencyFlushed(&presenter);
+      struct pollfd fds[4] = {{xfd, POLLIN, 0}, {timerArmed ? frameTimer : -1, POLLIN, 0}, {encoder.done, POLLIN, 0},
+                              {quitFd, POLLIN, 0}};
+      if (poll(fds, 4, frameTimer == -1 && frame.pending ? 1000 / FRAME_RATE_DEFAULT : -1) < 0 &&
+          errno != EINTR)
+      {
+        fprintf(stderr, "poll failed: %s\n", strerror(errno));
+        bye(d, w, color_index, shape, thickness, font_size, dashed, &settings);
+      }
+      if (fds[2].revents & POLLIN)
+        addRepaint(&damage, drawSavingIndicator(d, layers.ui, gc, width, height, screenshotsPending(),
+                                                redactionsPending()),
+                   width, height);
+      int tick = (frameTimer == -1) ? !(fds[0].revents & POLLIN) : 0;
+      if (timerArmed && (fds[1].revents & POLLIN))
+      {
+        uint64_t expirations;
+        tick = read(frameTimer, &expirations, sizeof(expirations)) == sizeof(expirations);
+      }
+      if (!tick)
+        continue;
+      if (!frame.pending)
+      {
+        struct itimerspec off = {{0, 0}, {0, 0}};
+        timerfd_settime(frameTimer, 0, &off, NULL);
+        timerArmed = 0;
+        continue;
+      }
+
+      // Render everything accumulated since the previous frame
+      if (drawing && (shape == 'p' || shape == 'a') && frame.pathDrawn < path.count)
+      {
+        presentWait(d, &presenter, &preview);
+        drawPathSegments(d, w, gcPreDraw, &path, frame.pathDrawn ? frame.pathDrawn - 1 : 0);
+        frame.pathDrawn = path.count;
+      }
+      addDamage(&damage, flushBrushStamps(d, &layers, gc, &settings, blurBackend, shape, &frame.brushStamps, width, height), width, height);
+      if (frame.pointer.x >= 0 && p > 0)
+      {
+        showShapePreview(d, w, gc, gcPreDraw, &preview, layers.scene, &previewBox,
+                         shape, roundedRect && !(shape == 'r' && f_screenshot), rect[0].x, rect[0].y,
+                         frame.pointer.x, frame.pointer.y, thickness, width, height);
+      }
+      frame.pointer.x = -1;
+#ifdef HAVE_XI2
+      for (int i = 0; i < MAX_TOUCHES; i++)
+      {
+        TouchStroke *t = &touches[i];
+        if (!t->active || !t->dirty)
+          continue;
+        t->dirty = 0;
+        if (shape == 'p')
+        {
+          presentWait(d, &presenter, &preview);
+          drawPathSegments(d, w, gcPreDraw, &t->path, t->drawn ? t->drawn - 1 : 0);
+          t->drawn = t->path.count;
+          continue;
+        }
+        // Recompose this touch's damage from the committed image and every
+        // preview that may overlap it
+        XRectangle next = unionRect(shapeBounds(shape, t->start.x, t->start.y, t->last.x, t->last.y, thickness),
+                                    (XRectangle){0, 0, 0, 0}, width, height);
+        XRectangle area = unionRect(t->box, next, width, height);
+        t->box = next;
+        if (!area.width)
+          continue;
+        Pixmap scratch = previewPrepare(d, w, gc, &preview, layers.scene, area);
+        for (int j = 0; j < MAX_TOUCHES; j++)
+        {
+          TouchStroke *o = &touches[j];
+          if (o->active && o->last.x >= 0)
+            drawShape(d, scratch, gcPreDraw, shape, roundedRect, o->start.x - area.x,
+                      o->start.y - area.y, o->last.x - area.x, o->last.y - area.y);
+        }
+        previewPresent(d, w, gc, &preview, area);
+      }
+#endif
+      frame.pending = 0;
+      continue;
+    }
+
     XNextEvent(d, &e);
 
     // Let XIM process the event for dead key composition (é, á, ã, etc.)
@@ -1562,6 +6661,10 @@ int main()
     switch (e.type)
     {
     case ButtonPress:
+      trafficMark(d, trafficTool(shape, shape == 'a' && (e.xbutton.state & ShiftMask), f_screenshot));
+      // Screenshots may leave the annotations out; anything else draws
+      if (!f_screenshot || f_screenshot == 5)
+        layersRevealAnnotations(&layers, &damage, width, height);
       rect[p].x = e.xbutton.x;
       rect[p].y = e.xbutton.y;
       p++;
@@ -1570,21 +6673,39 @@ int main()
         drawing = 1;
         path.count = 0;
         addPoint(&path, e.xbutton.x, e.xbutton.y);
-        XCopyArea(d, w, undoStack[undoLevel], gc, 0, 0, width, height, 0, 0);
+        holdAnchor.x = e.xbutton.x;
+        holdAnchor.y = e.xbutton.y;
+        holdStart = e.xbutton.time;
+        frame.pathDrawn = 1;
+        XCopyArea(d, layers.annotations, undoStack[undoLevel], gc, 0, 0, width, height, 0, 0);
       }
-      else if (shape == 'b')
+      else if (shape == 'b' || shape == 'x')
       {
         drawing = 1;
-        XCopyArea(d, w, undoStack[undoLevel], gc, 0, 0, width, height, 0, 0);
-        blurArea(d, w, gc, e.xbutton.x, e.xbutton.y, BLUR_BRUSH, BLUR_RADIUS, width, height);
-        XFlush(d);
+        XCopyArea(d, layers.annotations, undoStack[undoLevel], gc, 0, 0, width, height, 0, 0);
+        // The scene must be current before it is read
+        composeDamagePresented(d, &layers, &damage, &presenter, &preview);
+        addDamage(&damage, brushStamp(d, &layers, gc, &settings, blurBackend, shape, e.xbutton.x, e.xbutton.y, width, height),
+                  width, height);
+        frame.brushLast = (Point){e.xbutton.x, e.xbutton.y};
+      }
+      else
+      {
+        // Drag tools: previews are composed over the scene until release
+        XCopyArea(d, layers.annotations, undoStack[undoLevel], gc, 0, 0, width, height, 0, 0);
+        previewBox.width = previewBox.height = 0;
+        frame.pointer.x = -1;
       }
       break;
 
     case Expose:
+      addRepaint(&damage, (XRectangle){e.xexpose.x, e.xexpose.y, e.xexpose.width, e.xexpose.height},
+                 width, height);
       break;
 
     case ButtonRelease:
+      if ((drawing || p > 0) && !t_text)
+        latencyInput(latencyTool(shape, drawing), e.xbutton.time);
       rect[p].x = e.xbutton.x;
       rect[p].y = e.xbutton.y;
       switch (shape)
@@ -1593,9 +6714,23 @@ int main()
         if (drawing)
         {
           drawing = 0;
-          XCopyArea(d, undoStack[undoLevel], w, gc, 0, 0, width, height, 0, 0);
-          smoothPath(&path, SMOOTHING_LEVEL);
-          drawPath(d, w, gc, &path);
+          // The preview segments only exist on the window: repaint their
+          // area from the layers once the final stroke is committed
+          XRectangle area = pathBounds(&path, thickness);
+          ShapeFit fit;
+          if (e.xbutton.time - holdStart >= SNAP_HOLD_MS && fitStroke(&path, &fit) != FIT_NONE)
+          {
+            ShapeGeometry g;
+            buildShapeFit(&g, &fit, roundedRect);
+            drawGeometry(d, layers.annotations, gc, &g);
+            area = unionRect(area, geometryBounds(&g, thickness), width, height);
+          }
+          else
+          {
+            smoothPath(&path, SMOOTHING_LEVEL);
+            drawPath(d, layers.annotations, gc, &path);
+          }
+          addDamage(&damage, area, width, height);
           undoLevel = (undoLevel >= UNDO_MAX - 1) ? 0 : ++undoLevel;
           maxUndo = (maxUndo >= UNDO_MAX) ? UNDO_MAX : ++maxUndo;
           maxRedo = 0;
@@ -1604,9 +6739,11 @@ int main()
         break;
 
       case 'b':
+      case 'x':
         if (drawing)
         {
           drawing = 0;
+          addDamage(&damage, flushBrushStamps(d, &layers, gc, &settings, blurBackend, shape, &frame.brushStamps, width, height), width, height);
           undoLevel = (undoLevel >= UNDO_MAX - 1) ? 0 : ++undoLevel;
           maxUndo = (maxUndo >= UNDO_MAX) ? UNDO_MAX : ++maxUndo;
           maxRedo = 0;
@@ -1614,12 +6751,22 @@ int main()
         }
         break;
 
+      case 'B':
+      case 'X':
+        hideShapePreview(&damage, &previewBox, width, height);
+        // The scene must be current before it is read
+        composeDamagePresented(d, &layers, &damage, &presenter, &preview);
+        addDamage(&damage, redactDrag(d, &layers, gc, &settings, blurBackend, shape, rect[0].x, rect[0].y, rect[1].x,
+                                      rect[1].y, width, height),
+                  width, height);
+        undoLevel = (undoLevel >= UNDO_MAX - 1) ? 0 : undoLevel + 1;
+        maxUndo = (maxUndo >= UNDO_MAX) ? UNDO_MAX : maxUndo + 1;
+        maxRedo = 0;
+        redoLevel = 0;
+        break;
+
       case 'c':
-        if (pointPreDraw.x >= 0 && pointPreDraw.y >= 0)
-        {
-          drawCircle(d, w, gcPreDraw, rect[0].x, rect[0].y, abs(pointPreDraw.x - rect[0].x));
-        }
-        XCopyArea(d, w, undoStack[undoLevel], gc, 0, 0, width, height, 0, 0);
+        hideShapePreview(&damage, &previewBox, width, height);
         undoLevel = (undoLevel >= UNDO_MAX - 1) ? 0 : ++undoLevel;
         maxUndo = (maxUndo >= UNDO_MAX) ? UNDO_MAX : ++maxUndo;
         if (e.xbutton.state & ShiftMask)
@@ -1640,7 +6787,7 @@ int main()
           rc.blue = (unsigned short)(((color_list[color_index] & 0xFF) * 257UL * rc.alpha) / 0xFFFF);
           Picture src = XRenderCreateSolidFill(d, &rc);
           XRenderPictFormat *fmt = XRenderFindVisualFormat(d, vinfo.visual);
-          Picture dst = XRenderCreatePicture(d, w, fmt, 0, NULL);
+          Picture dst = XRenderCreatePicture(d, layers.annotations, fmt, 0, NULL);
           XRenderComposite(d, PictOpOver, src, mask_pic, dst,
                            0, 0, 0, 0,
                            rect[0].x - (int)(r / 2), rect[0].y - (int)(r / 2), r, r);
@@ -1650,39 +6797,50 @@ int main()
           XFreePixmap(d, mask);
           XFreeGC(d, mgc);
         }
-        drawCircle(d, w, gc, rect[0].x, rect[0].y, abs(rect[1].x - rect[0].x));
+        drawCircle(d, layers.annotations, gc, rect[0].x, rect[0].y, abs(rect[1].x - rect[0].x));
+        addDamage(&damage, shapeBounds('c', rect[0].x, rect[0].y, rect[1].x, rect[1].y, thickness), width, height);
         break;
 
       case 'r':
-        if (pointPreDraw.x >= 0 && pointPreDraw.y >= 0)
-        {
-          if (roundedRect && !f_screenshot)
-            drawRoundedRetangle(d, w, gcPreDraw, rect[0].x, rect[0].y, pointPreDraw.x, pointPreDraw.y);
-          else
-            drawRetangle(d, w, gcPreDraw, rect[0].x, rect[0].y, pointPreDraw.x, pointPreDraw.y);
-        }
+        hideShapePreview(&damage, &previewBox, width, height);
         if (f_screenshot)
         {
-          // Sync display and wait for compositor to update before capture
-          XSync(d, False);
-          usleep(50000); // 50ms delay for compositor
           int clipMode = 0;
           if (f_screenshot == 2 || f_screenshot == 3)
             clipMode = 1;
           else if (f_screenshot == 4)
             clipMode = 2;
-          saveScreenshot(d, w, screen, rect[0].x, rect[0].y, rect[1].x, rect[1].y, clipMode);
+          // The scene must be current before it is read
+          composeDamagePresented(d, &layers, &damage, &presenter, &preview);
+          if (f_screenshot == 5)
+          {
+            // Text redaction uses the last redaction tool; the event loop
+            // applies it when the OCR is done
+            char tool = (prv_shape == 'x' || prv_shape == 'X') ? 'X' : 'B';
+            if (!redactOcrStart(d, &layers, &settings, tool, rect[0].x, rect[0].y, rect[1].x, rect[1].y, width,
+                                height))
+              fprintf(stderr, "zpen: text redaction failed\n");
+            addRepaint(&damage, drawSavingIndicator(d, layers.ui, gc, width, height, screenshotsPending(),
+                                                    redactionsPending()),
+                       width, height);
+          }
+          else
+          {
+            saveScreenshot(d, &layers, &settings, rect[0].x, rect[0].y, rect[1].x, rect[1].y, clipMode);
+            addRepaint(&damage, drawSavingIndicator(d, layers.ui, gc, width, height, screenshotsPending(),
+                                                    redactionsPending()),
+                       width, height);
+          }
           XSetForeground(d, gcPreDraw, guideColor(color));
           shape = prv_shape;
           setShapeCursor(d, w, &cursor, shape);
           if (f_screenshot == 2 || f_screenshot == 4)
           {
-            bye(d, w, color_index, shape, thickness, font_size, dashed);
+            bye(d, w, color_index, shape, thickness, font_size, dashed, &settings);
           }
         }
         else
         {
-          XCopyArea(d, w, undoStack[undoLevel], gc, 0, 0, width, height, 0, 0);
           undoLevel = (undoLevel >= UNDO_MAX - 1) ? 0 : ++undoLevel;
           maxUndo = (maxUndo >= UNDO_MAX) ? UNDO_MAX : ++maxUndo;
           maxRedo = 0;
@@ -1694,7 +6852,7 @@ int main()
             int fw = abs(rect[1].x - rect[0].x);
             int fh = abs(rect[1].y - rect[0].y);
             XRenderPictFormat *fmt = XRenderFindVisualFormat(d, vinfo.visual);
-            Picture pic = XRenderCreatePicture(d, w, fmt, 0, NULL);
+            Picture pic = XRenderCreatePicture(d, layers.annotations, fmt, 0, NULL);
             XRenderColor rc;
             rc.alpha = 0x3333;
             rc.red = (unsigned short)((((color_list[color_index] >> 16) & 0xFF) * 257UL * rc.alpha) / 0xFFFF);
@@ -1704,9 +6862,10 @@ int main()
             XRenderFreePicture(d, pic);
           }
           if (roundedRect)
-            drawRoundedRetangle(d, w, gc, rect[0].x, rect[0].y, rect[1].x, rect[1].y);
+            drawRoundedRetangle(d, layers.annotations, gc, rect[0].x, rect[0].y, rect[1].x, rect[1].y);
           else
-            drawRetangle(d, w, gc, rect[0].x, rect[0].y, rect[1].x, rect[1].y);
+            drawRetangle(d, layers.annotations, gc, rect[0].x, rect[0].y, rect[1].x, rect[1].y);
+          addDamage(&damage, shapeBounds('r', rect[0].x, rect[0].y, rect[1].x, rect[1].y, thickness), width, height);
         }
         f_screenshot = 0;
         setShapeCursor(d, w, &cursor, shape);
@@ -1717,9 +6876,9 @@ int main()
         {
           // Freehand arrow mode (Shift+draw)
           drawing = 0;
-          XCopyArea(d, undoStack[undoLevel], w, gc, 0, 0, width, height, 0, 0);
+          addDamage(&damage, pathBounds(&path, thickness + 2 * ARROW_SIZE), width, height);
           smoothPath(&path, SMOOTHING_LEVEL);
-          drawPath(d, w, gc, &path);
+          drawPath(d, layers.annotations, gc, &path);
           // Calculate arrow direction from last N samples
           if (path.count >= 2)
           {
@@ -1733,7 +6892,7 @@ int main()
               avg_dy += path.items[i + 1].y - path.items[i].y;
             }
             float angle = atan2(avg_dy, avg_dx);
-            drawArrowHead(d, w, gc, path.items[path.count - 1].x,
+            drawArrowHead(d, layers.annotations, gc, path.items[path.count - 1].x,
                           path.items[path.count - 1].y, angle, ARROW_SIZE);
           }
           undoLevel = (undoLevel >= UNDO_MAX - 1) ? 0 : ++undoLevel;
@@ -1744,145 +6903,94 @@ int main()
         else
         {
           // Straight arrow mode (normal)
-          if (pointPreDraw.x >= 0 && pointPreDraw.y >= 0)
-          {
-            drawArrow(d, w, gcPreDraw, rect[0].x, rect[0].y, pointPreDraw.x, pointPreDraw.y, ARROW_SIZE);
-          }
-          XCopyArea(d, w, undoStack[undoLevel], gc, 0, 0, width, height, 0, 0);
+          hideShapePreview(&damage, &previewBox, width, height);
           undoLevel = (undoLevel >= UNDO_MAX - 1) ? 0 : ++undoLevel;
           maxUndo = (maxUndo >= UNDO_MAX) ? UNDO_MAX : ++maxUndo;
-          drawArrow(d, w, gc, rect[0].x, rect[0].y, rect[1].x, rect[1].y, ARROW_SIZE);
+          drawArrow(d, layers.annotations, gc, rect[0].x, rect[0].y, rect[1].x, rect[1].y, ARROW_SIZE);
+          addDamage(&damage, shapeBounds('a', rect[0].x, rect[0].y, rect[1].x, rect[1].y, thickness), width, height);
         }
         break;
 
       case 'l':
-        if (pointPreDraw.x >= 0 && pointPreDraw.y >= 0)
-        {
-          drawLine(d, w, gcPreDraw, rect[0].x, rect[0].y, pointPreDraw.x, pointPreDraw.y);
-        }
-        XCopyArea(d, w, undoStack[undoLevel], gc, 0, 0, width, height, 0, 0);
+        hideShapePreview(&damage, &previewBox, width, height);
         undoLevel = (undoLevel >= UNDO_MAX - 1) ? 0 : ++undoLevel;
         maxUndo = (maxUndo >= UNDO_MAX) ? UNDO_MAX : ++maxUndo;
-        drawLine(d, w, gc, rect[0].x, rect[0].y, rect[1].x, rect[1].y);
+        drawLine(d, layers.annotations, gc, rect[0].x, rect[0].y, rect[1].x, rect[1].y);
+        addDamage(&damage, shapeBounds('l', rect[0].x, rect[0].y, rect[1].x, rect[1].y, thickness), width, height);
         break;
 
       case '{':
-        if (pointPreDraw.x >= 0 && pointPreDraw.y >= 0)
-        {
-          drawBrace(d, w, gcPreDraw, rect[0].x, rect[0].y, pointPreDraw.x, pointPreDraw.y);
-        }
-        XCopyArea(d, w, undoStack[undoLevel], gc, 0, 0, width, height, 0, 0);
+        hideShapePreview(&damage, &previewBox, width, height);
         undoLevel = (undoLevel >= UNDO_MAX - 1) ? 0 : ++undoLevel;
         maxUndo = (maxUndo >= UNDO_MAX) ? UNDO_MAX : ++maxUndo;
-        drawBrace(d, w, gc, rect[0].x, rect[0].y, rect[1].x, rect[1].y);
+        drawBrace(d, layers.annotations, gc, rect[0].x, rect[0].y, rect[1].x, rect[1].y);
+        addDamage(&damage, shapeBounds('{', rect[0].x, rect[0].y, rect[1].x, rect[1].y, thickness), width, height);
         break;
 
       case '[':
-        if (pointPreDraw.x >= 0 && pointPreDraw.y >= 0)
-        {
-          drawBracket(d, w, gcPreDraw, rect[0].x, rect[0].y, pointPreDraw.x, pointPreDraw.y);
-        }
-        XCopyArea(d, w, undoStack[undoLevel], gc, 0, 0, width, height, 0, 0);
+        hideShapePreview(&damage, &previewBox, width, height);
         undoLevel = (undoLevel >= UNDO_MAX - 1) ? 0 : ++undoLevel;
         maxUndo = (maxUndo >= UNDO_MAX) ? UNDO_MAX : ++maxUndo;
-        drawBracket(d, w, gc, rect[0].x, rect[0].y, rect[1].x, rect[1].y);
+        drawBracket(d, layers.annotations, gc, rect[0].x, rect[0].y, rect[1].x, rect[1].y);
+        addDamage(&damage, shapeBounds('[', rect[0].x, rect[0].y, rect[1].x, rect[1].y, thickness), width, height);
         break;
       }
       p = 0;
-      pointPreDraw.x = -1;
-      pointPreDraw.y = -1;
       break;
 
     case MotionNotify:
-      if (pointPreDraw.x >= 0 && pointPreDraw.y >= 0)
-      {
-        switch (shape)
-        {
-        case 'c':
-          drawCircle(d, w, gcPreDraw, rect[0].x, rect[0].y, abs(pointPreDraw.x - rect[0].x));
-          break;
-        case 'r':
-          if (roundedRect && !f_screenshot)
-            drawRoundedRetangle(d, w, gcPreDraw, rect[0].x, rect[0].y, pointPreDraw.x, pointPreDraw.y);
-          else
-            drawRetangle(d, w, gcPreDraw, rect[0].x, rect[0].y, pointPreDraw.x, pointPreDraw.y);
-          break;
-        case 'a':
-          if (!drawing)
-            drawArrow(d, w, gcPreDraw, rect[0].x, rect[0].y, pointPreDraw.x, pointPreDraw.y, ARROW_SIZE);
-          break;
-        case 'l':
-          drawLine(d, w, gcPreDraw, rect[0].x, rect[0].y, pointPreDraw.x, pointPreDraw.y);
-          break;
-        case '{':
-          drawBrace(d, w, gcPreDraw, rect[0].x, rect[0].y, pointPreDraw.x, pointPreDraw.y);
-          break;
-        case '[':
-          drawBracket(d, w, gcPreDraw, rect[0].x, rect[0].y, pointPreDraw.x, pointPreDraw.y);
-          break;
-        }
-      }
-      pointPreDraw.x = e.xmotion.x;
-      pointPreDraw.y = e.xmotion.y;
+      // Only record the motion here; it is drawn on the next frame tick
       switch (shape)
       {
-      case 'a':
+      case 'p':
         if (drawing)
         {
           addPoint(&path, e.xmotion.x, e.xmotion.y);
-          if (path.count > 1)
+          if (abs(e.xmotion.x - holdAnchor.x) > SNAP_HOLD_SLOP ||
+              abs(e.xmotion.y - holdAnchor.y) > SNAP_HOLD_SLOP)
           {
-            XDrawLine(d, w, gcPreDraw,
-                      path.items[path.count - 2].x, path.items[path.count - 2].y,
-                      path.items[path.count - 1].x, path.items[path.count - 1].y);
+            holdAnchor.x = e.xmotion.x;
+            holdAnchor.y = e.xmotion.y;
+            holdStart = e.xmotion.time;
           }
-          break;
+          latencyInput(LAT_PEN, e.xmotion.time);
+          frame.pending = 1;
         }
-        drawArrow(d, w, gcPreDraw, rect[0].x, rect[0].y, pointPreDraw.x, pointPreDraw.y, ARROW_SIZE);
         break;
-      case 'p':
+      case 'b':
+      case 'x':
         if (drawing)
         {
-          addPoint(&path, e.xmotion.x, e.xmotion.y);
-          if (path.count > 1)
-          {
-            XDrawLine(d, w, gcPreDraw,
-                      path.items[path.count - 2].x, path.items[path.count - 2].y,
-                      path.items[path.count - 1].x, path.items[path.count - 1].y);
-          }
+          addBrushSegment(&frame.brushStamps, &settings, shape, frame.brushLast, (Point){e.xmotion.x, e.xmotion.y});
+          frame.brushLast = (Point){e.xmotion.x, e.xmotion.y};
+          latencyInput(LAT_BLUR, e.xmotion.time);
+          frame.pending = 1;
         }
         break;
-      case 'c':
-        drawCircle(d, w, gcPreDraw, rect[0].x, rect[0].y, abs(pointPreDraw.x - rect[0].x));
-        break;
-      case 'r':
-        if (roundedRect && !f_screenshot)
-          drawRoundedRetangle(d, w, gcPreDraw, rect[0].x, rect[0].y, pointPreDraw.x, pointPreDraw.y);
-        else
-          drawRetangle(d, w, gcPreDraw, rect[0].x, rect[0].y, pointPreDraw.x, pointPreDraw.y);
-        break;
-      case 'l':
-        drawLine(d, w, gcPreDraw, rect[0].x, rect[0].y, pointPreDraw.x, pointPreDraw.y);
-        break;
-      case '{':
-        drawBrace(d, w, gcPreDraw, rect[0].x, rect[0].y, pointPreDraw.x, pointPreDraw.y);
-        break;
-      case '[':
-        drawBracket(d, w, gcPreDraw, rect[0].x, rect[0].y, pointPreDraw.x, pointPreDraw.y);
-        break;
-      case 'b':
+      default:
         if (drawing)
         {
-          blurArea(d, w, gc, e.xmotion.x, e.xmotion.y, BLUR_BRUSH, BLUR_RADIUS, width, height);
+          // Freehand arrow
+          addPoint(&path, e.xmotion.x, e.xmotion.y);
+          latencyInput(LAT_PEN, e.xmotion.time);
+          frame.pending = 1;
+        }
+        else if (p > 0)
+        {
+          frame.pointer.x = e.xmotion.x;
+          frame.pointer.y = e.xmotion.y;
+          latencyInput(LAT_SHAPE, e.xmotion.time);
+          frame.pending = 1;
         }
         break;
       }
-      XFlush(d);
       break;
 
     case KeyPress:
+      trafficMark(d, t_text ? TRAFFIC_TEXT : TRAFFIC_KEYS);
       if (t_text)
       {
+        latencyInput(LAT_TEXT, e.xkey.time);
         KeySym key = NoSymbol;
         Status status;
         char ltext[64];
@@ -1916,31 +7024,39 @@ int main()
             new_size = font_size - 2;
           if (new_size >= 8 && new_size <= 72 && new_size != font_size)
           {
+            XRectangle line = unionRect(textLineBounds(y_text, font_size, width),
+                                        textLineBounds(y_text, new_size, width), width, height);
             font_size = new_size;
             if (fontset)
               XFreeFontSet(d, fontset);
             fontset = createTextFontSet(d, font_size);
-            XClearWindow(d, w);
-            XCopyArea(d, textPixMap, w, gc, 0, 0, width, height, 0, 0);
-            drawTextWithCursor(d, w, gc, fontset, x_text, y_text, text, font_size);
-            XFlush(d);
+            XCopyArea(d, textPixMap, layers.annotations, gc, line.x, line.y, line.width, line.height, line.x, line.y);
+            clearLayer(d, layers.uiPic, textCursor);
+            addDamage(&damage, textCursor, width, height);
+            textCursor = drawTextWithCursor(d, layers.annotations, layers.ui, gc, fontset, x_text, y_text, text, font_size);
+            addDamage(&damage, textCursor, width, height);
+            addDamage(&damage, line, width, height);
           }
         }
         else if (key == XK_Return || e.xkey.keycode == 104)
         {
           // Enter: commit current line and start new line below
           // First redraw without cursor to commit clean text
-          XClearWindow(d, w);
-          XCopyArea(d, textPixMap, w, gc, 0, 0, width, height, 0, 0);
+          XRectangle line = unionRect(textLineBounds(y_text, font_size, width), (XRectangle){0, 0, 0, 0}, width, height);
+          XCopyArea(d, textPixMap, layers.annotations, gc, line.x, line.y, line.width, line.height, line.x, line.y);
           if (fontset && strlen(text) > 0)
-            XmbDrawString(d, w, fontset, gc, x_text, y_text, text, strlen(text));
-          XCopyArea(d, w, textPixMap, gc, 0, 0, width, height, 0, 0);
+            XmbDrawString(d, layers.annotations, fontset, gc, x_text, y_text, text, strlen(text));
+          XCopyArea(d, layers.annotations, textPixMap, gc, line.x, line.y, line.width, line.height, line.x, line.y);
+          addDamage(&damage, line, width, height);
           l_text = 0;
           *text = 0x00;
           y_text += font_size + 6; // Move to next line (line height scales with font size)
           // Draw cursor on new line
-          drawTextWithCursor(d, w, gc, fontset, x_text, y_text, text, font_size);
-          XFlush(d);
+          clearLayer(d, layers.uiPic, textCursor);
+          addDamage(&damage, textCursor, width, height);
+          textCursor = drawTextWithCursor(d, layers.annotations, layers.ui, gc, fontset, x_text, y_text, text, font_size);
+          addDamage(&damage, textCursor, width, height);
+          addDamage(&damage, textLineBounds(y_text, font_size, width), width, height);
         }
         else if (key == XK_BackSpace && l_text > 0)
         {
@@ -1950,30 +7066,40 @@ int main()
           if (l_text > 0)
             l_text--; // Remove the start byte
           text[l_text] = 0x00;
-          XClearWindow(d, w);
-          XCopyArea(d, textPixMap, w, gc, 0, 0, width, height, 0, 0);
-          drawTextWithCursor(d, w, gc, fontset, x_text, y_text, text, font_size);
-          XFlush(d);
+          XRectangle line = unionRect(textLineBounds(y_text, font_size, width), (XRectangle){0, 0, 0, 0}, width, height);
+          XCopyArea(d, textPixMap, layers.annotations, gc, line.x, line.y, line.width, line.height, line.x, line.y);
+          clearLayer(d, layers.uiPic, textCursor);
+          addDamage(&damage, textCursor, width, height);
+          textCursor = drawTextWithCursor(d, layers.annotations, layers.ui, gc, fontset, x_text, y_text, text, font_size);
+          addDamage(&damage, textCursor, width, height);
+          addDamage(&damage, line, width, height);
         }
         else if (n > 0 && (unsigned char)ltext[0] >= 32 && l_text + n < sizeof(text) - 1 &&
                  !(e.xkey.state & ControlMask))
         {
           // Accept any printable character (including UTF-8 multi-byte)
           // First clear previous cursor
-          XClearWindow(d, w);
-          XCopyArea(d, textPixMap, w, gc, 0, 0, width, height, 0, 0);
+          XRectangle line = unionRect(textLineBounds(y_text, font_size, width), (XRectangle){0, 0, 0, 0}, width, height);
+          XCopyArea(d, textPixMap, layers.annotations, gc, line.x, line.y, line.width, line.height, line.x, line.y);
           strcat(text, ltext);
           l_text += n;
-          drawTextWithCursor(d, w, gc, fontset, x_text, y_text, text, font_size);
-          XFlush(d);
+          clearLayer(d, layers.uiPic, textCursor);
+          addDamage(&damage, textCursor, width, height);
+          textCursor = drawTextWithCursor(d, layers.annotations, layers.ui, gc, fontset, x_text, y_text, text, font_size);
+          addDamage(&damage, textCursor, width, height);
+          addDamage(&damage, line, width, height);
         }
         if (e.xkey.keycode == 0x09)
         {
           // ESC: commit text and return to previous drawing tool
-          XClearWindow(d, w);
-          XCopyArea(d, textPixMap, w, gc, 0, 0, width, height, 0, 0);
+          clearLayer(d, layers.uiPic, textCursor);
+          addDamage(&damage, textCursor, width, height);
+          textCursor.width = 0;
+          XRectangle line = unionRect(textLineBounds(y_text, font_size, width), (XRectangle){0, 0, 0, 0}, width, height);
+          XCopyArea(d, textPixMap, layers.annotations, gc, line.x, line.y, line.width, line.height, line.x, line.y);
           if (fontset && strlen(text) > 0)
-            XmbDrawString(d, w, fontset, gc, x_text, y_text, text, strlen(text));
+            XmbDrawString(d, layers.annotations, fontset, gc, x_text, y_text, text, strlen(text));
+          addDamage(&damage, line, width, height);
           t_text = 0;
           l_text = 0;
           *text = 0x00;
@@ -1994,7 +7120,22 @@ int main()
           if (skipNextEsc)
             skipNextEsc = 0;
           else
-            bye(d, w, color_index, shape, thickness, font_size, dashed);
+            bye(d, w, color_index, shape, thickness, font_size, dashed, &settings);
+        }
+        else if (ksym == XK_F12)
+        {
+          latencyDump();
+          trafficDump();
+        }
+        else if (klen == 1 && (kbuf[0] == 'h' || kbuf[0] == 'H'))
+        {
+          // h: hide/show annotations, H: hide/show palette and text cursor
+          if (kbuf[0] == 'h')
+            layers.showAnnotations = !layers.showAnnotations;
+          else
+            layers.showUi = !layers.showUi;
+          preview.overlay = layers.showUi ? layers.uiPic : None;
+          addRepaint(&damage, (XRectangle){0, 0, width, height}, width, height);
         }
         else if (e.xkey.keycode == 50)
         {
@@ -2017,8 +7158,10 @@ int main()
         else if ((e.xkey.state & ControlMask) && e.xkey.keycode == 55)
         {
           // Ctrl+V: paste clipboard image at mouse cursor
-          XCopyArea(d, w, undoStack[undoLevel], gc, 0, 0, width, height, 0, 0);
-          pasteClipboard(d, w, gc, &vinfo, e.xbutton.x, e.xbutton.y, width, height);
+          layersRevealAnnotations(&layers, &damage, width, height);
+          XCopyArea(d, layers.annotations, undoStack[undoLevel], gc, 0, 0, width, height, 0, 0);
+          pasteClipboard(d, layers.annotations, gc, &vinfo, e.xbutton.x, e.xbutton.y, width, height);
+          addDamage(&damage, (XRectangle){0, 0, width, height}, width, height);
           undoLevel = (undoLevel >= UNDO_MAX - 1) ? 0 : ++undoLevel;
           maxUndo = (maxUndo >= UNDO_MAX) ? UNDO_MAX : ++maxUndo;
           maxRedo = 0;
@@ -2069,7 +7212,15 @@ int main()
         }
         else if (klen == 1 && (kbuf[0] == 'b' || kbuf[0] == 'B'))
         {
-          shape = 'b';
+          // b: blur brush, again for the rectangle variant and back
+          shape = (shape == 'b') ? 'B' : 'b';
+          p = 0;
+          setShapeCursor(d, w, &cursor, shape);
+        }
+        else if (klen == 1 && (kbuf[0] == 'x' || kbuf[0] == 'X'))
+        {
+          // x: pixelate brush, again for the rectangle variant and back
+          shape = (shape == 'x') ? 'X' : 'x';
           p = 0;
           setShapeCursor(d, w, &cursor, shape);
         }
@@ -2091,7 +7242,7 @@ int main()
           setCursor(d, w, &cursor, XC_icon);
           XSetForeground(d, gcPreDraw, guideColor(0xFFFFFFFF));
         }
-        else if (klen == 1 && (kbuf[0] == 'o' || kbuf[0] == 'O'))
+        else if (klen == 1 && kbuf[0] && strchr("oOeE", kbuf[0]))
         {
           if (!hasTesseract())
           {
@@ -2102,7 +7253,7 @@ int main()
             prv_shape = shape;
             shape = 'r';
             p = 0;
-            f_screenshot = 4;
+            f_screenshot = tolower((unsigned char)kbuf[0]) == 'e' ? 5 : 4;
             setCursor(d, w, &cursor, XC_icon);
             XSetForeground(d, gcPreDraw, guideColor(0xFFFFFFFF));
           }
@@ -2110,35 +7261,75 @@ int main()
         else if (e.xkey.keycode == 28)
         {
           prv_shape = shape;
-          XCopyArea(d, w, textPixMap, gc, 0, 0, width, height, 0, 0);
+          layersRevealAnnotations(&layers, &damage, width, height);
+          XCopyArea(d, layers.annotations, textPixMap, gc, 0, 0, width, height, 0, 0);
           setCursor(d, w, &cursor, XC_xterm);
           x_text = e.xbutton.x;
           y_text = e.xbutton.y;
           t_text = 1;
           // Draw initial cursor
-          drawTextWithCursor(d, w, gc, fontset, x_text, y_text, text, font_size);
-          XFlush(d);
+          clearLayer(d, layers.uiPic, textCursor);
+          addDamage(&damage, textCursor, width, height);
+          textCursor = drawTextWithCursor(d, layers.annotations, layers.ui, gc, fontset, x_text, y_text, text, font_size);
+          addDamage(&damage, textCursor, width, height);
+          addDamage(&damage, textLineBounds(y_text, font_size, width), width, height);
         }
         else if (e.xkey.keycode == 65)
         {
           color_index = (color_index + 1) % MAX_COLORS;
           XSetForeground(d, gc, color_list[color_index]);
           XSetForeground(d, gcPreDraw, guideColor(color_list[color_index]));
-          drawColorPalette(d, w, gc, width, height, color_list, color_index, thickness, dashed);
+          addRepaint(&damage, drawColorPalette(d, layers.ui, gc, width, height, color_list, color_index, thickness, dashed),
+                     width, height);
         }
         else if (e.xkey.keycode == 114)
         {
           color_index = (color_index + 1) % MAX_COLORS;
           XSetForeground(d, gc, color_list[color_index]);
           XSetForeground(d, gcPreDraw, guideColor(color_list[color_index]));
-          drawColorPalette(d, w, gc, width, height, color_list, color_index, thickness, dashed);
+          addRepaint(&damage, drawColorPalette(d, layers.ui, gc, width, height, color_list, color_index, thickness, dashed),
+                     width, height);
         }
         else if (e.xkey.keycode == 113)
         {
           color_index = (color_index - 1 + MAX_COLORS) % MAX_COLORS;
           XSetForeground(d, gc, color_list[color_index]);
           XSetForeground(d, gcPreDraw, guideColor(color_list[color_index]));
-          drawColorPalette(d, w, gc, width, height, color_list, color_index, thickness, dashed);
+          addRepaint(&damage, drawColorPalette(d, layers.ui, gc, width, height, color_list, color_index, thickness, dashed),
+                     width, height);
+        }
+        else if ((shape == 'b' || shape == 'B') &&
+                 (e.xkey.keycode == 21 || e.xkey.keycode == 86 ||
+                  e.xkey.keycode == 20 || e.xkey.keycode == 82 ||
+                  e.xkey.keycode == 19 || e.xkey.keycode == 90))
+        {
+          // +/-/0 with the blur tools: stronger, weaker or default blur;
+          // with Ctrl: bigger, smaller or default brush
+          int up = e.xkey.keycode == 21 || e.xkey.keycode == 86;
+          int reset = e.xkey.keycode == 19 || e.xkey.keycode == 90;
+          if (e.xkey.state & ControlMask)
+          {
+            int size = reset ? BLUR_BRUSH : settings.blurBrush + (up ? 4 : -4);
+            settings.blurBrush = size < BLUR_BRUSH_MIN ? BLUR_BRUSH_MIN : size > BLUR_BRUSH_MAX ? BLUR_BRUSH_MAX : size;
+          }
+          else
+          {
+            int radius = reset ? BLUR_RADIUS : settings.blurRadius + (up ? 1 : -1);
+            settings.blurRadius = radius < 1 ? 1 : radius > BLUR_RADIUS_MAX ? BLUR_RADIUS_MAX : radius;
+          }
+        }
+        else if ((shape == 'x' || shape == 'X') &&
+                 (e.xkey.keycode == 21 || e.xkey.keycode == 86 ||
+                  e.xkey.keycode == 20 || e.xkey.keycode == 82 ||
+                  e.xkey.keycode == 19 || e.xkey.keycode == 90))
+        {
+          // +/-/0 with a pixelate tool: coarser, finer or default cells
+          if (e.xkey.keycode == 19 || e.xkey.keycode == 90)
+            settings.pixelBlock = PIXELATE_BLOCK;
+          else if (e.xkey.keycode == 21 || e.xkey.keycode == 86)
+            settings.pixelBlock = settings.pixelBlock + 2 > 64 ? 64 : settings.pixelBlock + 2;
+          else
+            settings.pixelBlock = settings.pixelBlock - 2 < 4 ? 4 : settings.pixelBlock - 2;
         }
         else if (e.xkey.keycode == 21 || e.xkey.keycode == 86)
         {
@@ -2148,7 +7339,8 @@ int main()
             thickness++;
             XSetLineAttributes(d, gc, thickness, dashed ? LineOnOffDash : LineSolid, CapRound, JoinMiter);
             XSetLineAttributes(d, gcPreDraw, thickness > 2 ? thickness - 2 : 1, LineDoubleDash, CapRound, JoinMiter);
-            drawColorPalette(d, w, gc, width, height, color_list, color_index, thickness, dashed);
+            addRepaint(&damage, drawColorPalette(d, layers.ui, gc, width, height, color_list, color_index, thickness, dashed),
+                       width, height);
           }
         }
         else if (e.xkey.keycode == 20 || e.xkey.keycode == 82)
@@ -2159,7 +7351,8 @@ int main()
             thickness--;
             XSetLineAttributes(d, gc, thickness, dashed ? LineOnOffDash : LineSolid, CapRound, JoinMiter);
             XSetLineAttributes(d, gcPreDraw, thickness > 2 ? thickness - 2 : 1, LineDoubleDash, CapRound, JoinMiter);
-            drawColorPalette(d, w, gc, width, height, color_list, color_index, thickness, dashed);
+            addRepaint(&damage, drawColorPalette(d, layers.ui, gc, width, height, color_list, color_index, thickness, dashed),
+                       width, height);
           }
         }
         else if (e.xkey.keycode == 19 || e.xkey.keycode == 90)
@@ -2168,7 +7361,8 @@ int main()
           thickness = THICKNESS;
           XSetLineAttributes(d, gc, thickness, dashed ? LineOnOffDash : LineSolid, CapRound, JoinMiter);
           XSetLineAttributes(d, gcPreDraw, thickness > 2 ? thickness - 2 : 1, LineDoubleDash, CapRound, JoinMiter);
-          drawColorPalette(d, w, gc, width, height, color_list, color_index, thickness, dashed);
+          addRepaint(&damage, drawColorPalette(d, layers.ui, gc, width, height, color_list, color_index, thickness, dashed),
+                     width, height);
         }
         else if (e.xkey.keycode == 63 || (e.xkey.keycode == 17 && (e.xkey.state & ShiftMask)))
         {
@@ -2177,7 +7371,8 @@ int main()
           if (dashed)
             XSetDashes(d, gc, 0, dash_pattern, 2);
           XSetLineAttributes(d, gc, thickness, dashed ? LineOnOffDash : LineSolid, CapRound, JoinMiter);
-          drawColorPalette(d, w, gc, width, height, color_list, color_index, thickness, dashed);
+          addRepaint(&damage, drawColorPalette(d, layers.ui, gc, width, height, color_list, color_index, thickness, dashed),
+                     width, height);
         }
         else if (klen == 1 && (kbuf[0] == '[' || kbuf[0] == ']'))
         {
@@ -2194,21 +7389,28 @@ int main()
           stepCnt++;
           if (stepCnt >= 9)
             stepCnt = 0;
-          XDrawString(d, w, gc, e.xbutton.x, e.xbutton.y, s, strlen(s));
+          XDrawString(d, layers.annotations, gc, e.xbutton.x, e.xbutton.y, s, strlen(s));
+          XRectangle label = {e.xbutton.x - 2, e.xbutton.y - 24, 48, 32};
           if (ft)
+          {
+            label = (XRectangle){e.xbutton.x - 2, e.xbutton.y - ft->ascent - 2,
+                                 XTextWidth(ft, s, strlen(s)) + 4, ft->ascent + ft->descent + 4};
             XFreeFont(d, ft);
+          }
+          addDamage(&damage, label, width, height);
         }
         else if ((e.xkey.state & ControlMask) && (e.xkey.state & ShiftMask) &&
                  (e.xkey.keycode == 52 || e.xkey.keycode == 29))
         {
           if (maxRedo > 0)
           {
-            XCopyArea(d, w, undoStack[undoLevel], gc, 0, 0, width, height, 0, 0);
+            XCopyArea(d, layers.annotations, undoStack[undoLevel], gc, 0, 0, width, height, 0, 0);
             undoLevel = (undoLevel >= UNDO_MAX - 1) ? 0 : undoLevel + 1;
             maxUndo = (maxUndo >= UNDO_MAX) ? UNDO_MAX : maxUndo + 1;
             redoLevel = (redoLevel == 0) ? UNDO_MAX - 1 : redoLevel - 1;
             maxRedo = (maxRedo < 0) ? 0 : maxRedo - 1;
-            XCopyArea(d, redoStack[redoLevel], w, gc, 0, 0, width, height, 0, 0);
+            XCopyArea(d, redoStack[redoLevel], layers.annotations, gc, 0, 0, width, height, 0, 0);
+            addRepaint(&damage, (XRectangle){0, 0, width, height}, width, height);
           }
         }
         else if (e.xkey.keycode == 30 ||
@@ -2217,12 +7419,13 @@ int main()
         {
           if (maxUndo > 0)
           {
-            XCopyArea(d, w, redoStack[redoLevel], gc, 0, 0, width, height, 0, 0);
+            XCopyArea(d, layers.annotations, redoStack[redoLevel], gc, 0, 0, width, height, 0, 0);
             redoLevel = (redoLevel >= UNDO_MAX - 1) ? 0 : redoLevel + 1;
             maxRedo = (maxRedo >= UNDO_MAX) ? UNDO_MAX : maxRedo + 1;
             undoLevel = (undoLevel == 0) ? UNDO_MAX - 1 : undoLevel - 1;
             maxUndo = (maxUndo < 0) ? 0 : maxUndo - 1;
-            XCopyArea(d, undoStack[undoLevel], w, gc, 0, 0, width, height, 0, 0);
+            XCopyArea(d, undoStack[undoLevel], layers.annotations, gc, 0, 0, width, height, 0, 0);
+            addRepaint(&damage, (XRectangle){0, 0, width, height}, width, height);
           }
         }
       }
@@ -2239,7 +7442,7 @@ int main()
           if (skipNextEsc)
             skipNextEsc = 0;
           else
-            bye(d, w, color_index, shape, thickness, font_size, dashed);
+            bye(d, w, color_index, shape, thickness, font_size, dashed, &settings);
         }
         else if (e.xkey.keycode == 50)
         {
@@ -2261,6 +7464,123 @@ int main()
         */
       }
       break;
+
+    case GenericEvent:
+      if (presenterHandleEvent(d, &presenter, &preview, &e))
+        break;
+#ifdef HAVE_XI2
+      if (e.xcookie.extension == xiOpcode && XGetEventData(d, &e.xcookie))
+      {
+        XIDeviceEvent *te = (XIDeviceEvent *)e.xcookie.data;
+        int tx = (int)te->event_x;
+        int ty = (int)te->event_y;
+        TouchStroke *t = findTouch(touches, te->detail);
+        if (e.xcookie.evtype == XI_TouchBegin && !t && !t_text && !f_screenshot)
+        {
+          for (int i = 0; i < MAX_TOUCHES && !t; i++)
+          {
+            if (!touches[i].active)
+              t = &touches[i];
+          }
+          if (t)
+          {
+            trafficMark(d, trafficTool(shape, 0, 0));
+            layersRevealAnnotations(&layers, &damage, width, height);
+            if (activeTouches == 0 && (shape == 'b' || shape == 'x'))
+              XCopyArea(d, layers.annotations, undoStack[undoLevel], gc, 0, 0, width, height, 0, 0);
+            activeTouches++;
+            t->active = 1;
+            t->id = te->detail;
+            t->path.count = 0;
+            addPoint(&t->path, tx, ty);
+            t->start.x = tx;
+            t->start.y = ty;
+            t->last.x = -1;
+            t->last.y = -1;
+            t->box = (XRectangle){0, 0, 0, 0};
+            t->drawn = 1;
+            t->dirty = 0;
+            if (shape == 'b' || shape == 'x')
+            {
+              // The scene must be current before it is read
+              composeDamagePresented(d, &layers, &damage, &presenter, &preview);
+              addDamage(&damage, brushStamp(d, &layers, gc, &settings, blurBackend, shape, tx, ty, width, height),
+                        width, height);
+            }
+          }
+        }
+        else if (e.xcookie.evtype == XI_TouchUpdate && t)
+        {
+          if (shape == 'p')
+            addPoint(&t->path, tx, ty);
+          else if (shape == 'b' || shape == 'x')
+            addBrushSegment(&frame.brushStamps, &settings, shape,
+                            t->last.x >= 0 ? (Point){t->last.x, t->last.y} : (Point){t->start.x, t->start.y},
+                            (Point){tx, ty});
+          t->last.x = tx;
+          t->last.y = ty;
+          t->dirty = 1;
+          latencyInput(latencyTool(shape, 0), te->time);
+          frame.pending = 1;
+        }
+        else if (e.xcookie.evtype == XI_TouchEnd && t)
+        {
+          latencyInput(latencyTool(shape, 0), te->time);
+          t->active = 0;
+          activeTouches--;
+          // Brushes are applied in place, so a multi-finger brush session
+          // shares one undo entry that is closed when its last finger lifts.
+          int brush = shape == 'b' || shape == 'x';
+          if (!brush || activeTouches == 0)
+          {
+            addDamage(&damage, flushBrushStamps(d, &layers, gc, &settings, blurBackend, shape, &frame.brushStamps, width, height), width, height);
+            if (!brush)
+            {
+              XCopyArea(d, layers.annotations, undoStack[undoLevel], gc, 0, 0, width, height, 0, 0);
+              if (shape == 'B' || shape == 'X')
+              {
+                // The scene must be current before it is read
+                composeDamagePresented(d, &layers, &damage, &presenter, &preview);
+                addRepaint(&damage, t->box, width, height);
+                addDamage(&damage, redactDrag(d, &layers, gc, &settings, blurBackend, shape, t->start.x, t->start.y,
+                                              tx, ty, width, height),
+                          width, height);
+              }
+              else if (shape == 'p')
+              {
+                addPoint(&t->path, tx, ty);
+                addDamage(&damage, pathBounds(&t->path, thickness), width, height);
+                smoothPath(&t->path, SMOOTHING_LEVEL);
+                drawPath(d, layers.annotations, gc, &t->path);
+              }
+              else
+              {
+                drawShape(d, layers.annotations, gc, shape, roundedRect, t->start.x, t->start.y, tx, ty);
+                addRepaint(&damage, t->box, width, height);
+                addDamage(&damage, shapeBounds(shape, t->start.x, t->start.y, tx, ty, thickness), width, height);
+              }
+            }
+            undoLevel = (undoLevel >= UNDO_MAX - 1) ? 0 : undoLevel + 1;
+            maxUndo = (maxUndo >= UNDO_MAX) ? UNDO_MAX : maxUndo + 1;
+            maxRedo = 0;
+            redoLevel = 0;
+            if (activeTouches > 0)
+            {
+              // Repainting the damage may wipe parts of the other touches'
+              // previews: redraw them in full on the next frame
+              for (int i = 0; i < MAX_TOUCHES; i++)
+              {
+                touches[i].drawn = 0;
+                touches[i].dirty = touches[i].active;
+              }
+              frame.pending = 1;
+            }
+          }
+        }
+        XFreeEventData(d, &e.xcookie);
+      }
+#endif
+      break;
     }
   }
   return 0;